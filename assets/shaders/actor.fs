@@ -14,6 +14,8 @@ uniform bool use_alpha_colour;
 
 out vec4 frag_colour;
 
+#include "uniform_blocks.inc"
+
 #include "light.finc"
 
 void main() {
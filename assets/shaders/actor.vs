@@ -1,25 +1,44 @@
 #version 300 es
 
+// PRESKINNED is defined for animated meshes, which skin.vs has already skinned for this
+// frame. Their positions, normals and tangents are plain floats.
 layout(location = 0) in vec3 v_position;
+#ifdef PRESKINNED
 layout(location = 1) in vec3 v_normal;
 layout(location = 2) in vec3 v_tangent;
+#else
+layout(location = 1) in vec2 v_normal;
+layout(location = 2) in vec2 v_tangent;
+#endif
 layout(location = 3) in vec2 v_tex_coords;
 layout(location = 4) in vec2 v_ao_tex_coords;
-layout(location = 5) in ivec4 v_bone_ids;
-layout(location = 6) in vec4 v_bone_weights;
 
-uniform mat4 mvp;
 uniform mat4 model;
 
+#include "uniform_blocks.inc"
+
 #include "light.vinc"
 
 #include "skinning.vinc"
 
-void main() {
-  SkinnedResult skinned =
-      MaybeSkinPositionNormalTangent(v_position, v_normal, v_tangent, v_bone_ids, v_bone_weights);
+#include "vertex_format.vinc"
 
-  gl_Position = mvp * skinned.position;
+// Must match shadow.vs in the depth prepass.
+invariant gl_Position;
+
+void main() {
+  SkinnedResult skinned;
+#ifdef PRESKINNED
+  skinned.position = vec4(v_position, 1.0f);
+  skinned.normal = v_normal;
+  skinned.tangent = v_tangent;
+#else
+  skinned.position = vec4(DecodePosition(v_position), 1.0f);
+  skinned.normal = DecodeOctahedral(v_normal);
+  skinned.tangent = DecodeOctahedral(v_tangent);
+#endif
+
+  gl_Position = view_projection * (model * skinned.position);
 
   vec3 tangent = normalize((model * vec4(skinned.tangent, 0.0)).xyz);
   vec3 bitangent = normalize((model * vec4(cross(skinned.normal, skinned.tangent), 0.0f)).xyz);
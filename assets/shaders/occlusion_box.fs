@@ -0,0 +1,11 @@
+#version 300 es
+
+precision mediump float;
+
+// Colour writes are disabled. Only whether any fragment passes the depth test matters.
+
+out vec4 frag_colour;
+
+void main() {
+  frag_colour = vec4(1.0);
+}
@@ -0,0 +1,13 @@
+#version 300 es
+
+// Corners of a unit cube, stretched to the box being tested.
+layout(location = 0) in vec3 v_position;
+
+uniform vec3 box_min;
+uniform vec3 box_max;
+
+#include "uniform_blocks.inc"
+
+void main() {
+  gl_Position = view_projection * vec4(mix(box_min, box_max, v_position), 1.0f);
+}
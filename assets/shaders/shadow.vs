@@ -1,14 +1,26 @@
 #version 300 es
 
+// PRESKINNED is defined for animated meshes, which skin.vs has already skinned for this
+// frame. Their positions are plain floats.
 layout(location = 0) in vec3 v_position;
-layout(location = 5) in ivec4 v_bone_ids;
-layout(location = 6) in vec4 v_bone_weights;
 
-// This is mvp from light space.
-uniform mat4 mvp;
+uniform mat4 model;
 
-#include "skinning.vinc"
+#include "uniform_blocks.inc"
+
+#include "vertex_format.vinc"
+
+// Also used for the depth prepass, which needs exactly the same depth as actor.vs.
+invariant gl_Position;
 
 void main() {
-  gl_Position = mvp * MaybeSkinPosition(v_position, v_bone_ids, v_bone_weights);
+#ifdef PRESKINNED
+  vec3 position = v_position;
+#else
+  vec3 position = DecodePosition(v_position);
+#endif
+
+  // view_projection is from light space in the shadow pass. This must be computed the same way
+  // as in actor.vs.
+  gl_Position = view_projection * (model * vec4(position, 1.0f));
 }
@@ -0,0 +1,8 @@
+#version 300 es
+
+precision mediump float;
+
+// Rasteriser discard is on when skinning, so this never runs, but a program needs one.
+
+void main() {
+}
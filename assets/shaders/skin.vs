@@ -0,0 +1,32 @@
+#version 300 es
+
+// Skins a mesh's vertices once per frame, for the shadow and geometry passes to draw as
+// PRESKINNED geometry. Outputs are captured with transform feedback (see
+// kTransformFeedbackVaryings in shaders.cpp), so nothing is rasterised.
+
+layout(location = 0) in vec3 v_position;
+layout(location = 1) in vec2 v_normal;
+layout(location = 2) in vec2 v_tangent;
+layout(location = 5) in uvec4 v_bone_ids;
+layout(location = 6) in vec4 v_bone_weights;
+
+#include "skinning.vinc"
+
+#include "vertex_format.vinc"
+
+// In model space (before the model transform).
+out vec3 skinned_position;
+out vec3 skinned_normal;
+out vec3 skinned_tangent;
+
+void main() {
+  SkinnedResult skinned =
+      MaybeSkinPositionNormalTangent(DecodePosition(v_position), DecodeOctahedral(v_normal),
+                                     DecodeOctahedral(v_tangent), v_bone_ids, v_bone_weights);
+
+  skinned_position = skinned.position.xyz;
+  skinned_normal = skinned.normal;
+  skinned_tangent = skinned.tangent;
+
+  gl_Position = skinned.position;
+}
@@ -10,6 +10,8 @@ uniform bool is_edge;
 
 out vec4 frag_colour;
 
+#include "uniform_blocks.inc"
+
 #include "light.finc"
 
 void main() {
@@ -2,15 +2,16 @@
 
 layout(location = 0) in vec3 v_position;
 
-uniform mat4 mvp;
-
 // How much texture coordinates should be scaled by. 1.0 means 1m = 1 repeat of the texture.
 uniform float texture_scale;
 
+#include "uniform_blocks.inc"
+
 #include "light.vinc"
 
 void main() {
-  gl_Position = mvp * vec4(v_position, 1.0);
+  // Terrain vertices are already in world space.
+  gl_Position = view_projection * vec4(v_position, 1.0);
 
   set_tex_coords(texture_scale * vec2(v_position.x, v_position.y));
 
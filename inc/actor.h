@@ -23,9 +23,40 @@
 
 class ActorTemplate;
 
+// Vertex buffer an animated actor's mesh is skinned into every frame (see
+// RenderPass::kSkinning), and a VAO to draw it with. Made on first use.
+struct SkinnedVertices {
+  // Mesh the buffer was made for.
+  std::string mesh_file_name;
+
+  GLuint buffer = 0;
+  GLuint vao = 0;
+
+  SkinnedVertices() {}
+  SkinnedVertices(const SkinnedVertices& other) = delete;
+  SkinnedVertices& operator=(const SkinnedVertices& other) = delete;
+  ~SkinnedVertices();
+
+  // Deletes the buffer and VAO.
+  void Clear();
+};
+
+// What an actor looks like at one point in time. The simulation makes these, and the renderer
+// draws actors from them (see Simulation).
+struct ActorSnapshot {
+  glm::vec3 position = glm::vec3(0.0f);
+  float rotation_rad = 0.0f;
+  float scale = 1.0f;
+  std::vector<glm::mat4> bone_transforms;
+};
+
 // An actor is a logical instantiation of an ActorTemplate, with sampled
 // variant selections and state in world. The template must outlive any
 // actor instantiated from it.
+//
+// Update() and the setters change the simulation state, which the renderer never reads. It
+// renders the state applied by ApplySnapshots() instead, so the two can run on different
+// threads. Props are all made by the constructor, so the tree of actors doesn't change after that.
 class Actor : public Renderable {
  public:
   enum class ActorState {
@@ -47,12 +78,31 @@ class Actor : public Renderable {
   }
 
   void Render(RenderContext* context) override;
-  void Render(RenderContext* context, const glm::mat4& model);
+
+  // Also extends bounds with the world space bounds of the meshes rendered.
+  void Render(RenderContext* context, const glm::mat4& model, std::optional<BoundingBox>* bounds);
+
+  // An actor is static if neither it nor any of its props are animated.
+  bool IsStatic() const override;
+
+  // Bounds of the actor and its props when they were last rendered, moved to where the actor is
+  // now. Animated meshes are padded, since their bounds are of the bind pose.
+  std::optional<BoundingBox> WorldBounds() const override;
 
   void SetPosition(const glm::vec3& new_position) { position_ = new_position; }
   void SetRotationRad(float rotation_rad) { rotation_rad_ = rotation_rad; }
   void SetScale(float new_scale) { scale_ = new_scale; }
 
+  // Simulation side. Writes the state of this actor and its props (depth first) to
+  // (*snapshots)[index] onwards, and returns the index after them. Reuses what is already
+  // in snapshots.
+  std::size_t WriteSnapshots(std::vector<ActorSnapshot>* snapshots, std::size_t index) const;
+
+  // Render side. Renders this actor and its props as they were t (0 to 1) of the way from one set
+  // of snapshots (written by WriteSnapshots()) to another. Returns the index after them.
+  std::size_t ApplySnapshots(const std::vector<ActorSnapshot>& from, const std::vector<ActorSnapshot>& to,
+                             std::size_t index, float t);
+
   int NumGroups() const { return variant_selections_.size(); }
   int VariantSelection(int group) const { return variant_selections_[group]; }
 
@@ -66,7 +116,18 @@ class Actor : public Renderable {
     return &props_;
   }
 
-  const std::vector<glm::mat4>& BoneTransforms() const { return bone_transforms_; }
+  // As rendered.
+  const std::vector<glm::mat4>& BoneTransforms() const { return rendered_.bone_transforms; }
+
+  // Textures for the current variant selections.
+  const TextureSet& Textures() const { return textures_; }
+
+  SkinnedVertices* GetSkinnedVertices() {
+    if (!skinned_vertices_) {
+      skinned_vertices_ = std::make_unique<SkinnedVertices>();
+    }
+    return skinned_vertices_.get();
+  }
 
   Actor(const Actor& other) = delete;
   Actor(Actor&& actor) = default;
@@ -81,6 +142,8 @@ class Actor : public Renderable {
   // AnimationSpecs for the current variant selections.
   std::map<std::string, std::vector<const data::AnimationSpec*>> animation_specs_;
 
+  TextureSet textures_;
+
   // Variant selection for each group.
   std::vector<int> variant_selections_;
 
@@ -100,6 +163,19 @@ class Actor : public Renderable {
   // These are from bone space to model space (no pre-multiplied bind pose inverse),
   // and no virtual bind bone.
   std::vector<glm::mat4> bone_transforms_;
+
+  // Everything above is simulation state. This is what is rendered.
+  ActorSnapshot rendered_;
+
+  // Behind a pointer so actors can still be moved.
+  std::unique_ptr<SkinnedVertices> skinned_vertices_;
+
+  glm::mat4 ModelMatrix() const;
+
+  // See WorldBounds(). Inverse of the model matrix when they were recorded, so we can move them
+  // with the actor.
+  std::optional<BoundingBox> bounds_;
+  glm::mat4 bounds_model_inverse_;
 };
 
 // Corresponds to an actor .fbs file, which corresponds to an actor XML.
@@ -120,12 +196,20 @@ class ActorTemplate {
     return actor_data_->groups()->Get(group)->variants()->Get(variant)->name()->str();
   }
 
-  // Render a variant from a group. Props are ignored.
-  void Render(Renderable::RenderContext* context, Actor* actor, const glm::mat4& model) const;
+  // Adds the props of the actor's variants. Called once when the actor is made.
+  void MakeProps(Actor* actor) const;
+
+  // Render a variant from a group. Props are ignored. Extends bounds with the world space bounds
+  // of the mesh.
+  void Render(Renderable::RenderContext* context, Actor* actor, const glm::mat4& model,
+              std::optional<BoundingBox>* bounds) const;
 
   // Get all the animation paths with the actor's current selection of variants.
   std::map<std::string, std::vector<const data::AnimationSpec*>> AnimationSpecs(const Actor* actor) const;
 
+  // Get the textures with the actor's current selection of variants.
+  TextureSet Textures(const Actor* actor) const;
+
   // Get all the joint bind pose inverses with the actor's current selection of variants.
   std::vector<glm::mat4> BindPoseInverses(const Actor* actor) const;
 
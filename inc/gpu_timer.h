@@ -0,0 +1,60 @@
+#ifndef GPU_TIMER_H
+#define GPU_TIMER_H
+
+#include <array>
+#include <optional>
+
+#include "platform_includes.h"
+
+// Measures how long the GPU takes to execute the commands between Begin() and End(), with
+// EXT_disjoint_timer_query. Results arrive a few frames late, so queries are kept in a ring,
+// and we never wait for them.
+//
+// Only one timer can be running at a time (timer queries can't be nested).
+class GpuTimer {
+ public:
+  GpuTimer();
+  ~GpuTimer();
+
+  GpuTimer(const GpuTimer& other) = delete;
+  GpuTimer& operator=(const GpuTimer& other) = delete;
+
+  // Whether the GL implementation has timer queries.
+  static bool Supported();
+
+  // Does nothing if all queries are still waiting for results (the GPU is far behind).
+  void Begin();
+  void End();
+
+  // Most recent result in milliseconds, if there is one.
+  std::optional<float> LatestMs();
+
+  // Whether anything happened that makes timings meaningless (eg. a GPU frequency change) since
+  // the last call. Reading the flag resets it, so this must only be called once per frame for
+  // all timers, and results in flight of all of them discarded if it's set.
+  static bool Disjoint();
+
+  // Results of queries ended so far will be dropped.
+  void DiscardPending() { num_to_discard_ = num_pending_; }
+
+ private:
+  // Reads results of finished queries.
+  void Poll();
+
+  static constexpr int kNumQueries = 4;
+
+  std::array<GLuint, kNumQueries> queries_;
+
+  // Queries ended and waiting for results, oldest first in the ring from next_to_read_.
+  int next_to_read_ = 0;
+  int num_pending_ = 0;
+
+  // How many of the oldest pending queries have unreliable results.
+  int num_to_discard_ = 0;
+
+  bool running_ = false;
+
+  std::optional<float> latest_ms_;
+};
+
+#endif // GPU_TIMER_H
@@ -9,5 +9,11 @@
   GraphicsSetting(UseAOMap, use_ao_map, bool, true, SDLK_a) \
   GraphicsSetting(UseShadows, use_shadows, bool, true, SDLK_s) \
   GraphicsSetting(UseSMAA, use_smaa, bool, true, SDLK_f) \
+  GraphicsSetting(UseMeshLod, use_mesh_lod, bool, true, SDLK_m) \
+  GraphicsSetting(UseDynamicResolution, use_dynamic_resolution, bool, true, SDLK_r) \
+  GraphicsSetting(UseQualityGovernor, use_quality_governor, bool, true, SDLK_t) \
+  GraphicsSetting(UseOcclusionCulling, use_occlusion_culling, bool, true, SDLK_o) \
+  GraphicsSetting(UseDepthPrepass, use_depth_prepass, bool, false, SDLK_d) \
+  GraphicsSetting(UseFrontToBackSort, use_front_to_back_sort, bool, true, SDLK_b) \
 
 #endif // GRAPHICS_SETTINGS_H
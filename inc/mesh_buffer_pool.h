@@ -0,0 +1,87 @@
+#ifndef MESH_BUFFER_POOL_H
+#define MESH_BUFFER_POOL_H
+
+#include <cstdint>
+#include <vector>
+
+#include "platform_includes.h"
+#include "renderer.h"
+
+// Where a mesh lives in the pool.
+struct MeshAllocation {
+  // Shared by all meshes in the same page.
+  GLuint vao;
+  GLuint vertex_buffer;
+  GLenum index_type;
+
+  // Offset of the mesh's first index in the page's index buffer in bytes (for glDrawElements()).
+  std::size_t index_offset;
+  std::size_t index_size;
+
+  // Where the mesh is in the page's buffers (in vertices and indices).
+  std::size_t page;
+  std::size_t first_vertex;
+  std::size_t num_vertices;
+  std::size_t first_index;
+  std::size_t num_indices;
+};
+
+// Mesh vertex and index data is suballocated from a few large buffers, instead of every mesh
+// having its own buffers and VAO.
+//
+// Buffers are allocated in pages. Each page has a vertex buffer for one vertex format, an
+// index buffer, and a VAO binding them, so meshes with the same vertex format in the same page
+// are drawn with the same VAO, only at different index offsets.
+//
+// We don't have glDrawElementsBaseVertex() in GLES 3.0 / WebGL 2, so indices are rebased to
+// where the mesh's vertices are in the page when uploaded. Pages have at most 65536 vertices
+// so indices stay 16-bit. Meshes with more vertices get a page of their own with 32-bit
+// indices.
+//
+// Meshes are never freed, since the mesh cache never evicts, so pages are filled front to back.
+class MeshBufferPool {
+ public:
+  static MeshBufferPool* GetInstance() {
+    static MeshBufferPool instance;
+    return &instance;
+  }
+
+  struct VertexFormat {
+    // Bytes between the starts of consecutive vertices.
+    std::size_t stride;
+    std::vector<Renderer::AttribSpec> attribs;
+
+    bool operator==(const VertexFormat& other) const;
+  };
+
+  // Uploads a mesh. vertices has num_vertices vertices in the format, and indices are relative
+  // to the mesh.
+  MeshAllocation Allocate(const VertexFormat& format, const void* vertices, std::size_t num_vertices,
+                          const std::vector<uint32_t>& indices);
+
+ private:
+  MeshBufferPool() {}
+
+  struct Page {
+    VertexFormat format;
+    GLenum index_type;
+    std::size_t index_size;
+
+    GLuint vao;
+    GLuint vertex_buffer;
+    GLuint index_buffer;
+
+    // Capacity, and how much is used from the start of the buffers (in vertices and indices).
+    std::size_t vertex_capacity;
+    std::size_t index_capacity;
+    std::size_t used_vertices = 0;
+    std::size_t used_indices = 0;
+  };
+
+  // Makes a page with room for at least num_vertices and num_indices. Returns its index.
+  std::size_t MakePage(const VertexFormat& format, std::size_t num_vertices, std::size_t num_indices);
+
+  std::vector<Page> pages_;
+};
+
+#endif // MESH_BUFFER_POOL_H
@@ -0,0 +1,72 @@
+#ifndef OCCLUSION_CULLER_H
+#define OCCLUSION_CULLER_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "platform_includes.h"
+#include "shaders.h"
+
+class Renderable;
+struct BoundingBox;
+
+// Hardware occlusion culling of dynamic renderables (units), mostly for those behind buildings.
+//
+// After the geometry pass (which draws static occluders first), the bounding box of each dynamic
+// renderable is drawn (without writing colour or depth) with a GL_ANY_SAMPLES_PASSED_CONSERVATIVE
+// query against its depth buffer. We never wait for results. They are read in a later frame, and
+// until then the last known visibility is used. Renderables found invisible are skipped in the
+// geometry pass. They are still skinned and drawn in the shadow pass when shadows are on, since
+// their shadows may be visible. A renderable that comes into view appears a frame or two late,
+// which is hard to notice at unit sizes.
+class OcclusionCuller {
+ public:
+  // Requires a GL context.
+  OcclusionCuller();
+  ~OcclusionCuller();
+
+  OcclusionCuller(const OcclusionCuller& other) = delete;
+  OcclusionCuller& operator=(const OcclusionCuller& other) = delete;
+
+  // Reads results of queries that have finished.
+  void CollectResults();
+
+  // Renderables not tested yet are visible.
+  bool IsVisible(const Renderable* renderable) const {
+    auto it = occludees_.find(renderable);
+    return it == occludees_.end() || it->second.visible;
+  }
+
+  // Tests bounding boxes against the depth buffer of the bound framebuffer. Must be called with
+  // the camera's per-pass uniforms, and depth testing enabled. Renderables still waiting for a
+  // result are not tested again.
+  void IssueQueries(const std::vector<std::pair<Renderable*, BoundingBox>>& occludees,
+                    const glm::vec3& eye_pos, uint64_t frame);
+
+  // Forgets all results (when culling is turned off).
+  void Clear();
+
+  // Renderables found invisible by their latest result.
+  std::size_t NumCulled() const;
+
+ private:
+  struct Occludee {
+    GLuint query = 0;
+    bool pending = false;
+    bool visible = true;
+    uint64_t last_tested_frame = 0;
+  };
+
+  std::unordered_map<const Renderable*, Occludee> occludees_;
+
+  ShaderProgram* shader_;
+
+  // Unit cube.
+  GLuint box_vao_;
+};
+
+#endif // OCCLUSION_CULLER_H
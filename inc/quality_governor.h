@@ -0,0 +1,130 @@
+#ifndef QUALITY_GOVERNOR_H
+#define QUALITY_GOVERNOR_H
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+// Parts of the frame timed separately on the GPU (timer queries can't be nested, so these don't
+// overlap).
+enum class TimedPass {
+  kSkinning,
+  kShadow,
+  kDepthPrepass,
+  kGeometry,
+
+  // SMAA and upscaling.
+  kPostProcess,
+
+  kUi,
+};
+
+constexpr int kNumTimedPasses = 6;
+
+// Graphics settings the governor can turn off, in the order they are turned off.
+enum class QualityFeature {
+  kSpecularHighlight,
+  kAOMap,
+  kNormalMap,
+  kSMAA,
+  kShadows,
+};
+
+constexpr int kNumQualityFeatures = 5;
+
+using QualityFeatureMask = uint32_t;
+
+constexpr QualityFeatureMask QualityFeatureBit(QualityFeature feature) {
+  return QualityFeatureMask(1) << static_cast<int>(feature);
+}
+
+// Decides when controllers (dynamic resolution, the quality governor) may step quality up when
+// there are no GPU timings. With vsync, CPU frame time never goes much below the budget, so the
+// only way to find out if there is headroom is to step up and see. Steps up are held off for a
+// while after any change, and a step down soon after a step up means the probe failed, so the
+// hold is doubled (up to a limit). The hold is back to the minimum after a probe that held.
+class StepUpProbe {
+ public:
+  StepUpProbe();
+
+  bool CanProbe(uint64_t frame) const { return (frame - last_change_frame_) >= hold_frames_; }
+
+  // Called once per frame, after all controllers have run.
+  void Update(uint64_t frame, bool stepped_down, bool stepped_up);
+
+ private:
+  uint64_t hold_frames_;
+  uint64_t last_change_frame_ = 0;
+  std::optional<uint64_t> last_step_up_frame_;
+};
+
+// Picks a quality tier to keep frame time within a budget. Tier N has the last N features of
+// QualityFeature enabled (as far as the user's settings allow), so stepping down a tier turns
+// off one more feature, cheapest looking first.
+//
+// The cost of each feature is measured as it runs: features with a pass of their own (shadows,
+// SMAA) cost what their pass costs, and the material features cost the difference in geometry
+// pass time when they are turned on or off.
+//
+// Tiers are stepped down when frames are over budget, and up when there is enough headroom for
+// the next feature's measured cost. There is a gap between the two, and a tier we stepped down
+// from isn't retried for a while, so we don't keep flipping between two tiers. Without GPU
+// timings, headroom can't be measured, and the caller decides when to step up (see StepUpProbe).
+class QualityGovernor {
+ public:
+  static constexpr int kMaxTier = kNumQualityFeatures;
+
+  explicit QualityGovernor(float budget_ms);
+
+  // Called once per frame. frame_time_ms is smoothed, and gpu_time is whether it is measured on the
+  // GPU (otherwise it is CPU frame time, which includes waiting for vsync). pass_ms has the GPU
+  // time of passes that ran this frame, if known. user_features are the features the user has
+  // enabled. can_step_down / can_step_up are for other controllers (dynamic resolution) that
+  // should be used first. Without GPU time, a tier is stepped up whenever can_step_up is set.
+  void Update(uint64_t frame, float frame_time_ms, bool gpu_time,
+              const std::array<std::optional<float>, kNumTimedPasses>& pass_ms,
+              QualityFeatureMask user_features, bool can_step_down, bool can_step_up);
+
+  // Back to the highest tier (when the governor is turned off).
+  void Reset();
+
+  bool Allows(QualityFeature feature) const {
+    return static_cast<int>(feature) >= (kNumQualityFeatures - tier_);
+  }
+
+  int Tier() const { return tier_; }
+
+  // For the UI. Tier, smoothed pass times, and feature costs.
+  std::string TierSummary() const;
+  std::string PassTimesSummary() const;
+  std::string FeatureCostsSummary() const;
+
+ private:
+  // The feature turned off when stepping down from the tier.
+  static QualityFeature FeatureOfTier(int tier) {
+    return static_cast<QualityFeature>(kNumQualityFeatures - tier);
+  }
+
+  // toggled_feature is the feature turned on or off (ignoring features the user has turned off).
+  void SetTier(uint64_t frame, int tier, QualityFeature toggled_feature);
+
+  float budget_ms_;
+  int tier_ = kMaxTier;
+
+  std::array<std::optional<float>, kNumTimedPasses> smoothed_pass_ms_;
+  std::array<std::optional<float>, kNumQualityFeatures> feature_cost_ms_;
+
+  uint64_t last_change_frame_ = 0;
+
+  // Geometry pass time before the last tier change, for measuring the cost of the feature
+  // toggled.
+  std::optional<float> geometry_ms_before_change_;
+  std::optional<QualityFeature> changed_feature_;
+
+  // The last tier we stepped down from, and when. We don't step back up to it for a while.
+  int too_slow_tier_ = kMaxTier + 1;
+  uint64_t too_slow_frame_ = 0;
+};
+
+#endif // QUALITY_GOVERNOR_H
@@ -1,17 +1,22 @@
 #ifndef RENDERER_H
 #define RENDERER_H
 
+#include <array>
 #include <chrono>
 #include <cstdint>
 #include <initializer_list>
 #include <memory>
 #include <optional>
+#include <vector>
 
 #include "flatbuffers/flatbuffers.h"
 #include "glm/gtc/matrix_transform.hpp"
 #include "glm/mat4x4.hpp"
 
+#include "gpu_timer.h"
 #include "graphics_settings.h"
+#include "occlusion_culler.h"
+#include "quality_governor.h"
 #include "shaders.h"
 #include "utils.h"
 
@@ -20,6 +25,7 @@ namespace {
 constexpr uint64_t kRenderStatsPeriod = 100000;
 }
 
+// Shadow map of all casters (the cached static casters, with dynamic casters drawn on top).
 constexpr GLint kShadowTextureUnit = 8;
 
 // For Geometry pass output, SMAA pass input.
@@ -32,9 +38,20 @@ constexpr GLint kSmaaSearchTexTextureUnit = 12;
 constexpr GLint kSmaaWeightsTextureUnit = 13;
 
 enum class RenderPass {
-  // Shadow map pass. Depth testing enabled, MVP is ortho from light position.
+  // Animated meshes are skinned into per-actor vertex buffers with transform feedback. Nothing is
+  // rasterised. The other passes draw the skinned vertices as if they were static.
+  kSkinning,
+
+  // Shadow map pass. Depth testing enabled, MVP is ortho from light position. Static renderables
+  // are rendered into a cached shadow map, which is copied into the shadow map every frame before
+  // dynamic renderables are drawn on top (see Renderable::IsStatic()).
   kShadow,
 
+  // Optional depth only pass before the geometry pass (see UseDepthPrepass()), with the shadow
+  // pass' programs and the geometry pass' MVP. The geometry pass then only shades the front
+  // surface at each pixel. Renderables that don't draw in this pass are depth tested as usual.
+  kDepthPrepass,
+
   // Standard geometry pass with normal MVP, depth testing enabled, alpha blending disabled.
   kGeometry,
 
@@ -44,6 +61,24 @@ enum class RenderPass {
   kUi,
 };
 
+// Axis aligned bounding box.
+struct BoundingBox {
+  glm::vec3 min;
+  glm::vec3 max;
+
+  // Smallest box containing this box transformed.
+  BoundingBox Transformed(const glm::mat4& transform) const;
+
+  void Extend(const BoundingBox& other) {
+    min = glm::min(min, other.min);
+    max = glm::max(max, other.max);
+  }
+
+  bool Contains(const glm::vec3& point) const {
+    return glm::all(glm::greaterThanEqual(point, min)) && glm::all(glm::lessThanEqual(point, max));
+  }
+};
+
 class Renderable {
  public:
   struct RenderContext {
@@ -62,16 +97,37 @@ class Renderable {
     int32_t window_width;
     int32_t window_height;
 
+    // Size in pixels of 1 unit at distance 1 from the eye, for LOD selection. This is
+    // the camera's even during the shadow pass, so shadows match what is on screen.
+    // Infinity forces full detail.
+    float lod_scale;
+
     RenderPass pass;
 
+    // Shader features enabled by graphics settings. Renderables drop the ones their
+    // materials can't use (see TextureManager::SupportedShaderFeatures()), and add
+    // kShaderFeatureSkinning / kShaderFeaturePreskinned themselves.
+    ShaderFeatures shader_features;
+
+    // Graphics settings for this frame. These are the user's settings, with some features turned
+    // off if the quality governor is on.
     #define GraphicsSetting(upper, lower, type, default, toggle_key) type lower;
     GRAPHICS_SETTINGS
     #undef GraphicsSetting
   };
   virtual void Render(RenderContext* context) = 0;
 
-  // Set light_pos, eye_pos, shadow texture, and light transform uniforms from render_context_.
-  static void SetLightParams(RenderContext* context, ShaderProgram* shader);
+  // Static renderables don't move or animate, so their shadows are rendered into a cached shadow
+  // map that is only re-rendered when the set of static renderables or the light changes.
+  virtual bool IsStatic() const { return false; }
+
+  // World space bounds, for occlusion culling. Only dynamic renderables with bounds are culled.
+  // Static renderables are drawn first as occluders.
+  virtual std::optional<BoundingBox> WorldBounds() const { return std::nullopt; }
+
+  // Point the shadow map sampler at its texture unit. This only needs to be done once
+  // per program. Everything else about the light comes from the PerFrame uniform block.
+  static void SetShadowTextureUnits(ShaderProgram* shader);
 };
 
 class TestTriangleRenderable : public Renderable {
@@ -87,17 +143,18 @@ class TestTriangleRenderable : public Renderable {
 
 class Renderer {
  public:
-  struct VBOSpec {
-    // Pointer to data to buffer.
-    const void* data;
-
-    // Size of the buffer in bytes.
-    std::size_t data_size;
-
+  struct AttribSpec {
     int attrib_location;
     GLenum gl_type;
     int components_per_element;
 
+    // If true, integer types are converted to normalised floats. Otherwise they are
+    // passed to the shader as integers.
+    bool normalised = false;
+
+    // Offset from the start of each vertex in bytes.
+    std::size_t offset = 0;
+
     bool IsInt() const {
       static constexpr GLenum kIntTypes[] = {
         GL_BYTE, GL_UNSIGNED_BYTE, GL_SHORT, GL_UNSIGNED_SHORT, GL_INT, GL_UNSIGNED_INT
@@ -109,39 +166,76 @@ class Renderer {
       }
       return false;
     }
+  };
+
+  struct VBOSpec {
+    // Pointer to data to buffer.
+    const void* data;
+
+    // Size of the buffer in bytes.
+    std::size_t data_size;
+
+    // Bytes between the starts of consecutive vertices. 0 means tightly packed.
+    std::size_t stride;
+
+    // Attributes in the buffer. There is one unless the buffer is interleaved.
+    std::vector<AttribSpec> attribs;
 
     template <typename T>
     VBOSpec(const std::vector<T>& buf, int attrib_location_i, GLenum gl_type_i, int components_per_element_i) 
-        : data(buf.data()), data_size(buf.size() * sizeof(T)), attrib_location(attrib_location_i), gl_type(gl_type_i),
-          components_per_element(components_per_element_i) {}
+        : data(buf.data()), data_size(buf.size() * sizeof(T)), stride(0),
+          attribs({AttribSpec{attrib_location_i, gl_type_i, components_per_element_i}}) {}
 
     template <typename T>
     VBOSpec(const flatbuffers::Vector<T>& buf, int attrib_location_i, GLenum gl_type_i, int components_per_element_i) 
-        : data(buf.data()), data_size(static_cast<std::size_t>(buf.size()) * sizeof(T)), attrib_location(attrib_location_i),
-          gl_type(gl_type_i), components_per_element(components_per_element_i) {}
+        : data(buf.data()), data_size(static_cast<std::size_t>(buf.size()) * sizeof(T)), stride(0),
+          attribs({AttribSpec{attrib_location_i, gl_type_i, components_per_element_i}}) {}
+
+    // Interleaved buffer with multiple attributes.
+    template <typename T>
+    VBOSpec(const flatbuffers::Vector<T>& buf, std::size_t stride_i, const std::vector<AttribSpec>& attribs_i)
+        : data(buf.data()), data_size(static_cast<std::size_t>(buf.size()) * sizeof(T)), stride(stride_i),
+          attribs(attribs_i) {}
   };
 
   struct EBOSpec {
     // Pointer to data to buffer.
     const void* data;
 
-    // Size of the buffer in elements.
+    // Size of the buffer in bytes.
     std::size_t data_size;
 
-    // Size per element.
+    // Size per element in bytes (1, 2, or 4).
     std::size_t element_size;
 
+    // Index type to use with glDrawElements.
+    GLenum GLType() const {
+      switch (element_size) {
+        case 1: return GL_UNSIGNED_BYTE;
+        case 2: return GL_UNSIGNED_SHORT;
+        default: return GL_UNSIGNED_INT;
+      }
+    }
+
     template <typename T>
     EBOSpec(const std::vector<T>& buf) 
-        : data(buf.data()), data_size(buf.size() * sizeof(T)) {}
+        : data(buf.data()), data_size(buf.size() * sizeof(T)), element_size(sizeof(T)) {
+      static_assert(sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4);
+    }
 
     template <typename T>
     EBOSpec(const flatbuffers::Vector<T>& buf) 
-        : data(buf.data()), data_size(static_cast<std::size_t>(buf.size()) * sizeof(T)) {}
+        : data(buf.data()), data_size(static_cast<std::size_t>(buf.size()) * sizeof(T)), element_size(sizeof(T)) {
+      static_assert(sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4);
+    }
   };
 
   Renderer();
 
+  // Compiles all shader variants the current graphics settings may need, so they don't
+  // have to be compiled while rendering. Requires a GL context.
+  void WarmUpShaders();
+
   void RenderFrame(const std::vector<Renderable*>& renderables);
 
   void AddAzimuth(float diff_az) {
@@ -176,46 +270,94 @@ class Renderer {
 
   void MoveCamera(int32_t x_from, int32_t y_from, int32_t x_to, int32_t y_to);
 
+  // Static shadows are re-rendered automatically when static renderables are added or removed, but
+  // not when they are moved. This must be called after moving a static renderable.
+  void InvalidateStaticShadows() { static_shadows_valid_ = false; }
+
   static GLuint MakeVAO(std::initializer_list<VBOSpec> vbos, const EBOSpec& ebo);
 
   static void UseVAO(GLuint vao);
 
+  // Points attributes at the buffer bound to GL_ARRAY_BUFFER, in the bound VAO.
+  static void SetUpAttribs(const std::vector<AttribSpec>& attribs, std::size_t stride);
+
   // UnProject screen coordinates to a point on the z=0 plane.
   glm::vec3 UnProjectToXY(int32_t x, int32_t y);
 
+  // Fraction of the window size the scene is rendered at (see UseDynamicResolution()).
+  float RenderScale() const { return render_scale_; }
+
+  // Picks the features rendered when UseQualityGovernor() is on.
+  const QualityGovernor& GetQualityGovernor() const { return quality_governor_; }
+
+  // Renderables skipped by occlusion culling (see UseOcclusionCulling()).
+  std::size_t NumOcclusionCulled() const { return occlusion_culler_ ? occlusion_culler_->NumCulled() : 0; }
+
+  // These are the user's settings. Features may still be turned off by the quality governor.
   #define GraphicsSetting(upper, lower, type, default, toggle_key) \
-    void Toggle ## upper() { render_context_.lower ^= 0x1; }
+    void Toggle ## upper() { settings_.lower ^= 0x1; }
     GRAPHICS_SETTINGS
   #undef GraphicsSetting
 
   #define GraphicsSetting(upper, lower, type, default, toggle_key) \
-    void Set ## upper(type new_val) { render_context_.lower = new_val; }
+    void Set ## upper(type new_val) { settings_.lower = new_val; }
     GRAPHICS_SETTINGS
   #undef GraphicsSetting
 
   #define GraphicsSetting(upper, lower, type, default, toggle_key) \
-    type upper() const { return render_context_.lower; }
+    type upper() const { return settings_.lower; }
     GRAPHICS_SETTINGS
   #undef GraphicsSetting
 
  private:
-  // TODO: add support for deallocating the textures.
+  // Shader features enabled by graphics settings.
+  ShaderFeatures EnabledShaderFeatures() const;
+
+  // Sets render_context_ settings from the user's, and the quality governor's tier.
+  void ApplySettings();
+
+  // Adjusts the render scale to keep smoothed_frame_time_ms_ near the target. gpu_time is
+  // whether it is measured on the GPU (otherwise it's CPU frame time, which includes waiting
+  // for vsync, so the scale only goes up when step_up_probe_ allows).
+  void UpdateRenderScale(bool gpu_time);
+
+  void BeginTimedPass(TimedPass pass);
+  void EndTimedPass(TimedPass pass);
+
+  // Owns its framebuffer object, textures and stencil buffer (move only).
   class FrameBuffer {
    public:
-    FrameBuffer(int width, int height, bool have_colour, bool have_depth);
+    FrameBuffer(int width, int height, bool have_colour, bool have_depth, bool have_stencil = false);
+    ~FrameBuffer();
     void Resize(int width, int height);
     void Bind();
 
+    // Attaches the stencil buffer of another framebuffer (which must outlive this one, and have
+    // the same size).
+    void UseStencilOf(const FrameBuffer& other);
+
+    // Copies the colour attachment (of size width x height) to the back buffer, stretched
+    // to window_width x window_height with bilinear filtering.
+    void BlitColourToBackBuffer(int width, int height, int window_width, int window_height);
+
+    // Copies the depth attachment to another framebuffer with the same size and depth format.
+    void BlitDepthTo(FrameBuffer* other, int width, int height);
+
+    // Tells the driver we don't need the contents of the attachments anymore, so tile based GPUs
+    // don't have to write them out to memory. Binds the framebuffer.
+    void Invalidate(std::initializer_list<GLenum> attachments);
+
     GLuint ColourTex() const { return *colour_tex_; }
     GLuint DepthTex() const { return *depth_tex_; }
 
-    FrameBuffer(const FrameBuffer&) = default;
-    FrameBuffer& operator=(const FrameBuffer&) = default;
+    FrameBuffer(FrameBuffer&& other);
+    FrameBuffer& operator=(FrameBuffer&& other);
 
    private:
-    GLuint fbo_;
+    GLuint fbo_ = 0;
     std::optional<GLuint> colour_tex_;
     std::optional<GLuint> depth_tex_;
+    std::optional<GLuint> stencil_rb_;
   };
 
   glm::vec3 EyePos();
@@ -226,6 +368,23 @@ class Renderer {
 
   static GLuint MakeAndUploadBuf(GLenum binding_target, const void* buf, std::size_t size);
 
+  // Contents of the uniform blocks in uniform_blocks.inc (std140 layout).
+  struct PerFrameUniforms {
+    glm::mat4 light_transform;
+    glm::vec3 light_pos;
+    float padding0;
+    glm::vec3 eye_pos;
+    float padding1;
+  };
+
+  struct PerPassUniforms {
+    glm::mat4 view_projection;
+  };
+
+  // Upload from render_context_.
+  void UploadPerFrameUniforms();
+  void UploadPerPassUniforms();
+
   Renderable::RenderContext render_context_;
 
   float eye_azimuth_;
@@ -242,15 +401,53 @@ class Renderer {
   bool first_frame_;
   SDL_Window* window_;
 
-  int last_window_width_;
-  int last_window_height_;
+  // Size the scene was last rendered at (window size times render scale).
+  int last_render_width_;
+  int last_render_height_;
+
+  // The scene is rendered at a lower resolution and upscaled when frames take too long.
+  // The scale is kept in steps of kRenderScaleStep, so we don't resize framebuffers every frame.
+  int render_scale_steps_;
+  float render_scale_;
+  float smoothed_frame_time_ms_;
+  uint64_t last_render_scale_change_frame_;
+
+  // GPU time of each pass, if timer queries are supported.
+  std::array<std::optional<GpuTimer>, kNumTimedPasses> pass_timers_;
+
+  // Passes run last frame (their timers have new results).
+  std::array<bool, kNumTimedPasses> passes_run_ = {};
 
-  // Target of the shadow map pass.
-  std::optional<FrameBuffer> shadow_fb_;
+  QualityGovernor quality_governor_;
+
+  // Shared by dynamic resolution and the quality governor, for stepping up without GPU time.
+  StepUpProbe step_up_probe_;
+
+  std::optional<OcclusionCuller> occlusion_culler_;
+
+  // What the user has chosen (see ApplySettings()).
+  struct GraphicsSettings {
+    #define GraphicsSetting(upper, lower, type, default, toggle_key) type lower = default;
+    GRAPHICS_SETTINGS
+    #undef GraphicsSetting
+  };
+  GraphicsSettings settings_;
+
+  // Targets of the shadow map pass.
+  std::optional<FrameBuffer> static_shadow_fb_;
+  std::optional<FrameBuffer> dynamic_shadow_fb_;
+
+  // What the static shadow map was last rendered with.
+  bool static_shadows_valid_;
+  std::vector<Renderable*> static_shadow_casters_;
+  glm::vec3 static_shadow_light_pos_;
 
   // Target of the geometry pass.
   std::optional<FrameBuffer> geometry_fb_;
 
+  GLuint per_frame_ubo_;
+  GLuint per_pass_ubo_;
+
   struct SMAAData {
     GLuint area_tex_;
     GLuint search_tex_;
@@ -1,9 +1,13 @@
 #ifndef SHADERS_H
 #define SHADERS_H
 
-#include <unordered_map>
+#include <algorithm>
+#include <array>
+#include <cstdint>
 #include <stdexcept>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #define GLM_ENABLE_EXPERIMENTAL
 #include "glm/ext.hpp"
@@ -13,13 +17,60 @@
 #include "platform_includes.h"
 #include "utils.h"
 
+// Binding points of the uniform blocks declared in uniform_blocks.inc. Every program that
+// declares them has them bound at link time.
+constexpr GLuint kPerFrameUniformBinding = 0;
+constexpr GLuint kPerPassUniformBinding = 1;
+
+// Optional shader features. Each is compiled in as a #define (e.g. SKINNING) instead of being
+// branched on at run time, so disabled features cost nothing. Every combination used is a
+// separate program, compiled at startup by WarmUpShaders() or on first use.
+#define SHADER_FEATURES \
+  ShaderFeature(Skinning, SKINNING) \
+  ShaderFeature(Preskinned, PRESKINNED) \
+  ShaderFeature(Lighting, LIGHTING) \
+  ShaderFeature(SpecularHighlight, SPECULAR_HIGHLIGHT) \
+  ShaderFeature(NormalMap, NORMAL_MAP) \
+  ShaderFeature(AOMap, AO_MAP) \
+  ShaderFeature(Shadows, SHADOWS) \
+
+// Bitmask of kShaderFeature*.
+using ShaderFeatures = uint32_t;
+
+enum ShaderFeatureIndex {
+  #define ShaderFeature(name, define) kShaderFeatureIndex ## name,
+  SHADER_FEATURES
+  #undef ShaderFeature
+  kNumShaderFeatures
+};
+
+#define ShaderFeature(name, define) \
+  constexpr ShaderFeatures kShaderFeature ## name = 1u << kShaderFeatureIndex ## name;
+SHADER_FEATURES
+#undef ShaderFeature
+
+constexpr ShaderFeatures kNoShaderFeatures = 0;
+constexpr ShaderFeatures kAllShaderFeatures = (1u << kNumShaderFeatures) - 1;
+
 class ShaderProgram {
  public:
   ShaderProgram(const std::string& vertex_shader_file_name,
-                const std::string& fragment_shader_file_name);
+                const std::string& fragment_shader_file_name,
+                ShaderFeatures features = kNoShaderFeatures);
+
+  // Whether Finish() would return without waiting for the driver. Always true without
+  // KHR_parallel_shader_compile.
+  bool IsReady();
+
+  // Waits for compilation and linking to complete, checks for errors, and resolves uniforms.
+  // Called on first activation if it hasn't been already.
+  void Finish();
 
   void Activate() {
     if (current_program_ != program_) {
+      if (!finished_) {
+        Finish();
+      }
       glUseProgram(program_);
       current_program_ = program_;
     }
@@ -30,100 +81,158 @@ class ShaderProgram {
   // Firefox didn't seem to get the memo, and will return an error.
   // We don't error out on uniform not found because they are often
   // optimised out.
+  // Uploads are skipped if the value hasn't changed since the last upload to this program.
   void SetUniform(const NameLiteral& name, GLint x) {
-    GLint location = GetUniformLocation(name);
+    GLint location = LocationIfChanged(name, &x, sizeof(x));
     if (location != -1) {
-      auto it = uniform_cache_1i_.find(name);
-      if (it == uniform_cache_1i_.end() || it->second != x) {
-        glUniform1i(location, x);
-        uniform_cache_1i_.insert_or_assign(name, x);
-      }
+      glUniform1i(location, x);
     }
   }
 
   void SetUniform(const NameLiteral& name, GLuint x) {
-    GLint location = GetUniformLocation(name);
+    GLint location = LocationIfChanged(name, &x, sizeof(x));
     if (location != -1) {
       glUniform1ui(location, x);
     }
   }
 
   void SetUniform(const NameLiteral& name, GLfloat x) {
-    GLint location = GetUniformLocation(name);
+    GLint location = LocationIfChanged(name, &x, sizeof(x));
     if (location != -1) {
       glUniform1f(location, x);
     }
   }
 
   void SetUniform(const NameLiteral& name, const glm::vec2& x) {
-    GLint location = GetUniformLocation(name);
+    GLint location = LocationIfChanged(name, glm::value_ptr(x), sizeof(x));
     if (location != -1) {
       glUniform2fv(location, 1, glm::value_ptr(x));
     }
   }
 
   void SetUniform(const NameLiteral& name, const glm::vec3& x) {
-    GLint location = GetUniformLocation(name);
+    GLint location = LocationIfChanged(name, glm::value_ptr(x), sizeof(x));
     if (location != -1) {
       glUniform3fv(location, 1, glm::value_ptr(x));
     }
   }
 
   void SetUniform(const NameLiteral& name, const glm::vec4& x) {
-    GLint location = GetUniformLocation(name);
+    GLint location = LocationIfChanged(name, glm::value_ptr(x), sizeof(x));
     if (location != -1) {
       glUniform4fv(location, 1, glm::value_ptr(x));
     }
   }
 
   void SetUniform(const NameLiteral& name, const glm::mat3& x) {
-    GLint location = GetUniformLocation(name);
+    GLint location = LocationIfChanged(name, glm::value_ptr(x), sizeof(x));
     if (location != -1) {
       glUniformMatrix3fv(location, 1, GL_FALSE, glm::value_ptr(x));
     }
   }
 
   void SetUniform(const NameLiteral& name, const glm::mat4& x) {
-    GLint location = GetUniformLocation(name);
+    GLint location = LocationIfChanged(name, glm::value_ptr(x), sizeof(x));
     if (location != -1) {
       glUniformMatrix4fv(location, 1, GL_FALSE, glm::value_ptr(x));
     }
   }
 
   void SetUniform(const NameLiteral& name, const std::vector<glm::mat4>& x) {
-    std::vector<float> values(x.size() * 4 * 4);
-    float* write_ptr = values.data();
-    for (const auto& mat : x) {
-      std::copy(glm::value_ptr(mat), glm::value_ptr(mat) + 16, write_ptr);
-      write_ptr += 16;
+    if (x.empty()) {
+      return;
     }
-    GLint location = GetUniformLocation(name);
+    static_assert(sizeof(glm::mat4) == 16 * sizeof(float));
+    GLint location = LocationIfChanged(name, x.data(), x.size() * sizeof(glm::mat4));
     if (location != -1) {
-      glUniformMatrix4fv(location, x.size(), GL_FALSE, values.data());
+      glUniformMatrix4fv(location, x.size(), GL_FALSE, glm::value_ptr(x[0]));
     }
   }
 
   ~ShaderProgram();
  private:
-  GLint GetUniformLocation(const NameLiteral& name);
+  // Returns the location of the uniform if it's active in this program and the value is different
+  // from the last upload (and records the new value), or -1 otherwise.
+  GLint LocationIfChanged(const NameLiteral& name, const void* value, std::size_t size) {
+    std::size_t id = name.Id();
+    if (id == kUnknownUniformId) {
+      LOG_ERROR("% is not in UNIFORM_NAMES", name);
+      throw std::runtime_error("Unknown uniform name");
+    }
+    GLint location = uniform_locations_[id];
+    if (location == -1) {
+      return -1;
+    }
+    std::vector<uint8_t>& last_value = uniform_values_[id];
+    const uint8_t* value_bytes = static_cast<const uint8_t*>(value);
+    if (last_value.size() == size && std::equal(value_bytes, value_bytes + size, last_value.begin())) {
+      return -1;
+    }
+    last_value.assign(value_bytes, value_bytes + size);
+    return location;
+  }
 
   static GLuint current_program_;
 
+  // Starts compiling the preprocessed sources, and linking program_. Errors are checked in Finish().
+  void SubmitCompileAndLink();
+
   std::string vertex_shader_file_name_;
   std::string fragment_shader_file_name_;
+  ShaderFeatures features_;
   GLuint vertex_shader_;
   GLuint fragment_shader_;
   GLuint program_;
+  bool finished_;
+
+  // Preprocessed sources, only kept until the program is finished.
+  std::string vertex_shader_source_proc_;
+  std::string fragment_shader_source_proc_;
 
-  std::unordered_map<NameLiteral, GLint, NameLiteralHash> uniform_locations_cache_;
-  std::unordered_map<NameLiteral, GLint, NameLiteralHash> uniform_cache_1i_;
+  bool use_cache_;
+  uint64_t cache_key_;
+
+  // Indexed by uniform ID (see uniform_names.h). Resolved at link time.
+  std::array<GLint, kNumUniformNames> uniform_locations_;
+
+  // Last uploaded value of each uniform, as raw bytes (empty if never uploaded).
+  std::array<std::vector<uint8_t>, kNumUniformNames> uniform_values_;
 };
 
+// All feature permutations of a vertex + fragment shader pair.
+class ShaderVariants {
+ public:
+  ShaderVariants(const std::string& vertex_shader_file_name,
+                 const std::string& fragment_shader_file_name)
+      : vertex_shader_file_name_(vertex_shader_file_name),
+        fragment_shader_file_name_(fragment_shader_file_name) {}
+
+  // Compiles the variant on first use.
+  ShaderProgram* Get(ShaderFeatures features);
+
+ private:
+  std::string vertex_shader_file_name_;
+  std::string fragment_shader_file_name_;
+  std::unordered_map<ShaderFeatures, ShaderProgram*> variants_;
+};
+
+// Get the variants of a shader pair. Code that picks a variant per draw should hold on to
+// this instead of calling GetShader() every time.
+ShaderVariants* GetShaderVariants(
+  const std::string& vertex_shader_file_name,
+  const std::string& fragment_shader_file_name);
+
 // Get a pointer to a ShaderProgram built from the specified
-// sources. Reuses existing programs if already exists.
+// sources and features. Reuses existing programs if already exists.
 ShaderProgram* GetShader(
   const std::string& vertex_shader_file_name,
-  const std::string& fragment_shader_file_name);
+  const std::string& fragment_shader_file_name,
+  ShaderFeatures features = kNoShaderFeatures);
+
+// Compiles every program in the shader manifest (see shaders.cpp), with every combination of
+// features it may be used with (limited to `features`), so there are no compilation stalls
+// while rendering. Uses KHR_parallel_shader_compile when available.
+void WarmUpShaders(ShaderFeatures features);
 
 #endif // SHADERS_H
 
@@ -0,0 +1,59 @@
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "actor.h"
+#include "triple_buffer.h"
+
+// State of all actors at one simulation step.
+struct WorldSnapshot {
+  uint64_t time_us = 0;
+  std::vector<ActorSnapshot> actors;
+};
+
+// Runs actor updates at a fixed rate on a thread of its own, so a slow frame doesn't slow down
+// the simulation, and the simulation doesn't hold up rendering.
+//
+// After each step, the state of all actors is written to a snapshot and handed to the render
+// thread through a triple buffer, so neither thread waits for the other. The render thread draws
+// actors in between the last two snapshots it has, one step behind, so motion stays smooth at
+// any frame rate. All GL calls stay on the render thread.
+//
+// Emscripten builds don't have threads, so there the simulation is stepped inline every frame.
+class Simulation {
+ public:
+  // actors must outlive the simulation, and can't be added or removed while it's running.
+  explicit Simulation(std::vector<Actor>* actors);
+  ~Simulation();
+
+  Simulation(const Simulation& other) = delete;
+  Simulation& operator=(const Simulation& other) = delete;
+
+  // Runs the first step, then starts the thread.
+  void Start();
+
+  // Render thread. Sets actors to their interpolated state at time_us, for rendering.
+  void ApplySnapshot(uint64_t time_us);
+
+ private:
+  // Simulation thread. Updates actors to time_us, and publishes a snapshot of them.
+  void Step(uint64_t time_us);
+
+  void Run();
+
+  std::vector<Actor>* actors_;
+
+  TripleBuffer<WorldSnapshot> snapshots_;
+
+  // Render thread. The snapshot before the one in snapshots_.ReadSlot().
+  WorldSnapshot previous_;
+
+  std::atomic<bool> done_{false};
+  std::thread thread_;
+};
+
+#endif // SIMULATION_H
@@ -26,7 +26,7 @@ class Terrain : public Renderable {
   virtual ~Terrain() {}
 
  private:
-  ShaderProgram* shader_;
+  ShaderVariants* shader_variants_;
   bool initialized_;
   GLuint vao_id_;
   std::size_t num_indices_;
@@ -1,20 +1,53 @@
 #ifndef TEXTURE_MANAGER_H
 #define TEXTURE_MANAGER_H
 
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
+
+#include "glm/glm.hpp"
 
 #include "texture_generated.h"
 
 #include "platform_includes.h"
 #include "shaders.h"
+#include "thread_pool.h"
 #include "utils.h"
 
+// What a texture looks like until it's loaded. Placeholders are neutral for their material
+// slot, so objects look plain rather than broken while textures stream in.
+enum class TexturePlaceholder {
+  kBase,     // Mid grey.
+  kNormal,   // Flat normal.
+  kSpecular, // No highlight.
+  kAO,       // No occlusion.
+};
+
+// Identifies a texture managed by TextureManager. Handles are valid forever (the texture
+// itself may be evicted, and is then loaded again when bound).
+enum class TextureHandle : uint32_t {};
+
+constexpr TextureHandle kNoTexture = static_cast<TextureHandle>(std::numeric_limits<uint32_t>::max());
+
+// Textures used by a material. Resolved once (see TextureManager::LoadTextures()), so
+// using a set is just binding handles.
+//
+// Handles are of texture arrays, so materials with textures in the same arrays bind the same
+// textures, and only differ in the layers used.
 struct TextureSet {
-  std::string base_texture;
-  std::string norm_texture;
-  std::string spec_texture;
-  std::string ao_texture;
+  TextureHandle base_texture = kNoTexture;
+  TextureHandle norm_texture = kNoTexture;
+  TextureHandle spec_texture = kNoTexture;
+  TextureHandle ao_texture = kNoTexture;
+
+  // Layer of each texture in its array (base, norm, spec, ao).
+  glm::vec4 layers = glm::vec4(0.0f);
 };
 
 // This is a low level interface for loading textures. Except for special
@@ -25,6 +58,24 @@ GLuint TextureFromMemory(int width, int height, GLint internal_format,
 // This class manages all texture-related operations including activating
 // texture units, loading and uploading textures to the GPU when necessary
 // (on first use), and binding textures.
+//
+// The active unit and the texture bound to each unit are tracked, so redundant
+// glActiveTexture() and glBindTexture() calls are skipped. All texture binding must go
+// through this class for that to work.
+//
+// Textures are 2D texture arrays. make_assets puts textures of the same size and material
+// slot into shared arrays (listed in texture_arrays.fb), so objects with different textures
+// can be drawn without rebinding. Textures that aren't in an array (eg. in assets from before
+// arrays) are arrays of one layer.
+//
+// Textures are streamed: on first use, a 1x1 placeholder is bound while the image is
+// decoded on a worker thread, and its mip levels are uploaded by Update() later, smallest
+// first. ETC2/EAC compressed textures (.ktx, written by make_assets) are used when the GPU
+// supports them, and PNGs otherwise.
+//
+// GPU memory used by textures is kept within a budget. Least recently used textures have
+// their top levels dropped, and are eventually evicted. Either way they are streamed in again
+// when they are next used.
 class TextureManager {
  public:
   static TextureManager* GetInstance() { 
@@ -32,9 +83,36 @@ class TextureManager {
   	return &instance;
   }
 
-  void BindTexture(const std::string& texture_name, GLenum texture_unit);
+  // Returns the handle of a texture array (by name in texture_arrays.fb), or of a texture not
+  // in an array (by name, relative to the textures directory). The texture is loaded on first
+  // bind. The placeholder is decided by the first caller.
+  TextureHandle GetTextureHandle(const std::string& texture_name,
+                                 TexturePlaceholder placeholder = TexturePlaceholder::kBase);
+
+  void BindTexture(TextureHandle texture, GLenum texture_unit);
+
+  // Binds a texture that isn't managed by us (eg. framebuffer textures). This also makes
+  // the unit active.
   void BindTexture(GLuint texture, GLenum texture_unit);
 
+  // Binds a texture to a spare texture unit and makes it active, for uploading or setting
+  // parameters without disturbing other bindings.
+  void BindTextureForEditing(GLuint texture, GLenum target = GL_TEXTURE_2D);
+
+  // Deletes a texture made by Make*Texture() or TextureFromMemory().
+  void DeleteTexture(GLuint texture);
+
+  // Uploads textures that have finished decoding, up to a per-frame budget, and evicts
+  // textures if we are over the memory budget. Called once per frame.
+  void Update();
+
+  static constexpr std::size_t kDefaultMemoryBudget = 512 * 1024 * 1024;
+
+  void SetMemoryBudget(std::size_t bytes) { memory_budget_ = bytes; }
+
+  // GPU memory used by streamed textures (estimated from the data uploaded).
+  std::size_t ResidentBytes() const { return resident_bytes_; }
+
   GLuint MakeColourTexture(int width, int height);
   GLuint MakeDepthTexture(int width, int height);
 
@@ -50,11 +128,135 @@ class TextureManager {
 
   void UseTextureSet(ShaderProgram* shader, const TextureSet& textures);
 
+  // Shader features that can be used with a texture set (all features except the ones that
+  // need a texture the set doesn't have).
+  static ShaderFeatures SupportedShaderFeatures(const TextureSet& textures);
+
  private:
-  TextureManager() {}
+  TextureManager();
+
+  struct ResidentTexture {
+    std::string name;
+    TexturePlaceholder placeholder;
+
+    // Texture files (relative to the textures directory) of each layer.
+    std::vector<std::string> layer_files;
+
+    // 0 if not loaded (not used yet, or evicted).
+    GLuint texture_id = 0;
+
+    // GPU memory used by each level (0 for levels not uploaded or dropped). The placeholder
+    // isn't counted.
+    std::vector<std::size_t> level_bytes;
+
+    // Most detailed level the texture has. Nothing has been uploaded if this is past the end
+    // of level_bytes.
+    int base_level = std::numeric_limits<int>::max();
+
+    uint64_t last_used_frame = 0;
+
+    // Decoding or uploading. These textures are never evicted.
+    bool streaming = false;
+
+    // No layer could be decoded. The placeholder is used, and decoding isn't tried again.
+    bool failed = false;
+  };
+
+  struct DecodedTexture {
+    TextureHandle handle;
+    GLuint texture_id = 0;
+
+    // 0 for uncompressed RGBA8 textures.
+    GLenum compressed_format = 0;
+
+    int num_layers = 1;
+
+    // Mip levels, each a range of data with all layers, one after another. For a compressed
+    // texture with one layer, data is the whole KTX file.
+    struct Level {
+      uint32_t width;
+      uint32_t height;
+      std::size_t offset;
+      std::size_t size;
+    };
+    std::vector<Level> levels;
+    std::vector<uint8_t> data;
+
+    // Levels are uploaded from the smallest, so the texture can be used at a lower
+    // resolution while the rest stream in. This is the next one to upload.
+    int next_level = 0;
+  };
+
+  // Makes the texture object with a placeholder, and starts streaming the texture.
+  void StartLoading(TextureHandle handle);
+
+  void StartDecode(TextureHandle handle);
+
+  // Called on a worker thread (or directly on the web, where we have no threads).
+  void DecodeTexture(const std::vector<std::string>& layer_files, TexturePlaceholder placeholder,
+                     TextureHandle handle);
+
+  // Reads a KTX (version 1) file with a 2D compressed texture. Returns false if the file
+  // isn't one we can use.
+  static bool LoadKtx(const std::string& path, DecodedTexture* decoded);
+
+  // Reads a PNG and the mip levels make_assets wrote next to it. Returns false if level 0
+  // can't be loaded.
+  static bool LoadPng(const std::string& texture_name, DecodedTexture* decoded);
+
+  // Combines single layer textures into one with all the layers. Returns false if they don't
+  // have the same format and size. Only levels all layers have are kept.
+  static bool StackLayers(const std::vector<DecodedTexture>& layers, DecodedTexture* decoded);
+
+  // Reads texture_arrays.fb written by make_assets, if there is one.
+  void LoadTextureArrays();
+
+  // Uploads decoded->next_level, and makes the texture use it. Returns the GPU memory used
+  // by the level.
+  std::size_t UploadNextLevel(DecodedTexture* decoded);
+
+  void EvictToBudget();
+
+  void ActivateTextureUnit(GLenum texture_unit);
+
+  // Binds without changing the active unit, unless the texture isn't already bound.
+  void BindToUnit(GLuint texture, GLenum texture_unit, GLenum target = GL_TEXTURE_2D);
+
+  // Layer files of each texture array, by array name.
+  std::map<std::string, std::vector<std::string>> texture_arrays_;
+
+  // Handles of all textures we have seen, and their state (indexed by handle).
+  std::map<std::string, TextureHandle> texture_handles_;
+  std::vector<ResidentTexture> textures_;
+
+  static constexpr int kNumTextureUnits = 32;
+
+  // What we think the GL state is.
+  GLenum active_texture_unit_ = GL_TEXTURE0;
+  std::array<GLuint, kNumTextureUnits> bound_textures_ = {};
+  std::array<GLuint, kNumTextureUnits> bound_texture_arrays_ = {};
+
+  // Incremented by Update().
+  uint64_t frame_ = 0;
+
+  std::size_t resident_bytes_ = 0;
+  std::size_t memory_budget_ = kDefaultMemoryBudget;
+
+  // Textures decoded by workers, waiting to be uploaded.
+  std::mutex decoded_textures_mutex_;
+  std::deque<DecodedTexture> decoded_textures_;
+
+  // Textures with levels still to be uploaded (only used on the main thread).
+  std::deque<DecodedTexture> uploading_textures_;
+
+  GLuint upload_pbo_ = 0;
+
+  // Whether the GPU supports the formats make_assets compresses textures into. Only written
+  // before the decode workers start.
+  bool etc2_supported_ = false;
 
-  // Texture IDs for textures already uploaded to the GPU.
-  std::map<std::string, GLuint> texture_cache_;
+  // Declared last, so workers are stopped before anything they use is destroyed.
+  std::unique_ptr<ThreadPool> decode_pool_;
 };
 
 #endif // TEXTURE_MANAGER_H
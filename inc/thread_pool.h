@@ -0,0 +1,90 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Fixed size pool of worker threads running queued work in FIFO order. Workers are started
+// by Run(), and exit once SetDone() has been called and the queue is empty.
+class ThreadPool {
+ public:
+  ThreadPool(int num_threads) : num_threads_(num_threads), done_(false) {}
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // Tell the workers to exit as soon as the work_queue_ is empty.
+  void SetDone() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_ = true;
+    }
+    cv_.notify_all();
+  }
+
+  void Push(std::function<void()> work) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    work_queue_.push(work);
+    cv_.notify_one();
+  }
+
+  void Run() {
+    auto worker_fn = [&]() {
+      while (true) {
+        std::function<void()> work;
+        bool all_done = false;
+
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          cv_.wait(lock, [&]{ return done_ || !work_queue_.empty(); });
+
+          if (!work_queue_.empty()) {
+            work = work_queue_.front();
+            work_queue_.pop();
+            if (work_queue_.empty() && done_) {
+              // We took the last task, so we should notify everyone to wakeup and die (once we release the mutex).
+              all_done = true;
+            }
+          } else if (done_) {
+            break;
+          }
+        }
+        if (all_done) {
+          cv_.notify_all();
+        }
+        if (work) {
+          work();
+        }
+      }
+    };
+
+    for (int i = 0; i < num_threads_; ++i) {
+      threads_.push_back(std::thread(worker_fn));
+    }
+  }
+
+  void JoinAll() {
+    for (std::thread& t : threads_) {
+      t.join();
+    }
+    threads_.clear();
+  }
+
+  ~ThreadPool() {
+    SetDone();
+    JoinAll();
+  }
+
+ private:
+  int num_threads_;
+  bool done_;
+  std::vector<std::thread> threads_;
+  std::queue<std::function<void()>> work_queue_;
+  std::condition_variable cv_;
+  std::mutex mutex_;
+};
+
+#endif // THREAD_POOL_H
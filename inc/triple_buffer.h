@@ -0,0 +1,61 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// Lock-free single producer, single consumer triple buffer. The producer fills its own slot
+// and publishes it, and the consumer takes the most recently published slot. Neither ever waits
+// for the other. Slots are reused, so whatever they allocate is too.
+//
+// Of the 3 slots, one is the producer's, one is the consumer's, and the other one is the last
+// published (or an old one the consumer gave back). Publishing and taking swap the caller's slot
+// with that one.
+template <typename T>
+class TripleBuffer {
+ public:
+  TripleBuffer() {}
+  TripleBuffer(const TripleBuffer&) = delete;
+  TripleBuffer& operator=(const TripleBuffer&) = delete;
+
+  // Producer side.
+  T* WriteSlot() { return &slots_[write_]; }
+
+  void Publish() {
+    uint8_t old = shared_.exchange(write_ | kPublishedBit, std::memory_order_acq_rel);
+    write_ = old & kIndexMask;
+  }
+
+  // Consumer side. Whether Take() would take a slot. Only the consumer clears the bit, so if this
+  // returns true, the next Take() will succeed.
+  bool HasPublished() const { return shared_.load(std::memory_order_relaxed) & kPublishedBit; }
+
+  // Takes the latest published slot, if there is one we haven't taken yet. The slot we had goes
+  // back to the producer.
+  bool Take() {
+    if (!HasPublished()) {
+      return false;
+    }
+    uint8_t old = shared_.exchange(read_, std::memory_order_acq_rel);
+    read_ = old & kIndexMask;
+    return true;
+  }
+
+  T* ReadSlot() { return &slots_[read_]; }
+
+ private:
+  static constexpr uint8_t kIndexMask = 0x3;
+  static constexpr uint8_t kPublishedBit = 0x4;
+
+  std::array<T, 3> slots_;
+
+  // Only used by the producer and consumer respectively.
+  uint8_t write_ = 0;
+  uint8_t read_ = 1;
+
+  // Index of the third slot, and whether it has been published since the consumer last took one.
+  std::atomic<uint8_t> shared_{2};
+};
+
+#endif // TRIPLE_BUFFER_H
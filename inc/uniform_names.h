@@ -0,0 +1,49 @@
+#ifndef UNIFORM_NAMES_H
+#define UNIFORM_NAMES_H
+
+#include <cstddef>
+
+// Every uniform set through ShaderProgram::SetUniform. Each gets a dense ID at compile time
+// (see NameLiteral), which ShaderProgram uses to index its per-program location and value tables.
+// "x"_name fails to compile if x is not in this list.
+#define UNIFORM_NAMES \
+  UniformName(alpha_colour) \
+  UniformName(ao_texture) \
+  UniformName(areaTex) \
+  UniformName(base_texture) \
+  UniformName(blendTex) \
+  UniformName(bone_transforms) \
+  UniformName(box_max) \
+  UniformName(box_min) \
+  UniformName(colorTex) \
+  UniformName(edgesTex) \
+  UniformName(is_edge) \
+  UniformName(model) \
+  UniformName(mvp) \
+  UniformName(norm_texture) \
+  UniformName(position_offset) \
+  UniformName(position_scale) \
+  UniformName(resolution) \
+  UniformName(searchTex) \
+  UniformName(shadow_texture) \
+  UniformName(SMAA_RT_METRICS) \
+  UniformName(spec_texture) \
+  UniformName(tex_xywh) \
+  UniformName(texture_byte_order) \
+  UniformName(texture_layers) \
+  UniformName(texture_scale) \
+  UniformName(use_alpha_colour) \
+  UniformName(xywh) \
+
+constexpr const char* kUniformNames[] = {
+  #define UniformName(name) #name,
+  UNIFORM_NAMES
+  #undef UniformName
+};
+
+constexpr std::size_t kNumUniformNames = sizeof(kUniformNames) / sizeof(kUniformNames[0]);
+
+// ID of names that are not in UNIFORM_NAMES.
+constexpr std::size_t kUnknownUniformId = kNumUniformNames;
+
+#endif // UNIFORM_NAMES_H
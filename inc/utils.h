@@ -10,6 +10,7 @@
 #include <stdexcept>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
@@ -23,6 +24,7 @@
 
 #include "logger.h"
 #include "platform_includes.h"
+#include "uniform_names.h"
 
 // SDL uses return values to indicate error. We have these macros to log and
 // convert them to exceptions.
@@ -121,13 +123,43 @@ constexpr std::size_t Djb2(const char* s) {
   return hash;
 }
 
-// This is a wrapper around const char* with hash.
+// 64-bit FNV-1a, for when collisions need to be unlikely (eg. cache keys).
+constexpr uint64_t Fnv1a64(std::string_view s) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (char c : s) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+constexpr bool StringsEqual(const char* a, const char* b) {
+  while (*a != '\0' && *a == *b) {
+    ++a;
+    ++b;
+  }
+  return *a == *b;
+}
+
+// Index of s in UNIFORM_NAMES, or kUnknownUniformId.
+constexpr std::size_t UniformId(const char* s) {
+  for (std::size_t i = 0; i < kNumUniformNames; ++i) {
+    if (StringsEqual(s, kUniformNames[i])) {
+      return i;
+    }
+  }
+  return kUnknownUniformId;
+}
+
+// This is a wrapper around const char* with hash, and uniform ID (see uniform_names.h).
 class NameLiteral {
  public:
-  constexpr NameLiteral(const char* s) : s_(s), hash_(Djb2(s)) {}
+  constexpr NameLiteral(const char* s) : s_(s), hash_(Djb2(s)), id_(UniformId(s)) {}
 
   constexpr const char* Ptr() const { return s_; };
 
+  constexpr std::size_t Id() const { return id_; }
+
   constexpr bool operator==(const NameLiteral& other) const {
     if (s_ == other.s_) {
       return true;
@@ -147,6 +179,7 @@ class NameLiteral {
  private:
   const char* s_;
   std::size_t hash_;
+  std::size_t id_;
 };
 
 inline std::ostream& operator<<(std::ostream& os, const NameLiteral& name) {
@@ -154,9 +187,14 @@ inline std::ostream& operator<<(std::ostream& os, const NameLiteral& name) {
   return os;
 }
 
-constexpr NameLiteral operator""_name(const char *str, std::size_t len) {
+// consteval so that the ID lookup always happens at compile time.
+consteval NameLiteral operator""_name(const char *str, std::size_t len) {
   (void) len;
-  return NameLiteral(str);
+  NameLiteral name(str);
+  if (name.Id() == kUnknownUniformId) {
+    throw "Uniform name is not in UNIFORM_NAMES";
+  }
+  return name;
 }
 
 struct NameLiteralHash {
@@ -1,8 +1,10 @@
 #include "actor.h"
 
+#include <cmath>
 #include <fstream>
 #include <random>
 #include <stdexcept>
+#include <unordered_map>
 #include <vector>
 
 #pragma GCC diagnostic push
@@ -13,6 +15,7 @@
 #pragma GCC diagnostic pop
 
 #include "logger.h"
+#include "mesh_buffer_pool.h"
 #include "renderer.h"
 #include "shaders.h"
 #include "utils.h"
@@ -25,17 +28,82 @@ static constexpr const char* kMeshPathPrefix = "assets/art/meshes/";
 // https://trac.wildfiregames.com/wiki/AnimationSync
 static constexpr float kDefaultWalkingSpeed = 7.0f;
 
+// Use the least detailed LOD whose geometric error projects to at most this many pixels.
+static constexpr float kMaxLodErrorPixels = 1.0f;
+
+// Skinned vertices are a position, normal and tangent, as floats (see skin.vs).
+static constexpr std::size_t kSkinnedVertexSize = 9 * sizeof(float);
+
+// Bounds of animated meshes are of the bind pose, so they are grown by this fraction of their
+// size on each side to cover limbs moving out.
+static constexpr float kAnimatedBoundsPadding = 0.25f;
+
 // Data about a mesh that has been uploaded to the GPU (used at least once).
 struct MeshGPUData {
-  ShaderProgram* shader;
-  ShaderProgram* shadow_shader;
+  ShaderVariants* shader_variants;
+  ShaderVariants* shadow_shader_variants;
+  ShaderProgram* skin_shader;
+
+  // Shared with other meshes with the same vertex format (see MeshBufferPool).
+  MeshAllocation allocation;
+  MeshBufferPool::VertexFormat format;
+
+  // Skinned meshes only. Skinned vertices start from 0 in their own buffer, so they need
+  // indices that aren't rebased like the pool's. Same index size as the pool's.
+  GLuint skinned_index_buffer = 0;
+
+  struct Lod {
+    GLsizei num_indices;
+
+    // Offset into the (shared) index buffer in bytes.
+    std::size_t offset;
 
-  GLuint vao_id;
+    // Geometric error in model units.
+    float error;
+  };
+
+  // Most detailed first.
+  std::vector<Lod> lods;
 
-  GLsizei num_indices;
   bool skinned;
+
+  // Dequantisation parameters for positions.
+  glm::vec3 position_offset;
+  glm::vec3 position_scale;
+
+  // Select LOD based on projected error at the distance from the eye.
+  const Lod& SelectLod(const glm::mat4& model, Renderable::RenderContext* context) const {
+    if (!context->use_mesh_lod || lods.size() == 1) {
+      return lods[0];
+    }
+    glm::vec3 centre = glm::vec3(model * glm::vec4(position_offset + 0.5f * position_scale, 1.0f));
+    float distance = std::max(glm::length(context->eye_pos - centre), 0.001f);
+
+    // Errors are in model units, so they are scaled to world units (conservatively, by the
+    // largest axis scale) before projecting.
+    float model_scale = std::max({glm::length(glm::vec3(model[0])), glm::length(glm::vec3(model[1])),
+                                  glm::length(glm::vec3(model[2]))});
+    float pixels_per_unit = context->lod_scale / distance * model_scale;
+    std::size_t selected = 0;
+    while ((selected + 1) < lods.size() && (lods[selected + 1].error * pixels_per_unit) <= kMaxLodErrorPixels) {
+      ++selected;
+    }
+    return lods[selected];
+  }
 };
 
+GLenum VertexAttributeTypeToGL(data::VertexAttributeType type) {
+  switch (type) {
+    case data::VertexAttributeType_Float: return GL_FLOAT;
+    case data::VertexAttributeType_HalfFloat: return GL_HALF_FLOAT;
+    case data::VertexAttributeType_UnsignedShort: return GL_UNSIGNED_SHORT;
+    case data::VertexAttributeType_Short: return GL_SHORT;
+    case data::VertexAttributeType_UnsignedByte: return GL_UNSIGNED_BYTE;
+    case data::VertexAttributeType_Byte: return GL_BYTE;
+  }
+  throw std::runtime_error("Unknown vertex attribute type");
+}
+
 struct AttachmentPoints {
   // Either relative to root or bone.
   glm::mat4 transform;
@@ -75,11 +143,68 @@ std::map<std::string, AttachmentPoints> GetAttachPoints(const std::string& mesh_
   return it->second;
 }
 
-void RenderMesh(const std::string& mesh_file_name, const TextureSet& textures, const glm::mat4& vp,
-                const glm::mat4& model, std::optional<glm::vec3> maybe_alpha_colour,
-                const std::vector<glm::mat4>& bone_transforms, Renderable::RenderContext* context) {
+// Makes the buffer a mesh is skinned into, and a VAO to draw it with the mesh's texture
+// coordinates.
+void MakeSkinnedVertices(const std::string& mesh_file_name, const MeshGPUData& data,
+                         SkinnedVertices* skinned_vertices) {
+  skinned_vertices->Clear();
+  skinned_vertices->mesh_file_name = mesh_file_name;
+
+  glGenBuffers(1, &skinned_vertices->buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, skinned_vertices->buffer);
+  glBufferData(GL_ARRAY_BUFFER, data.allocation.num_vertices * kSkinnedVertexSize, nullptr, GL_STREAM_COPY);
+  CHECK_GL_ERROR
+
+  glGenVertexArrays(1, &skinned_vertices->vao);
+  Renderer::UseVAO(skinned_vertices->vao);
+  Renderer::SetUpAttribs({
+    Renderer::AttribSpec{/*attrib_location=*/0, GL_FLOAT, 3, /*normalised=*/false, /*offset=*/0},
+    Renderer::AttribSpec{/*attrib_location=*/1, GL_FLOAT, 3, /*normalised=*/false, /*offset=*/3 * sizeof(float)},
+    Renderer::AttribSpec{/*attrib_location=*/2, GL_FLOAT, 3, /*normalised=*/false, /*offset=*/6 * sizeof(float)},
+  }, kSkinnedVertexSize);
+
+  // Texture coordinates (locations 3 and 4, see actor.vs) aren't changed by skinning, so they
+  // come from the mesh in the pool.
+  std::vector<Renderer::AttribSpec> tex_coord_attribs;
+  for (Renderer::AttribSpec attrib : data.format.attribs) {
+    if (attrib.attrib_location == 3 || attrib.attrib_location == 4) {
+      attrib.offset += data.allocation.first_vertex * data.format.stride;
+      tex_coord_attribs.push_back(attrib);
+    }
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, data.allocation.vertex_buffer);
+  Renderer::SetUpAttribs(tex_coord_attribs, data.format.stride);
+
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, data.skinned_index_buffer);
+  CHECK_GL_ERROR
+}
+
+// Skins all vertices of the mesh into skinned_vertices with transform feedback.
+void SkinMesh(const MeshGPUData& data, const std::vector<glm::mat4>& bone_transforms,
+              SkinnedVertices* skinned_vertices) {
+  ShaderProgram* shader = data.skin_shader;
+  shader->Activate();
+  shader->SetUniform("position_offset"_name, data.position_offset);
+  shader->SetUniform("position_scale"_name, data.position_scale);
+  shader->SetUniform("bone_transforms"_name, bone_transforms);
+
+  Renderer::UseVAO(data.allocation.vao);
+  glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, skinned_vertices->buffer);
+  glBeginTransformFeedback(GL_POINTS);
+  glDrawArrays(GL_POINTS, data.allocation.first_vertex, data.allocation.num_vertices);
+  glEndTransformFeedback();
+
+  // WebGL doesn't allow drawing from a buffer that is still bound for transform feedback.
+  glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+  CHECK_GL_ERROR
+}
+
+void RenderMesh(const std::string& mesh_file_name, const TextureSet& textures, const glm::mat4& model, std::optional<glm::vec3> maybe_alpha_colour,
+                bool animated, const std::vector<glm::mat4>& bone_transforms, SkinnedVertices* skinned_vertices,
+                std::optional<BoundingBox>* bounds, Renderable::RenderContext* context) {
   static std::map<std::string, MeshGPUData> mesh_gpu_data_cache;
-  bool shadow_pass = context->pass == RenderPass::kShadow;
+  // The depth prepass uses the shadow pass' programs, with the camera's MVP.
+  bool depth_only = context->pass == RenderPass::kShadow || context->pass == RenderPass::kDepthPrepass;
   auto it = mesh_gpu_data_cache.find(mesh_file_name);
   if (it == mesh_gpu_data_cache.end()) {
     // This raw buffer only needs to survive for as long as we want to read
@@ -89,57 +214,128 @@ void RenderMesh(const std::string& mesh_file_name, const TextureSet& textures, c
         ReadWholeFile(std::string(kMeshPathPrefix) + mesh_file_name);
     const data::Mesh* mesh_data = data::GetMesh(raw_buffer.data());
     MeshGPUData data;
-    data.shadow_shader = GetShader("shadow.vs", "shadow.fs");
-    data.shader = GetShader("actor.vs", "actor.fs");
-    data.shader->Activate();
+    data.shadow_shader_variants = GetShaderVariants("shadow.vs", "shadow.fs");
+    data.shader_variants = GetShaderVariants("actor.vs", "actor.fs");
+    data.skin_shader = GetShader("skin.vs", "skin.fs", kShaderFeatureSkinning);
 
     data.skinned = mesh_data->bind_pose_transforms()->size() > 0;
 
-    // Upload all the vertex attributes to the GPU.
-    data.vao_id = Renderer::MakeVAO({
-      Renderer::VBOSpec(*mesh_data->vertices(), 0, GL_FLOAT, 3),
-      Renderer::VBOSpec(*mesh_data->normals(), 1, GL_FLOAT, 3),
-      Renderer::VBOSpec(*mesh_data->tangents(), 2, GL_FLOAT, 3),
-      Renderer::VBOSpec(*mesh_data->tex_coords(), 3, GL_FLOAT, 2),
-      Renderer::VBOSpec(*mesh_data->ao_tex_coords(), 4, GL_FLOAT, 2),
-      Renderer::VBOSpec(*mesh_data->bone_indices(), 5, GL_BYTE, 4),
-      Renderer::VBOSpec(*mesh_data->bone_weights(), 6, GL_FLOAT, 4),
-    },
-    Renderer::EBOSpec(*mesh_data->vertex_indices()));
-
-    data.num_indices = mesh_data->vertex_indices()->size();
-    it = mesh_gpu_data_cache.insert(std::make_pair(mesh_file_name, data)).first;
-  }
+    if (!mesh_data->packed_vertices() || !mesh_data->vertex_attributes()) {
+      throw std::runtime_error(mesh_file_name + " has no packed vertices (assets need to be rebuilt)");
+    }
 
-  const MeshGPUData& data = it->second;
+    MeshBufferPool::VertexFormat& format = data.format;
+    format.stride = mesh_data->vertex_stride();
+    for (const data::VertexAttribute* attrib : *mesh_data->vertex_attributes()) {
+      format.attribs.push_back(Renderer::AttribSpec{
+          attrib->location(), VertexAttributeTypeToGL(attrib->type()), attrib->components(),
+          attrib->normalised(), attrib->offset()});
+    }
 
-  ShaderProgram* shader = shadow_pass ? data.shadow_shader : data.shader;
-  shader->Activate();
+    data.position_offset = glm::vec3(mesh_data->position_offset()->x(), mesh_data->position_offset()->y(),
+                                     mesh_data->position_offset()->z());
+    data.position_scale = glm::vec3(mesh_data->position_scale()->x(), mesh_data->position_scale()->y(),
+                                    mesh_data->position_scale()->z());
+
+    // Meshes with <= 65536 vertices (almost all of them) have 16-bit indices. The pool
+    // rebases them, so it takes them as 32-bit either way.
+    bool use_16_bit_indices = mesh_data->vertex_indices_16() && mesh_data->vertex_indices_16()->size() > 0;
+    std::vector<uint32_t> indices = use_16_bit_indices
+        ? std::vector<uint32_t>(mesh_data->vertex_indices_16()->begin(), mesh_data->vertex_indices_16()->end())
+        : std::vector<uint32_t>(mesh_data->vertex_indices()->begin(), mesh_data->vertex_indices()->end());
+
+    // All the vertex attributes are in one interleaved buffer.
+    std::size_t num_vertices = mesh_data->packed_vertices()->size() / format.stride;
+    data.allocation = MeshBufferPool::GetInstance()->Allocate(format, mesh_data->packed_vertices()->data(),
+                                                              num_vertices, indices);
+
+    if (data.skinned) {
+      // The element array buffer binding is VAO state, so make sure we don't change a VAO's.
+      Renderer::UseVAO(0);
+      glGenBuffers(1, &data.skinned_index_buffer);
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, data.skinned_index_buffer);
+      if (data.allocation.index_type == GL_UNSIGNED_SHORT) {
+        std::vector<uint16_t> indices_16(indices.begin(), indices.end());
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices_16.size() * sizeof(uint16_t), indices_16.data(), GL_STATIC_DRAW);
+      } else {
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(uint32_t), indices.data(), GL_STATIC_DRAW);
+      }
+      CHECK_GL_ERROR
+    }
 
-  glm::mat4 mvp = vp * model;
+    // Meshes without LODs are treated as having a single LOD covering the whole index buffer.
+    if (mesh_data->lods() && mesh_data->lods()->size() > 0) {
+      for (const data::MeshLod* lod : *mesh_data->lods()) {
+        data.lods.push_back(MeshGPUData::Lod{static_cast<GLsizei>(lod->num_indices()),
+                                             data.allocation.index_offset + lod->first_index() * data.allocation.index_size,
+                                             lod->error()});
+      }
+    } else {
+      data.lods.push_back(MeshGPUData::Lod{static_cast<GLsizei>(indices.size()), data.allocation.index_offset, 0.0f});
+    }
+    it = mesh_gpu_data_cache.insert(std::make_pair(mesh_file_name, data)).first;
+  }
 
-  shader->SetUniform("mvp"_name, mvp);
+  const MeshGPUData& data = it->second;
 
-  Renderable::SetLightParams(context, shader);
+  // Animated meshes are skinned once in the skinning pass, and the other passes draw the skinned
+  // vertices.
+  bool preskinned = data.skinned && animated;
 
-  shader->SetUniform("skinning"_name, data.skinned ? 1 : 0);
+  BoundingBox mesh_bounds{data.position_offset, data.position_offset + data.position_scale};
+  if (preskinned) {
+    glm::vec3 padding = kAnimatedBoundsPadding * data.position_scale;
+    mesh_bounds.min -= padding;
+    mesh_bounds.max += padding;
+  }
+  mesh_bounds = mesh_bounds.Transformed(model);
+  if (*bounds) {
+    (*bounds)->Extend(mesh_bounds);
+  } else {
+    *bounds = mesh_bounds;
+  }
+  if (context->pass == RenderPass::kSkinning) {
+    if (preskinned) {
+      if (skinned_vertices->mesh_file_name != mesh_file_name) {
+        MakeSkinnedVertices(mesh_file_name, data, skinned_vertices);
+      }
+      SkinMesh(data, bone_transforms, skinned_vertices);
+    }
+    return;
+  }
 
-  if (data.skinned) {
-    shader->SetUniform("bone_transforms"_name, bone_transforms);
+  if (preskinned && skinned_vertices->mesh_file_name != mesh_file_name) {
+    // Not skinned yet (a prop added after the skinning pass). It will be next frame.
+    return;
   }
 
-  if (shadow_pass) {
-    Renderer::UseVAO(data.vao_id);
-    glDrawElements(GL_TRIANGLES, data.num_indices, GL_UNSIGNED_INT, (const void*) 0);
+  const MeshGPUData::Lod& lod = data.SelectLod(model, context);
+  GLuint vao = preskinned ? skinned_vertices->vao : data.allocation.vao;
+  std::size_t index_offset = preskinned ? (lod.offset - data.allocation.index_offset) : lod.offset;
+
+  // Graphics settings and material textures select a shader variant, so the shaders don't
+  // branch on them at runtime. Depth only passes only care about skinning.
+  ShaderFeatures features = preskinned ? kShaderFeaturePreskinned : kNoShaderFeatures;
+  ShaderProgram* shader;
+  if (depth_only) {
+    shader = data.shadow_shader_variants->Get(features);
+    shader->Activate();
   } else {
-    shader->SetUniform("model"_name, model);
+    features |= context->shader_features & TextureManager::SupportedShaderFeatures(textures);
+    shader = data.shader_variants->Get(features);
+    shader->Activate();
+    Renderable::SetShadowTextureUnits(shader);
+  }
 
-    // Graphics settings.
-    #define GraphicsSetting(upper, lower, type, default, toggle_key) \
-      shader->SetUniform(NameLiteral(#lower), context->lower);
-    GRAPHICS_SETTINGS
-    #undef GraphicsSetting
+  // View, projection and light come from the per-frame and per-pass uniform blocks.
+  shader->SetUniform("model"_name, model);
+  shader->SetUniform("position_offset"_name, data.position_offset);
+  shader->SetUniform("position_scale"_name, data.position_scale);
 
+  if (depth_only) {
+    Renderer::UseVAO(vao);
+    glDrawElements(GL_TRIANGLES, lod.num_indices, data.allocation.index_type, reinterpret_cast<const void*>(index_offset));
+  } else {
     if (maybe_alpha_colour) {
       shader->SetUniform("alpha_colour"_name, *maybe_alpha_colour);
       shader->SetUniform("use_alpha_colour"_name, 1);
@@ -148,19 +344,37 @@ void RenderMesh(const std::string& mesh_file_name, const TextureSet& textures, c
     }
 
     // Texture unit 0 for the base texture.
-    if (textures.base_texture.empty()) {
+    if (textures.base_texture == kNoTexture) {
       LOG_ERROR("No base texture. Skipping mesh.");
       return;
     }
 
     TextureManager::GetInstance()->UseTextureSet(shader, textures);
 
-    Renderer::UseVAO(data.vao_id);
-    glDrawElements(GL_TRIANGLES, data.num_indices, GL_UNSIGNED_INT, (const void*) 0);
+    Renderer::UseVAO(vao);
+    glDrawElements(GL_TRIANGLES, lod.num_indices, data.allocation.index_type, reinterpret_cast<const void*>(index_offset));
   }
 }
 }
 
+SkinnedVertices::~SkinnedVertices() {
+  Clear();
+}
+
+void SkinnedVertices::Clear() {
+  if (vao != 0) {
+    // Unbind first, so Renderer::UseVAO() doesn't think the name is still bound if it's reused.
+    Renderer::UseVAO(0);
+    glDeleteVertexArrays(1, &vao);
+    vao = 0;
+  }
+  if (buffer != 0) {
+    glDeleteBuffers(1, &buffer);
+    buffer = 0;
+  }
+  mesh_file_name.clear();
+}
+
 /*static*/ ActorTemplate& ActorTemplate::GetTemplate(const std::string& actor_path) {
   static std::map<std::string, ActorTemplate> template_cache;
   static std::mt19937 rng(RngSeed());
@@ -207,6 +421,8 @@ Actor::Actor(const ActorTemplate* actor_template, const std::set<std::string>& e
   }
 
   animation_specs_ = template_->AnimationSpecs(this);
+  textures_ = template_->Textures(this);
+  template_->MakeProps(this);
 }
 
 void Actor::Update(uint64_t time_us, std::map<std::string, std::shared_ptr<Animation>>& existing_animations) {
@@ -268,17 +484,98 @@ void Actor::Update(uint64_t time_us, std::map<std::string, std::shared_ptr<Anima
 }
 
 void Actor::Render(RenderContext* context) {
+  glm::mat4 model = ModelMatrix();
+  std::optional<BoundingBox> bounds;
+  Render(context, model, &bounds);
+  if (bounds) {
+    bounds_ = bounds;
+    bounds_model_inverse_ = glm::inverse(model);
+  }
+}
+
+void Actor::Render(RenderContext* context, const glm::mat4& model, std::optional<BoundingBox>* bounds) {
+  if (context->pass == RenderPass::kSkinning || context->pass == RenderPass::kGeometry ||
+      context->pass == RenderPass::kShadow || context->pass == RenderPass::kDepthPrepass) {
+    template_->Render(context, this, model, bounds);
+  }
+}
+
+glm::mat4 Actor::ModelMatrix() const {
   // Models are supposed to be using 2m units, so scaling by 0.5 here give us 1m units to match rest of the game.
   // https://trac.wildfiregames.com/wiki/ArtScaleAndProportions
-  Render(context,
-         glm::translate(glm::mat4(1.0f), -position_) * glm::rotate(rotation_rad_, glm::vec3(0.0f, 0.0f, 1.0f)) *
-         glm::scale(glm::vec3(scale_ * 0.5f, scale_ * 0.5f, scale_ * 0.5f)));
+  float scale = rendered_.scale * 0.5f;
+  return glm::translate(glm::mat4(1.0f), -rendered_.position) *
+         glm::rotate(rendered_.rotation_rad, glm::vec3(0.0f, 0.0f, 1.0f)) * glm::scale(glm::vec3(scale, scale, scale));
+}
+
+std::optional<BoundingBox> Actor::WorldBounds() const {
+  if (!bounds_) {
+    return std::nullopt;
+  }
+  return bounds_->Transformed(ModelMatrix() * bounds_model_inverse_);
+}
+
+bool Actor::IsStatic() const {
+  if (!rendered_.bone_transforms.empty()) {
+    return false;
+  }
+  for (const auto& [point, props] : props_) {
+    for (const auto& prop : props) {
+      if (!prop->IsStatic()) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+std::size_t Actor::WriteSnapshots(std::vector<ActorSnapshot>* snapshots, std::size_t index) const {
+  if (snapshots->size() <= index) {
+    snapshots->resize(index + 1);
+  }
+  ActorSnapshot& snapshot = (*snapshots)[index++];
+  snapshot.position = position_;
+  snapshot.rotation_rad = rotation_rad_;
+  snapshot.scale = scale_;
+  snapshot.bone_transforms.assign(bone_transforms_.begin(), bone_transforms_.end());
+
+  for (const auto& [point, props] : props_) {
+    for (const auto& prop : props) {
+      index = prop->WriteSnapshots(snapshots, index);
+    }
+  }
+  return index;
 }
 
-void Actor::Render(RenderContext* context, const glm::mat4& model) {
-  if (context->pass == RenderPass::kGeometry || context->pass == RenderPass::kShadow) {
-    template_->Render(context, this, model);
+std::size_t Actor::ApplySnapshots(const std::vector<ActorSnapshot>& from, const std::vector<ActorSnapshot>& to,
+                                  std::size_t index, float t) {
+  const ActorSnapshot& a = from[index];
+  const ActorSnapshot& b = to[index];
+  ++index;
+
+  rendered_.position = glm::mix(a.position, b.position, t);
+  float rotation_diff = std::remainder(b.rotation_rad - a.rotation_rad, 2.0f * static_cast<float>(M_PI));
+  rendered_.rotation_rad = a.rotation_rad + rotation_diff * t;
+  rendered_.scale = glm::mix(a.scale, b.scale, t);
+
+  // Blending matrices isn't quite right for rotations, but snapshots are close enough together
+  // that it doesn't show. The animation may have changed between them (eg. to one of another
+  // mesh), in which case we just use the newer one.
+  if (a.bone_transforms.size() == b.bone_transforms.size()) {
+    rendered_.bone_transforms.resize(b.bone_transforms.size());
+    for (std::size_t i = 0; i < b.bone_transforms.size(); ++i) {
+      rendered_.bone_transforms[i] = a.bone_transforms[i] + (b.bone_transforms[i] - a.bone_transforms[i]) * t;
+    }
+  } else {
+    rendered_.bone_transforms = b.bone_transforms;
   }
+
+  for (auto& [point, props] : props_) {
+    for (auto& prop : props) {
+      index = prop->ApplySnapshots(from, to, index, t);
+    }
+  }
+  return index;
 }
 
 void Actor::AddPropIfNotExist(const std::string& attachpoint, const ActorTemplate& actor_template) {
@@ -298,27 +595,9 @@ ActorTemplate::ActorTemplate(const std::string& actor_path, std::mt19937* rng)
   LOG_INFO("Actor loaded: %", actor_data_->path()->str());
 }
 
-void ActorTemplate::Render(Renderable::RenderContext* context, Actor* actor, const glm::mat4& model) const {
-  std::string mesh_path;
-  TextureSet textures;
-  std::map<std::string, std::vector<ActorTemplate*>> props;
-  std::map<std::string, AttachmentPoints> attachpoints;
-  std::optional<glm::vec3> object_colour;
-
-  bool shadow_pass = context->pass == RenderPass::kShadow;
-
+void ActorTemplate::MakeProps(Actor* actor) const {
   for (int group = 0; group < actor->NumGroups(); ++group) {
     const data::Variant* variant = actor_data_->groups()->Get(group)->variants()->Get(actor->VariantSelection(group));
-
-    if (variant->mesh_path() && !variant->mesh_path()->str().empty()) {
-      mesh_path = variant->mesh_path()->str();
-      attachpoints = GetAttachPoints(mesh_path);
-    }
-
-    if (!shadow_pass) {
-      textures = TextureManager::GetInstance()->LoadTextures(*variant->textures(), textures);
-    }
-
     for (const auto* prop : *variant->props()) {
       std::string attachpoint = prop->attachpoint()->str();
       std::string prop_actor = prop->actor()->str();
@@ -329,6 +608,23 @@ void ActorTemplate::Render(Renderable::RenderContext* context, Actor* actor, con
         actor->AddPropIfNotExist(attachpoint, GetTemplate(prop_actor));
       }
     }
+  }
+}
+
+void ActorTemplate::Render(Renderable::RenderContext* context, Actor* actor, const glm::mat4& model,
+                           std::optional<BoundingBox>* bounds) const {
+  std::string mesh_path;
+  std::map<std::string, std::vector<ActorTemplate*>> props;
+  std::map<std::string, AttachmentPoints> attachpoints;
+  std::optional<glm::vec3> object_colour;
+
+  for (int group = 0; group < actor->NumGroups(); ++group) {
+    const data::Variant* variant = actor_data_->groups()->Get(group)->variants()->Get(actor->VariantSelection(group));
+
+    if (variant->mesh_path() && !variant->mesh_path()->str().empty()) {
+      mesh_path = variant->mesh_path()->str();
+      attachpoints = GetAttachPoints(mesh_path);
+    }
 
     if (variant->object_colour()) {
       object_colour = glm::vec3(
@@ -358,10 +654,10 @@ void ActorTemplate::Render(Renderable::RenderContext* context, Actor* actor, con
   bool skinning = !actor->BoneTransforms().empty();
 
   // Make bone transforms pre-multiplied by bind pose inverses, and
-  // with the virtual bind pose bone added.
+  // with the virtual bind pose bone added. Only the skinning pass uses them.
   std::vector<glm::mat4> final_bone_transforms;
 
-  if (skinning) {
+  if (skinning && context->pass == RenderPass::kSkinning) {
     auto to_bone_space = BindPoseInverses(actor);
 
     if (to_bone_space.size() != actor->BoneTransforms().size()) {
@@ -387,9 +683,8 @@ void ActorTemplate::Render(Renderable::RenderContext* context, Actor* actor, con
   glm::mat4 render_root = skinning ?
       attachpoints["root"].transform : attachpoints["mesh_root"].transform;
 
-  RenderMesh(mesh_path, textures, context->projection * context->view,
-             model * render_root, maybe_alpha_colour,
-             final_bone_transforms, context);
+  RenderMesh(mesh_path, actor->Textures(), model * render_root, maybe_alpha_colour,
+             skinning, final_bone_transforms, actor->GetSkinnedVertices(), bounds, context);
 
   for (auto& [point, prop_actors] : *(actor->Props())) {
     auto it = attachpoints.find(point);
@@ -402,7 +697,7 @@ void ActorTemplate::Render(Renderable::RenderContext* context, Actor* actor, con
         } else {
           prop_model = model * attachpoints["root"].transform * actor->BoneTransforms()[pt.bone] * pt.transform;
         }
-        prop_actor->Render(context, prop_model);
+        prop_actor->Render(context, prop_model, bounds);
       }
     }
   }
@@ -428,6 +723,15 @@ std::map<std::string, std::vector<const data::AnimationSpec*>> ActorTemplate::An
   return ret;
 }
 
+TextureSet ActorTemplate::Textures(const Actor* actor) const {
+  TextureSet ret;
+  for (int group = 0; group < actor->NumGroups(); ++group) {
+    const data::Variant* variant = actor_data_->groups()->Get(group)->variants()->Get(actor->VariantSelection(group));
+    ret = TextureManager::GetInstance()->LoadTextures(*variant->textures(), ret);
+  }
+  return ret;
+}
+
 std::vector<glm::mat4> ActorTemplate::BindPoseInverses(const Actor* actor) const {
   std::string mesh_path;
   for (int group = 0; group < actor->NumGroups(); ++group) {
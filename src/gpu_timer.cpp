@@ -0,0 +1,89 @@
+#include "gpu_timer.h"
+
+#include "logger.h"
+
+namespace {
+// From EXT_disjoint_timer_query (same values as in ARB_timer_query on desktop GL).
+#ifndef GL_TIME_ELAPSED_EXT
+#define GL_TIME_ELAPSED_EXT 0x88BF
+#endif
+#ifndef GL_GPU_DISJOINT_EXT
+#define GL_GPU_DISJOINT_EXT 0x8FBB
+#endif
+}
+
+GpuTimer::GpuTimer() {
+  glGenQueries(kNumQueries, queries_.data());
+}
+
+GpuTimer::~GpuTimer() {
+  glDeleteQueries(kNumQueries, queries_.data());
+}
+
+/*static*/ bool GpuTimer::Supported() {
+  static bool supported = [] {
+    bool ret = SDL_GL_ExtensionSupported("GL_EXT_disjoint_timer_query") ||
+               SDL_GL_ExtensionSupported("GL_EXT_disjoint_timer_query_webgl2") ||
+               SDL_GL_ExtensionSupported("GL_ARB_timer_query");
+    LOG_INFO("GPU timer queries %", ret ? "supported" : "not supported");
+    return ret;
+  }();
+  return supported;
+}
+
+/*static*/ bool GpuTimer::Disjoint() {
+  #ifndef USE_OPENGL
+  GLint disjoint = GL_FALSE;
+  glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+  return disjoint;
+  #else
+  // Desktop GL doesn't have this.
+  return false;
+  #endif
+}
+
+void GpuTimer::Begin() {
+  Poll();
+  if (num_pending_ == kNumQueries) {
+    return;
+  }
+  int query = (next_to_read_ + num_pending_) % kNumQueries;
+  glBeginQuery(GL_TIME_ELAPSED_EXT, queries_[query]);
+  running_ = true;
+}
+
+void GpuTimer::End() {
+  if (!running_) {
+    return;
+  }
+  glEndQuery(GL_TIME_ELAPSED_EXT);
+  running_ = false;
+  ++num_pending_;
+}
+
+std::optional<float> GpuTimer::LatestMs() {
+  Poll();
+  return latest_ms_;
+}
+
+void GpuTimer::Poll() {
+  while (num_pending_ > 0) {
+    GLuint query = queries_[next_to_read_];
+    GLuint available = GL_FALSE;
+    glGetQueryObjectuiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) {
+      break;
+    }
+
+    // 32 bits of nanoseconds is over 4 seconds, so we don't need the 64-bit query.
+    GLuint elapsed_ns = 0;
+    glGetQueryObjectuiv(query, GL_QUERY_RESULT, &elapsed_ns);
+    if (num_to_discard_ > 0) {
+      --num_to_discard_;
+    } else {
+      latest_ms_ = elapsed_ns / 1000000.0f;
+    }
+    next_to_read_ = (next_to_read_ + 1) % kNumQueries;
+    --num_pending_;
+  }
+}
@@ -15,6 +15,7 @@
 #include "logger.h"
 #include "renderer.h"
 #include "resources.h"
+#include "simulation.h"
 #include "terrain.h"
 #include "ui.h"
 #include "utils.h"
@@ -31,6 +32,7 @@ struct ProgramState {
   std::unique_ptr<Renderer> renderer;
   std::unique_ptr<Terrain> terrain;
   std::vector<Actor> actors;
+  std::unique_ptr<Simulation> simulation;
   std::unique_ptr<UI> ui;
   int32_t last_mouse_x;
   int32_t last_mouse_y;
@@ -133,10 +135,8 @@ bool main_loop() {
 
   uint64_t current_time_us = GetTimeUs();
 
-  // World updates.
-  for (auto& actor : g_state.actors) {
-    actor.Update(current_time_us);
-  }
+  // World updates happen on the simulation thread. This only picks up the latest.
+  g_state.simulation->ApplySnapshot(current_time_us);
 
   int mouse_x;
   int mouse_y;
@@ -224,7 +224,13 @@ bool main_loop() {
   int64_t elapsed = time_now - last_frame_rate_report;
   if (elapsed > kFrameRateReportIntervalUs) {
     double avg_frame_time_ms = static_cast<double>(elapsed) / frames_since_last_report / 1000.0;
-    g_state.ui->SetDebugText(0, FormatString("Avg Frame Time: % ms (% FPS)", avg_frame_time_ms, 1000.0 / avg_frame_time_ms));
+    g_state.ui->SetDebugText(0, FormatString("Avg Frame Time: % ms (% FPS) Render Scale: %", avg_frame_time_ms,
+                                             1000.0 / avg_frame_time_ms, g_state.renderer->RenderScale()));
+    const QualityGovernor& governor = g_state.renderer->GetQualityGovernor();
+    g_state.ui->SetDebugText(2, governor.TierSummary());
+    g_state.ui->SetDebugText(3, governor.PassTimesSummary());
+    g_state.ui->SetDebugText(4, governor.FeatureCostsSummary());
+    g_state.ui->SetDebugText(5, FormatString("Occlusion culled: %", g_state.renderer->NumOcclusionCulled()));
     frames_since_last_report = 0;
     last_frame_rate_report = time_now;
   }
@@ -288,6 +294,7 @@ int main(int /*argc*/, char** /*argv*/) {
   #endif
 
   g_state.renderer = std::make_unique<Renderer>();
+  g_state.renderer->WarmUpShaders();
 
   g_state.terrain = std::make_unique<Terrain>();
 
@@ -309,6 +316,9 @@ int main(int /*argc*/, char** /*argv*/) {
     g_state.actors[i].SetRotationRad(arg + 0.5f * M_PI);
   }
 
+  g_state.simulation = std::make_unique<Simulation>(&g_state.actors);
+  g_state.simulation->Start();
+
   #ifdef __EMSCRIPTEN__
   emscripten_set_main_loop(emscripten_main_loop, 0, 1);
   #else
@@ -316,6 +326,15 @@ int main(int /*argc*/, char** /*argv*/) {
   #endif
   // Anything after this is never executed in emscripten mode.
 
+  g_state.simulation.reset();
+
+  // Everything owning GL objects has to go while we still have a context (and before the
+  // TextureManager singleton, which was made after g_state, is destroyed).
+  g_state.ui.reset();
+  g_state.terrain.reset();
+  g_state.actors.clear();
+  g_state.renderer.reset();
+
   DeInitSDL();
   
   return 0;
@@ -1,22 +1,31 @@
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <cmath>
 #include <condition_variable>
+#include <cstddef>
 #include <cstdint>
 #include <cstdlib>
 #include <filesystem>
 #include <functional>
 #include <iostream>
 #include <iterator>
+#include <limits>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <queue>
 #include <set>
 #include <stack>
 #include <sstream>
 #include <string>
 #include <thread>
+#include <tuple>
 #include <vector>
 
 #include "logger.h"
+#include "thread_pool.h"
 #include "utils.h"
 
 #include "actor_generated.h"
@@ -25,6 +34,7 @@
 #include "resources.h"
 #include "skeleton_generated.h"
 #include "terrain_generated.h"
+#include "texture_arrays_generated.h"
 #include "texture_generated.h"
 
 #include "flatbuffers/flatbuffers.h"
@@ -37,6 +47,10 @@
 #include "gli/gli.hpp"
 #pragma GCC diagnostic pop
 
+#include "glm/glm.hpp"
+#include "glm/gtc/constants.hpp"
+#include "glm/gtc/packing.hpp"
+
 #include "lodepng/lodepng.h"
 #include "tinyxml2/tinyxml2.h"
 #include "libimagequant.h"
@@ -94,77 +108,6 @@ class DoneTracker {
   std::set<std::string> done_set_;
 };
 
-class ThreadPool {
- public:
-  ThreadPool(int num_threads) : num_threads_(num_threads), done_(false) {}
-  ThreadPool(const ThreadPool&) = delete;
-  ThreadPool& operator=(const ThreadPool&) = delete;
-
-  // Tell the workers to exit as soon as the work_queue_ is empty.
-  void SetDone() { done_ = true; cv_.notify_all(); }
-
-  void Push(std::function<void()> work) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    work_queue_.push(work);
-    cv_.notify_one();
-  }
-
-  void Run() {
-    auto worker_fn = [&]() {
-      while (true) {
-        std::function<void()> work;
-        bool all_done = false;
-
-        {
-          std::unique_lock<std::mutex> lock(mutex_);
-          cv_.wait(lock, [&]{ return done_ || !work_queue_.empty(); });
-
-          if (!work_queue_.empty()) {
-            work = work_queue_.front();
-            work_queue_.pop();
-            if (work_queue_.empty() && done_) {
-              // We took the last task, so we should notify everyone to wakeup and die (once we release the mutex).
-              all_done = true;
-            }
-          } else if (done_) {
-            break;
-          }
-        }
-        if (all_done) {
-          cv_.notify_all();
-        }
-        if (work) {
-          work();
-        }
-      }
-    };
-
-    for (int i = 0; i < num_threads_; ++i) {
-      threads_.push_back(std::thread(worker_fn));
-    }
-  }
-
-  void JoinAll() {
-    for (std::thread& t : threads_) {
-      t.join();
-    }
-    threads_.clear();
-  }
-
-  ~ThreadPool() {
-    SetDone();
-    JoinAll();
-  }
-
- private:
-  int num_threads_;
-  bool done_;
-  std::vector<std::thread> threads_;
-  std::queue<std::function<void()>> work_queue_;
-  std::condition_variable cv_;
-  std::mutex mutex_;
-};
-
 std::vector<XMLHandle> GetAllChildrenElements(XMLHandle root, const std::string& elem) {
   std::vector<XMLHandle> ret;
   XMLHandle it = root.FirstChildElement(elem.c_str());
@@ -524,6 +467,85 @@ struct IndexedVertexData {
   std::vector<uint32_t> indices;
 };
 
+// Interleaved vertex as stored in mesh files (and uploaded to the GPU as-is).
+// Attribute locations must match the vertex shaders.
+struct PackedVertex {
+  // unorm16 relative to the mesh bounding box (see Mesh.position_offset and position_scale).
+  // 4th component is padding.
+  uint16_t position[4];
+
+  // snorm16 octahedral encoded unit vectors.
+  int16_t normal[2];
+  int16_t tangent[2];
+
+  // Half floats.
+  uint16_t uv0[2];
+  uint16_t uv1[2];
+
+  // Integer bone ids (0xFF = no influence), and unorm8 weights summing to 255.
+  uint8_t bone_ids[kMaxSkinInfluences];
+  uint8_t bone_weights[kMaxSkinInfluences];
+};
+
+static_assert(sizeof(PackedVertex) == 32);
+
+struct PackedAttribute {
+  uint8_t location;
+  data::VertexAttributeType type;
+  uint8_t components;
+  bool normalised;
+  uint16_t offset;
+};
+
+constexpr PackedAttribute kPackedAttributes[] = {
+  { 0, data::VertexAttributeType_UnsignedShort, 3, true, offsetof(PackedVertex, position) },
+  { 1, data::VertexAttributeType_Short, 2, true, offsetof(PackedVertex, normal) },
+  { 2, data::VertexAttributeType_Short, 2, true, offsetof(PackedVertex, tangent) },
+  { 3, data::VertexAttributeType_HalfFloat, 2, false, offsetof(PackedVertex, uv0) },
+  { 4, data::VertexAttributeType_HalfFloat, 2, false, offsetof(PackedVertex, uv1) },
+  { 5, data::VertexAttributeType_UnsignedByte, kMaxSkinInfluences, false, offsetof(PackedVertex, bone_ids) },
+  { 6, data::VertexAttributeType_UnsignedByte, kMaxSkinInfluences, true, offsetof(PackedVertex, bone_weights) },
+};
+
+// Octahedral encoding of a unit vector into [-1, 1]^2. See:
+// http://jcgt.org/published/0003/02/01/
+glm::vec2 OctahedralEncode(glm::vec3 v) {
+  // Zero vectors (eg. tangents of meshes without UVs) have no direction. Any encoding will do.
+  float l1_norm = std::fabs(v.x) + std::fabs(v.y) + std::fabs(v.z);
+  if (l1_norm < 1e-12f) {
+    return glm::vec2(0.0f, 0.0f);
+  }
+  v /= l1_norm;
+  glm::vec2 ret(v.x, v.y);
+  if (v.z < 0.0f) {
+    ret = (1.0f - glm::abs(glm::vec2(ret.y, ret.x))) *
+          glm::vec2(ret.x >= 0.0f ? 1.0f : -1.0f, ret.y >= 0.0f ? 1.0f : -1.0f);
+  }
+  return ret;
+}
+
+void PackOctahedral(const float* v, int16_t* out) {
+  glm::vec2 encoded = OctahedralEncode(glm::vec3(v[0], v[1], v[2]));
+  out[0] = static_cast<int16_t>(glm::packSnorm1x16(encoded.x));
+  out[1] = static_cast<int16_t>(glm::packSnorm1x16(encoded.y));
+}
+
+// Quantise weights to unorm8 such that they still sum to exactly 255.
+void PackBoneWeights(const float* weights, uint8_t* out) {
+  int sum = 0;
+  int largest = 0;
+  for (int i = 0; i < kMaxSkinInfluences; ++i) {
+    out[i] = static_cast<uint8_t>(std::clamp(std::lround(weights[i] * 255.0f), 0L, 255L));
+    sum += out[i];
+    if (weights[i] > weights[largest]) {
+      largest = i;
+    }
+  }
+  if (sum != 0) {
+    out[largest] = static_cast<uint8_t>(std::clamp(out[largest] + (255 - sum), 0, 255));
+  }
+}
+
 struct RawBoneTransform {
 	float translation[3];
 	float orientation[4];
@@ -561,6 +583,550 @@ IndexedVertexData Reindex(std::vector<VertexData>&& vds) {
   return ret;
 }
 
+// Size of the simulated post-transform vertex cache. Real hardware varies (and is often not
+// a simple FIFO), but 16 is a reasonable lowest common denominator for mobile.
+constexpr int kVertexCacheSize = 16;
+
+struct VertexCacheStats {
+  // Average cache miss ratio (transformed vertices per triangle). Optimal is ~0.5.
+  float acmr;
+
+  // Average transform to vertex ratio. Optimal is 1.0.
+  float atvr;
+};
+
+VertexCacheStats SimulateVertexCache(const std::vector<uint32_t>& indices, std::size_t num_vertices) {
+  std::vector<uint32_t> cache;
+  std::size_t transforms = 0;
+  for (uint32_t index : indices) {
+    if (std::find(cache.begin(), cache.end(), index) == cache.end()) {
+      ++transforms;
+      cache.push_back(index);
+      if (cache.size() > kVertexCacheSize) {
+        cache.erase(cache.begin());
+      }
+    }
+  }
+  VertexCacheStats stats;
+  stats.acmr = indices.empty() ? 0.0f : static_cast<float>(transforms) / (indices.size() / 3);
+  stats.atvr = num_vertices == 0 ? 0.0f : static_cast<float>(transforms) / num_vertices;
+  return stats;
+}
+
+// Reorder triangles for the post-transform vertex cache using Tipsify. See:
+// Sander, Nehab, Barczak. "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw", SIGGRAPH 2007.
+// Returns the reordered triangle list. Triangle indices (into the input) where we hit a dead end (the
+// cache is effectively flushed) are appended to cluster_starts.
+std::vector<uint32_t> Tipsify(const std::vector<uint32_t>& indices, std::size_t num_vertices,
+                              std::vector<std::size_t>* cluster_starts) {
+  std::size_t num_triangles = indices.size() / 3;
+
+  // Vertex -> triangles adjacency, in CSR form.
+  std::vector<uint32_t> live(num_vertices, 0);
+  for (uint32_t index : indices) {
+    ++live[index];
+  }
+  std::vector<std::size_t> adjacency_offsets(num_vertices + 1, 0);
+  for (std::size_t v = 0; v < num_vertices; ++v) {
+    adjacency_offsets[v + 1] = adjacency_offsets[v] + live[v];
+  }
+  std::vector<uint32_t> adjacency(indices.size());
+  std::vector<std::size_t> fill(adjacency_offsets.begin(), adjacency_offsets.end() - 1);
+  for (std::size_t i = 0; i < indices.size(); ++i) {
+    adjacency[fill[indices[i]]++] = i / 3;
+  }
+
+  std::vector<int> cache_time(num_vertices, 0);
+  std::vector<bool> emitted(num_triangles, false);
+  std::vector<uint32_t> dead_end_stack;
+  std::vector<uint32_t> ret;
+  ret.reserve(indices.size());
+
+  int timestamp = kVertexCacheSize + 1;
+  std::size_t cursor = 0;
+  int64_t fanning_vertex = num_vertices > 0 ? 0 : -1;
+
+  cluster_starts->push_back(0);
+
+  while (fanning_vertex >= 0) {
+    std::vector<uint32_t> candidates;
+    for (std::size_t i = adjacency_offsets[fanning_vertex]; i < adjacency_offsets[fanning_vertex + 1]; ++i) {
+      uint32_t triangle = adjacency[i];
+      if (emitted[triangle]) {
+        continue;
+      }
+      for (int j = 0; j < 3; ++j) {
+        uint32_t v = indices[triangle * 3 + j];
+        ret.push_back(v);
+        dead_end_stack.push_back(v);
+        candidates.push_back(v);
+        --live[v];
+        if ((timestamp - cache_time[v]) > kVertexCacheSize) {
+          cache_time[v] = timestamp++;
+        }
+      }
+      emitted[triangle] = true;
+    }
+
+    // Pick the next fanning vertex. Prefer candidates that will still be in the cache after
+    // emitting all their remaining triangles, and among them the oldest.
+    fanning_vertex = -1;
+    int best_priority = -1;
+    for (uint32_t v : candidates) {
+      if (live[v] == 0) {
+        continue;
+      }
+      int priority = 0;
+      if ((timestamp - cache_time[v] + 2 * static_cast<int>(live[v])) <= kVertexCacheSize) {
+        priority = timestamp - cache_time[v];
+      }
+      if (priority > best_priority) {
+        best_priority = priority;
+        fanning_vertex = v;
+      }
+    }
+
+    if (fanning_vertex < 0) {
+      // Dead end. Try recently used vertices first, then fall back to input order.
+      while (!dead_end_stack.empty() && fanning_vertex < 0) {
+        uint32_t v = dead_end_stack.back();
+        dead_end_stack.pop_back();
+        if (live[v] > 0) {
+          fanning_vertex = v;
+        }
+      }
+      while (fanning_vertex < 0 && cursor < num_vertices) {
+        if (live[cursor] > 0) {
+          fanning_vertex = cursor;
+        }
+        ++cursor;
+      }
+      if (fanning_vertex >= 0 && ret.size() > cluster_starts->back() * 3) {
+        cluster_starts->push_back(ret.size() / 3);
+      }
+    }
+  }
+
+  return ret;
+}
+
+// Reorder clusters (runs of triangles produced by Tipsify) so that those facing outwards from
+// the centre of the mesh are drawn first. They are more likely to occlude the rest of the mesh.
+// This is the view-independent overdraw heuristic from the same paper (simplified to not
+// split clusters further).
+std::vector<uint32_t> SortClustersForOverdraw(const std::vector<uint32_t>& indices,
+                                              const std::vector<std::size_t>& cluster_starts,
+                                              const std::vector<glm::vec3>& positions) {
+  std::size_t num_triangles = indices.size() / 3;
+
+  glm::vec3 mesh_centroid(0.0f);
+  for (uint32_t index : indices) {
+    mesh_centroid += positions[index];
+  }
+  if (!indices.empty()) {
+    mesh_centroid /= static_cast<float>(indices.size());
+  }
+
+  struct Cluster {
+    std::size_t begin;
+    std::size_t end;
+    float sort_key;
+  };
+
+  std::vector<Cluster> clusters;
+  for (std::size_t i = 0; i < cluster_starts.size(); ++i) {
+    Cluster cluster;
+    cluster.begin = cluster_starts[i];
+    cluster.end = (i + 1) < cluster_starts.size() ? cluster_starts[i + 1] : num_triangles;
+
+    // Area weighted centroid and normal.
+    glm::vec3 centroid(0.0f);
+    glm::vec3 normal(0.0f);
+    float total_area = 0.0f;
+    for (std::size_t triangle = cluster.begin; triangle < cluster.end; ++triangle) {
+      const glm::vec3& a = positions[indices[triangle * 3]];
+      const glm::vec3& b = positions[indices[triangle * 3 + 1]];
+      const glm::vec3& c = positions[indices[triangle * 3 + 2]];
+      glm::vec3 cross = glm::cross(b - a, c - a);
+      float area = glm::length(cross);
+      centroid += (a + b + c) * (area / 3.0f);
+      normal += cross;
+      total_area += area;
+    }
+    if (total_area > 0.0f) {
+      centroid /= total_area;
+    }
+    float normal_length = glm::length(normal);
+    cluster.sort_key = normal_length > 0.0f ? glm::dot(centroid - mesh_centroid, normal / normal_length) : 0.0f;
+    clusters.push_back(cluster);
+  }
+
+  std::stable_sort(clusters.begin(), clusters.end(), [](const Cluster& a, const Cluster& b) {
+    return a.sort_key > b.sort_key;
+  });
+
+  std::vector<uint32_t> ret;
+  ret.reserve(indices.size());
+  for (const Cluster& cluster : clusters) {
+    ret.insert(ret.end(), indices.begin() + cluster.begin * 3, indices.begin() + cluster.end * 3);
+  }
+  return ret;
+}
+
+// Optimise triangle order for the vertex cache and overdraw.
+std::vector<uint32_t> OptimiseTriangleOrder(const std::vector<uint32_t>& indices,
+                                            const std::vector<glm::vec3>& positions, std::size_t* num_clusters) {
+  std::vector<std::size_t> cluster_starts;
+  std::vector<uint32_t> ret = Tipsify(indices, positions.size(), &cluster_starts);
+  *num_clusters = cluster_starts.size();
+  return SortClustersForOverdraw(ret, cluster_starts, positions);
+}
+
+// Optimise triangle order, then vertex order for fetch locality (vertices are stored in the order
+// they are first used).
+void OptimiseMesh(IndexedVertexData* ivd, const std::string& mesh_path) {
+  std::size_t num_vertices = ivd->vds.size();
+  VertexCacheStats before = SimulateVertexCache(ivd->indices, num_vertices);
+
+  std::vector<glm::vec3> positions;
+  positions.reserve(num_vertices);
+  for (auto& vd : ivd->vds) {
+    positions.push_back(glm::vec3(vd.Position()[0], vd.Position()[1], vd.Position()[2]));
+  }
+
+  std::size_t num_clusters = 0;
+  std::vector<uint32_t> indices = OptimiseTriangleOrder(ivd->indices, positions, &num_clusters);
+
+  constexpr uint32_t kUnassigned = std::numeric_limits<uint32_t>::max();
+  std::vector<uint32_t> remap(num_vertices, kUnassigned);
+  std::vector<VertexData> vds;
+  vds.reserve(num_vertices);
+  for (uint32_t& index : indices) {
+    if (remap[index] == kUnassigned) {
+      remap[index] = vds.size();
+      vds.push_back(ivd->vds[index]);
+    }
+    index = remap[index];
+  }
+
+  ivd->vds = std::move(vds);
+  ivd->indices = std::move(indices);
+
+  VertexCacheStats after = SimulateVertexCache(ivd->indices, ivd->vds.size());
+  LOG_INFO("% vertex cache optimisation (% clusters): ACMR % -> %, ATVR % -> %", mesh_path,
+           num_clusters, before.acmr, after.acmr, before.atvr, after.atvr);
+}
+
+// Fraction of triangles to keep in each successive LOD.
+constexpr float kLodReductionRatio = 0.5f;
+
+// Maximum number of LODs (including the full detail mesh).
+constexpr int kMaxLods = 3;
+
+// Stop generating LODs if a level can't remove at least this fraction of triangles (most
+// likely because of locked vertices).
+constexpr float kMinLodReduction = 0.1f;
+
+struct MeshLod {
+  std::vector<uint32_t> indices;
+
+  // Maximum geometric error relative to the full detail mesh, in model units.
+  float error;
+};
+
+// Symmetric 4x4 error quadric (Garland and Heckbert, "Surface Simplification Using Quadric Error Metrics").
+struct Quadric {
+  double a[10] = {};
+
+  static Quadric FromPlane(const glm::dvec3& n, double d) {
+    Quadric q;
+    q.a[0] = n.x * n.x; q.a[1] = n.x * n.y; q.a[2] = n.x * n.z; q.a[3] = n.x * d;
+    q.a[4] = n.y * n.y; q.a[5] = n.y * n.z; q.a[6] = n.y * d;
+    q.a[7] = n.z * n.z; q.a[8] = n.z * d;
+    q.a[9] = d * d;
+    return q;
+  }
+
+  Quadric& operator+=(const Quadric& other) {
+    for (int i = 0; i < 10; ++i) {
+      a[i] += other.a[i];
+    }
+    return *this;
+  }
+
+  // Sum of squared distances from p to all planes in the quadric.
+  double Evaluate(const glm::dvec3& p) const {
+    return a[0] * p.x * p.x + 2.0 * a[1] * p.x * p.y + 2.0 * a[2] * p.x * p.z + 2.0 * a[3] * p.x +
+           a[4] * p.y * p.y + 2.0 * a[5] * p.y * p.z + 2.0 * a[6] * p.y +
+           a[7] * p.z * p.z + 2.0 * a[8] * p.z +
+           a[9];
+  }
+};
+
+// Quadric of each vertex, from the planes of the triangles using it.
+std::vector<Quadric> VertexQuadrics(const std::vector<uint32_t>& indices, const std::vector<glm::vec3>& positions) {
+  std::vector<Quadric> quadrics(positions.size());
+  for (std::size_t t = 0; t < indices.size(); t += 3) {
+    glm::dvec3 a = positions[indices[t]];
+    glm::dvec3 b = positions[indices[t + 1]];
+    glm::dvec3 c = positions[indices[t + 2]];
+    glm::dvec3 n = glm::cross(b - a, c - a);
+    double length = glm::length(n);
+    if (length > 0.0) {
+      n /= length;
+      Quadric q = Quadric::FromPlane(n, -glm::dot(n, a));
+      for (int i = 0; i < 3; ++i) {
+        quadrics[indices[t + i]] += q;
+      }
+    }
+  }
+  return quadrics;
+}
+
+// Simplify a triangle list with quadric error half-edge collapses (a vertex is always collapsed into
+// one of its neighbours). No new vertices are created, so all LODs can share the vertex buffer, and
+// bone weights are preserved.
+// Vertices with locked[v] set are never removed, and vertices are only collapsed into vertices with
+// the same bone_keys entry, so skinned meshes don't get stretched between bones.
+// quadrics start as VertexQuadrics() of the full detail mesh, and are updated with collapses, so when
+// simplifying a LOD further, errors are still measured against the full detail mesh.
+std::vector<uint32_t> Simplify(const std::vector<uint32_t>& indices, const std::vector<glm::vec3>& positions,
+                               const std::vector<bool>& locked, const std::vector<uint8_t>& bone_keys,
+                               std::size_t target_triangles, std::vector<Quadric>* quadrics_in_out,
+                               float* max_error) {
+  std::size_t num_vertices = positions.size();
+  std::size_t num_triangles = indices.size() / 3;
+  std::vector<uint32_t> triangles = indices;
+  std::vector<bool> triangle_dead(num_triangles, false);
+  std::vector<bool> vertex_removed(num_vertices, false);
+  std::vector<std::vector<uint32_t>> vertex_triangles(num_vertices);
+  std::vector<Quadric>& quadrics = *quadrics_in_out;
+
+  for (std::size_t t = 0; t < num_triangles; ++t) {
+    for (int i = 0; i < 3; ++i) {
+      vertex_triangles[triangles[t * 3 + i]].push_back(t);
+    }
+  }
+
+  auto collapse_cost = [&](uint32_t from, uint32_t to) {
+    Quadric q = quadrics[from];
+    q += quadrics[to];
+    return std::max(0.0, q.Evaluate(positions[to]));
+  };
+
+  struct Collapse {
+    double cost;
+    uint32_t from;
+    uint32_t to;
+    bool operator<(const Collapse& other) const { return cost > other.cost; }
+  };
+  std::priority_queue<Collapse> queue;
+
+  auto push_edges_of = [&](uint32_t v) {
+    for (uint32_t t : vertex_triangles[v]) {
+      if (triangle_dead[t]) {
+        continue;
+      }
+      for (int i = 0; i < 3; ++i) {
+        uint32_t w = triangles[t * 3 + i];
+        if (w == v) {
+          continue;
+        }
+        if (!locked[v] && bone_keys[v] == bone_keys[w]) {
+          queue.push(Collapse{collapse_cost(v, w), v, w});
+        }
+        if (!locked[w] && bone_keys[v] == bone_keys[w]) {
+          queue.push(Collapse{collapse_cost(w, v), w, v});
+        }
+      }
+    }
+  };
+
+  for (uint32_t v = 0; v < num_vertices; ++v) {
+    push_edges_of(v);
+  }
+
+  auto triangle_has = [&](uint32_t t, uint32_t v) {
+    return triangles[t * 3] == v || triangles[t * 3 + 1] == v || triangles[t * 3 + 2] == v;
+  };
+
+  std::size_t live_triangles = num_triangles;
+  double max_cost = 0.0;
+
+  while (live_triangles > target_triangles && !queue.empty()) {
+    Collapse collapse = queue.top();
+    queue.pop();
+    uint32_t from = collapse.from;
+    uint32_t to = collapse.to;
+    if (vertex_removed[from] || vertex_removed[to]) {
+      continue;
+    }
+
+    // The edge may no longer exist.
+    bool edge_exists = false;
+    for (uint32_t t : vertex_triangles[from]) {
+      if (!triangle_dead[t] && triangle_has(t, to)) {
+        edge_exists = true;
+        break;
+      }
+    }
+    if (!edge_exists) {
+      continue;
+    }
+
+    // Quadrics may have changed since this was queued.
+    double cost = collapse_cost(from, to);
+    if (cost > collapse.cost * 1.0001 + 1e-12) {
+      queue.push(Collapse{cost, from, to});
+      continue;
+    }
+
+    // Reject collapses that would flip (or degenerate) any of the remaining triangles.
+    bool flips = false;
+    for (uint32_t t : vertex_triangles[from]) {
+      if (triangle_dead[t] || triangle_has(t, to)) {
+        continue;
+      }
+      glm::vec3 p[3];
+      glm::vec3 p_new[3];
+      for (int i = 0; i < 3; ++i) {
+        uint32_t v = triangles[t * 3 + i];
+        p[i] = positions[v];
+        p_new[i] = positions[v == from ? to : v];
+      }
+      glm::vec3 n = glm::cross(p[1] - p[0], p[2] - p[0]);
+      glm::vec3 n_new = glm::cross(p_new[1] - p_new[0], p_new[2] - p_new[0]);
+      if (glm::dot(n, n_new) <= 0.0f) {
+        flips = true;
+        break;
+      }
+    }
+    if (flips) {
+      continue;
+    }
+
+    for (uint32_t t : vertex_triangles[from]) {
+      if (triangle_dead[t]) {
+        continue;
+      }
+      if (triangle_has(t, to)) {
+        triangle_dead[t] = true;
+        --live_triangles;
+      } else {
+        for (int i = 0; i < 3; ++i) {
+          if (triangles[t * 3 + i] == from) {
+            triangles[t * 3 + i] = to;
+          }
+        }
+        vertex_triangles[to].push_back(t);
+      }
+    }
+    vertex_triangles[from].clear();
+    vertex_removed[from] = true;
+    quadrics[to] += quadrics[from];
+    max_cost = std::max(max_cost, cost);
+
+    push_edges_of(to);
+  }
+
+  std::vector<uint32_t> ret;
+  ret.reserve(live_triangles * 3);
+  for (std::size_t t = 0; t < num_triangles; ++t) {
+    if (!triangle_dead[t]) {
+      ret.insert(ret.end(), triangles.begin() + t * 3, triangles.begin() + t * 3 + 3);
+    }
+  }
+
+  *max_error = std::max(*max_error, static_cast<float>(std::sqrt(max_cost)));
+  return ret;
+}
+
+// Generate LODs 1 and up from the (already optimised) full detail mesh. LODs share vertices with the
+// full detail mesh.
+std::vector<MeshLod> GenerateLods(const IndexedVertexData& ivd, bool skinned, const std::string& mesh_path) {
+  std::size_t num_vertices = ivd.vds.size();
+
+  std::vector<glm::vec3> positions;
+  positions.reserve(num_vertices);
+  for (auto vd : ivd.vds) {
+    positions.push_back(glm::vec3(vd.Position()[0], vd.Position()[1], vd.Position()[2]));
+  }
+
+  // Vertices that are split because of other attributes (UV seams, hard edges) are locked, since
+  // collapsing only one side of the seam would tear the mesh. So are vertices on open borders.
+  // Borders are found on a position-welded mesh, otherwise edges along seams would look like borders.
+  std::map<std::tuple<float, float, float>, uint32_t> position_ids;
+  std::vector<uint32_t> welded(num_vertices);
+  std::vector<uint32_t> position_use_count;
+  for (std::size_t v = 0; v < num_vertices; ++v) {
+    auto key = std::make_tuple(positions[v].x, positions[v].y, positions[v].z);
+    auto [it, inserted] = position_ids.insert(std::make_pair(key, position_ids.size()));
+    if (inserted) {
+      position_use_count.push_back(0);
+    }
+    welded[v] = it->second;
+    ++position_use_count[it->second];
+  }
+
+  std::map<std::pair<uint32_t, uint32_t>, int> welded_edge_counts;
+  for (std::size_t t = 0; t < ivd.indices.size(); t += 3) {
+    for (int i = 0; i < 3; ++i) {
+      uint32_t a = welded[ivd.indices[t + i]];
+      uint32_t b = welded[ivd.indices[t + (i + 1) % 3]];
+      ++welded_edge_counts[std::make_pair(std::min(a, b), std::max(a, b))];
+    }
+  }
+
+  std::vector<bool> locked_positions(position_use_count.size(), false);
+  for (const auto& [edge, count] : welded_edge_counts) {
+    if (count != 2) {
+      locked_positions[edge.first] = true;
+      locked_positions[edge.second] = true;
+    }
+  }
+
+  std::vector<bool> locked(num_vertices);
+  std::vector<uint8_t> bone_keys(num_vertices, 0xFF);
+  for (std::size_t v = 0; v < num_vertices; ++v) {
+    locked[v] = position_use_count[welded[v]] > 1 || locked_positions[welded[v]];
+
+    // Use the most influential bone.
+    if (skinned) {
+      VertexData vd = ivd.vds[v];
+      int best = 0;
+      for (int i = 1; i < kMaxSkinInfluences; ++i) {
+        if (*vd.BoneWeight(i) > *vd.BoneWeight(best)) {
+          best = i;
+        }
+      }
+      bone_keys[v] = static_cast<uint8_t>(*vd.BoneId(best));
+    }
+  }
+
+  std::vector<MeshLod> lods;
+  const std::vector<uint32_t>* prev_indices = &ivd.indices;
+  std::vector<Quadric> quadrics = VertexQuadrics(ivd.indices, positions);
+  float error = 0.0f;
+  for (int lod = 1; lod < kMaxLods; ++lod) {
+    std::size_t prev_triangles = prev_indices->size() / 3;
+    std::size_t target = static_cast<std::size_t>(prev_triangles * kLodReductionRatio);
+    std::vector<uint32_t> indices = Simplify(*prev_indices, positions, locked, bone_keys, target, &quadrics, &error);
+    if ((indices.size() / 3) > prev_triangles * (1.0f - kMinLodReduction)) {
+      LOG_INFO("% LOD %: only % -> % triangles, stopping", mesh_path, lod, prev_triangles, indices.size() / 3);
+      break;
+    }
+
+    std::size_t num_clusters = 0;
+    MeshLod mesh_lod;
+    mesh_lod.indices = OptimiseTriangleOrder(indices, positions, &num_clusters);
+    mesh_lod.error = error;
+    LOG_INFO("% LOD %: % -> % triangles, error %", mesh_path, lod, prev_triangles, indices.size() / 3, error);
+    lods.push_back(std::move(mesh_lod));
+    prev_indices = &lods.back().indices;
+  }
+  return lods;
+}
+
 // Reduce number of influences on each joint to kMaxSkinInfluences.
 // See https://github.com/0ad/0ad/blob/c7d07d3979f969b969211a5e5748fa775f6768a7/source/collada/CommonConvert.cpp#L303
 // We don't drop weights less than min weight because we don't want to branch in the shader anyways.
@@ -725,6 +1291,439 @@ void AddSkinnedAttachmentPoints(FCDControllerInstance* controller_instance, std:
   }
 }
 
+// ETC2 / EAC block compression, for textures that are uploaded with glCompressedTexImage2D.
+// The formats are described in the OpenGL ES 3.0 spec, appendix C.1. The ETC2 RGB encoder
+// only uses the ETC1 compatible individual and differential modes.
+
+// Intensity modifiers of the ETC RGB modes, for selector 0 (+a) and 1 (+b). Selectors 2 and
+// 3 are -a and -b.
+constexpr int kEtcModifiers[8][2] = {
+  {2, 8}, {5, 17}, {9, 29}, {13, 42}, {18, 60}, {24, 80}, {33, 106}, {47, 183}
+};
+
+constexpr int kEacModifiers[16][8] = {
+  {-3, -6, -9, -15, 2, 5, 8, 14},
+  {-3, -7, -10, -13, 2, 6, 9, 12},
+  {-2, -5, -8, -13, 1, 4, 7, 12},
+  {-2, -4, -6, -13, 1, 3, 5, 12},
+  {-3, -6, -8, -12, 2, 5, 7, 11},
+  {-3, -7, -9, -11, 2, 6, 8, 10},
+  {-4, -7, -8, -11, 3, 6, 7, 10},
+  {-3, -5, -8, -11, 2, 4, 7, 10},
+  {-2, -6, -8, -10, 1, 5, 7, 9},
+  {-2, -5, -8, -10, 1, 4, 7, 9},
+  {-2, -4, -8, -10, 1, 3, 7, 9},
+  {-2, -5, -7, -10, 1, 4, 6, 9},
+  {-3, -4, -7, -10, 2, 3, 6, 9},
+  {-1, -2, -3, -10, 0, 1, 2, 9},
+  {-4, -6, -8, -9, 3, 5, 7, 8},
+  {-3, -5, -7, -9, 2, 4, 6, 8},
+};
+
+constexpr std::size_t kEtcBlockBytes = 8;
+
+// Pixels in a 4x4 block are numbered in column-major order (index = x * 4 + y), as in the
+// spec.
+using EtcBlockPixels = std::array<glm::ivec4, 16>;
+
+int EtcModifier(int table, int selector) {
+  int modifier = kEtcModifiers[table][selector & 1];
+  return (selector & 2) ? -modifier : modifier;
+}
+
+// Finds the best intensity table and selectors for a subblock with the given (expanded)
+// base colour. Returns the squared error.
+int FitEtcSubblock(const EtcBlockPixels& pixels, const std::array<int, 8>& subblock,
+                   const glm::ivec3& base, int* best_table, std::array<int, 8>* best_selectors) {
+  int best_error = std::numeric_limits<int>::max();
+  for (int table = 0; table < 8; ++table) {
+    int error = 0;
+    std::array<int, 8> selectors;
+    for (int i = 0; i < 8; ++i) {
+      const glm::ivec4& pixel = pixels[subblock[i]];
+      int best_pixel_error = std::numeric_limits<int>::max();
+      for (int selector = 0; selector < 4; ++selector) {
+        glm::ivec3 decoded = glm::clamp(base + EtcModifier(table, selector), 0, 255);
+        glm::ivec3 diff = decoded - glm::ivec3(pixel);
+        int pixel_error = diff.r * diff.r + diff.g * diff.g + diff.b * diff.b;
+        if (pixel_error < best_pixel_error) {
+          best_pixel_error = pixel_error;
+          selectors[i] = selector;
+        }
+      }
+      error += best_pixel_error;
+      if (error >= best_error) {
+        break;
+      }
+    }
+    if (error < best_error) {
+      best_error = error;
+      *best_table = table;
+      *best_selectors = selectors;
+    }
+  }
+  return best_error;
+}
+
+uint64_t EncodeEtcRgbBlock(const EtcBlockPixels& pixels) {
+  uint64_t best_block = 0;
+  int best_error = std::numeric_limits<int>::max();
+
+  for (int flip = 0; flip < 2; ++flip) {
+    // Without flip, subblocks are the left and right 2x4 halves. With flip, top and bottom.
+    std::array<std::array<int, 8>, 2> subblocks;
+    for (int x = 0; x < 4; ++x) {
+      for (int y = 0; y < 4; ++y) {
+        int half = flip ? (y / 2) : (x / 2);
+        int index_in_half = flip ? (x * 2 + y % 2) : ((x % 2) * 4 + y);
+        subblocks[half][index_in_half] = x * 4 + y;
+      }
+    }
+
+    std::array<glm::vec3, 2> averages;
+    for (int half = 0; half < 2; ++half) {
+      glm::vec3 sum(0.0f);
+      for (int pixel : subblocks[half]) {
+        sum += glm::vec3(pixels[pixel]);
+      }
+      averages[half] = sum / 8.0f;
+    }
+
+    for (int differential = 0; differential < 2; ++differential) {
+      // Individual mode has a 4 bit colour per subblock. Differential mode has a 5 bit colour
+      // for the first subblock, and a 3 bit signed delta for the second. The delta must stay
+      // in range, or the block would be decoded as one of the other ETC2 modes.
+      int max_quantised = differential ? 31 : 15;
+      auto expand = [differential](const glm::ivec3& c) {
+        return differential ? ((c << 3) | (c >> 2)) : c * 17;
+      };
+
+      // Start from the quantised average colours, then try stepping each channel, and all of them
+      // together (along the intensity axis).
+      constexpr glm::ivec3 kColourSteps[] = {
+        {0, 0, 0}, {-1, 0, 0}, {1, 0, 0}, {0, -1, 0}, {0, 1, 0}, {0, 0, -1}, {0, 0, 1}, {-1, -1, -1}, {1, 1, 1}
+      };
+      std::array<glm::ivec3, 2> colours;
+      std::array<int, 2> tables;
+      std::array<std::array<int, 8>, 2> selectors;
+      int error = 0;
+      for (int half = 0; half < 2; ++half) {
+        glm::ivec3 start = glm::clamp(glm::ivec3(glm::round(averages[half] * (max_quantised / 255.0f))),
+                                      0, max_quantised);
+        if (differential && half == 1) {
+          start = glm::clamp(start, colours[0] - 4, colours[0] + 3);
+        }
+
+        int best_half_error = std::numeric_limits<int>::max();
+        for (const glm::ivec3& step : kColourSteps) {
+          glm::ivec3 colour = start + step;
+          if (glm::any(glm::lessThan(colour, glm::ivec3(0))) ||
+              glm::any(glm::greaterThan(colour, glm::ivec3(max_quantised)))) {
+            continue;
+          }
+          if (differential && half == 1 &&
+              (glm::any(glm::lessThan(colour - colours[0], glm::ivec3(-4))) ||
+               glm::any(glm::greaterThan(colour - colours[0], glm::ivec3(3))))) {
+            continue;
+          }
+          int table;
+          std::array<int, 8> half_selectors;
+          int half_error = FitEtcSubblock(pixels, subblocks[half], expand(colour), &table, &half_selectors);
+          if (half_error < best_half_error) {
+            best_half_error = half_error;
+            colours[half] = colour;
+            tables[half] = table;
+            selectors[half] = half_selectors;
+          }
+        }
+        error += best_half_error;
+      }
+
+      if (error < best_error) {
+        best_error = error;
+        uint64_t block = 0;
+        for (int channel = 0; channel < 3; ++channel) {
+          uint64_t first = colours[0][channel];
+          uint64_t second = differential ? ((colours[1][channel] - colours[0][channel]) & 0x7) : colours[1][channel];
+          int shift = 56 - channel * 8;
+          block |= differential ? ((first << 3 | second) << shift) : ((first << 4 | second) << shift);
+        }
+        block |= static_cast<uint64_t>(tables[0]) << 37;
+        block |= static_cast<uint64_t>(tables[1]) << 34;
+        block |= static_cast<uint64_t>(differential) << 33;
+        block |= static_cast<uint64_t>(flip) << 32;
+        for (int half = 0; half < 2; ++half) {
+          for (int i = 0; i < 8; ++i) {
+            int pixel = subblocks[half][i];
+            int selector = selectors[half][i];
+            block |= static_cast<uint64_t>(selector >> 1) << (16 + pixel);
+            block |= static_cast<uint64_t>(selector & 1) << pixel;
+          }
+        }
+        best_block = block;
+      }
+    }
+  }
+  return best_block;
+}
+
+// EAC decoding of one value. 11-bit values (R11/RG11) are in [0, 2047], and 8-bit values
+// (ETC2 alpha) are in [0, 255].
+int EacDecode(int base, int multiplier, int modifier, bool eleven_bit) {
+  if (eleven_bit) {
+    int value = base * 8 + 4 + (multiplier == 0 ? modifier : modifier * multiplier * 8);
+    return std::clamp(value, 0, 2047);
+  } else {
+    return std::clamp(base + modifier * multiplier, 0, 255);
+  }
+}
+
+// Values are in the decoded range (see EacDecode()).
+uint64_t EncodeEacBlock(const std::array<int, 16>& values, bool eleven_bit) {
+  int min_value = *std::min_element(values.begin(), values.end());
+  int max_value = *std::max_element(values.begin(), values.end());
+  int scale = eleven_bit ? 8 : 1;
+
+  uint64_t best_block = 0;
+  int64_t best_error = std::numeric_limits<int64_t>::max();
+
+  for (int table = 0; table < 16 && best_error > 0; ++table) {
+    const int* modifiers = kEacModifiers[table];
+    int modifier_min = modifiers[3];
+    int modifier_max = modifiers[7];
+
+    // The multiplier that makes the table span the range of values, and its neighbours.
+    int ideal_multiplier = (max_value - min_value) / ((modifier_max - modifier_min) * scale);
+    int min_multiplier = std::max(ideal_multiplier, eleven_bit ? 0 : 1);
+    int max_multiplier = std::min(ideal_multiplier + 1, 15);
+
+    for (int multiplier = min_multiplier; multiplier <= max_multiplier; ++multiplier) {
+      int effective_multiplier = (eleven_bit && multiplier == 0) ? 1 : multiplier * scale;
+
+      // Base that centres the table on the range of values.
+      int ideal_base = ((min_value + max_value) - (modifier_min + modifier_max) * effective_multiplier) / 2;
+      if (eleven_bit) {
+        ideal_base = (ideal_base - 4) / 8;
+      }
+
+      for (int base = std::max(ideal_base - 1, 0); base <= std::min(ideal_base + 1, 255); ++base) {
+        int64_t error = 0;
+        uint64_t selector_bits = 0;
+        for (int pixel = 0; pixel < 16; ++pixel) {
+          int best_pixel_error = std::numeric_limits<int>::max();
+          int best_selector = 0;
+          for (int selector = 0; selector < 8; ++selector) {
+            int diff = EacDecode(base, multiplier, modifiers[selector], eleven_bit) - values[pixel];
+            if (diff * diff < best_pixel_error) {
+              best_pixel_error = diff * diff;
+              best_selector = selector;
+            }
+          }
+          error += best_pixel_error;
+          if (error >= best_error) {
+            break;
+          }
+          selector_bits |= static_cast<uint64_t>(best_selector) << (45 - 3 * pixel);
+        }
+        if (error < best_error) {
+          best_error = error;
+          best_block = static_cast<uint64_t>(base) << 56 | static_cast<uint64_t>(multiplier) << 52 |
+                       static_cast<uint64_t>(table) << 48 | selector_bits;
+        }
+      }
+    }
+  }
+  return best_block;
+}
+
+void AppendBigEndian(uint64_t block, std::vector<uint8_t>* out) {
+  for (int byte = 7; byte >= 0; --byte) {
+    out->push_back((block >> (byte * 8)) & 0xff);
+  }
+}
+
+// Compresses an RGBA8 image into GL_COMPRESSED_RGBA8_ETC2_EAC, or (for normal maps, which
+// only need X and Y) GL_COMPRESSED_RG11_EAC. Both are 16 bytes per 4x4 block. Partial blocks
+// at the edges are padded by repeating the last row/column.
+std::vector<uint8_t> CompressEtc2(const std::vector<uint8_t>& rgba, int width, int height, bool rg_only) {
+  std::vector<uint8_t> ret;
+  int blocks_x = (width + 3) / 4;
+  int blocks_y = (height + 3) / 4;
+  ret.reserve(blocks_x * blocks_y * kEtcBlockBytes * 2);
+  for (int block_y = 0; block_y < blocks_y; ++block_y) {
+    for (int block_x = 0; block_x < blocks_x; ++block_x) {
+      EtcBlockPixels pixels;
+      for (int x = 0; x < 4; ++x) {
+        for (int y = 0; y < 4; ++y) {
+          int image_x = std::min(block_x * 4 + x, width - 1);
+          int image_y = std::min(block_y * 4 + y, height - 1);
+          const uint8_t* pixel = &rgba[(image_y * width + image_x) * 4];
+          pixels[x * 4 + y] = glm::ivec4(pixel[0], pixel[1], pixel[2], pixel[3]);
+        }
+      }
+
+      if (rg_only) {
+        for (int channel = 0; channel < 2; ++channel) {
+          std::array<int, 16> values;
+          for (int i = 0; i < 16; ++i) {
+            values[i] = (pixels[i][channel] * 2047 + 127) / 255;
+          }
+          AppendBigEndian(EncodeEacBlock(values, /*eleven_bit=*/true), &ret);
+        }
+      } else {
+        std::array<int, 16> alpha;
+        for (int i = 0; i < 16; ++i) {
+          alpha[i] = pixels[i].a;
+        }
+        AppendBigEndian(EncodeEacBlock(alpha, /*eleven_bit=*/false), &ret);
+        AppendBigEndian(EncodeEtcRgbBlock(pixels), &ret);
+      }
+    }
+  }
+  return ret;
+}
+
+struct MipLevel {
+  int width;
+  int height;
+  std::vector<uint8_t> rgba;
+};
+
+// Kaiser window parameters for mip generation. The filter is a Kaiser windowed sinc, with
+// kKaiserRadius (in destination pixels) on each side.
+constexpr float kKaiserAlpha = 4.0f;
+constexpr float kKaiserRadius = 1.5f;
+
+float SrgbToLinear(float x) {
+  return x <= 0.04045f ? x / 12.92f : std::pow((x + 0.055f) / 1.055f, 2.4f);
+}
+
+float LinearToSrgb(float x) {
+  return x <= 0.0031308f ? x * 12.92f : 1.055f * std::pow(x, 1.0f / 2.4f) - 0.055f;
+}
+
+// Zeroth order modified Bessel function of the first kind (for the Kaiser window).
+float BesselI0(float x) {
+  float sum = 1.0f;
+  float term = 1.0f;
+  for (int k = 1; k < 20; ++k) {
+    term *= (x / (2.0f * k)) * (x / (2.0f * k));
+    sum += term;
+  }
+  return sum;
+}
+
+float KaiserSinc(float x) {
+  if (std::abs(x) >= kKaiserRadius) {
+    return 0.0f;
+  }
+  float t = x / kKaiserRadius;
+  float window = BesselI0(kKaiserAlpha * std::sqrt(1.0f - t * t)) / BesselI0(kKaiserAlpha);
+  float sinc = x == 0.0f ? 1.0f : std::sin(glm::pi<float>() * x) / (glm::pi<float>() * x);
+  return sinc * window;
+}
+
+// Resamples one dimension of a linear RGBA image. Pixels along the dimension are stride
+// apart, and lines are line_stride apart. Edges are clamped.
+std::vector<glm::vec4> KaiserDownsample1D(const std::vector<glm::vec4>& image, int size, int new_size, int lines,
+                                          int stride, int line_stride, int new_stride, int new_line_stride) {
+  std::vector<glm::vec4> ret(lines * new_size);
+  float scale = static_cast<float>(size) / new_size;
+  for (int i = 0; i < new_size; ++i) {
+    // Sample position of the output pixel centre, in source pixels.
+    float centre = (i + 0.5f) * scale;
+    int first = static_cast<int>(std::floor(centre - kKaiserRadius * scale));
+    int last = static_cast<int>(std::ceil(centre + kKaiserRadius * scale));
+    std::vector<std::pair<int, float>> taps;
+    float total_weight = 0.0f;
+    for (int source = first; source <= last; ++source) {
+      float weight = KaiserSinc((source + 0.5f - centre) / scale);
+      if (weight != 0.0f) {
+        taps.emplace_back(std::clamp(source, 0, size - 1), weight);
+        total_weight += weight;
+      }
+    }
+    for (int line = 0; line < lines; ++line) {
+      glm::vec4 sum(0.0f);
+      for (const auto& [source, weight] : taps) {
+        sum += image[line * line_stride + source * stride] * weight;
+      }
+      ret[line * new_line_stride + i * new_stride] = sum / total_weight;
+    }
+  }
+  return ret;
+}
+
+// Generates the full mip chain of an RGBA8 image (level 0 is the image itself).
+// Colour (sRGB) textures are filtered in linear space. Other data (AO, specular) is filtered
+// as is. Normal maps (Y already inverted) are renormalised at each level. Alpha is filtered
+// like any other channel, since it's the player colour mask, not alpha tested.
+std::vector<MipLevel> GenerateMipChain(const std::vector<uint8_t>& rgba, int width, int height, bool normal_map,
+                                       bool srgb) {
+  std::vector<glm::vec4> image(width * height);
+  for (int i = 0; i < width * height; ++i) {
+    glm::vec4 pixel = glm::vec4(rgba[i * 4], rgba[i * 4 + 1], rgba[i * 4 + 2], rgba[i * 4 + 3]) / 255.0f;
+    if (srgb) {
+      pixel = glm::vec4(SrgbToLinear(pixel.r), SrgbToLinear(pixel.g), SrgbToLinear(pixel.b), pixel.a);
+    }
+    image[i] = pixel;
+  }
+
+  std::vector<MipLevel> levels;
+  levels.push_back(MipLevel{width, height, rgba});
+
+  // Filtering is always done from the previous level in floating point, so there's no
+  // accumulation of quantisation error.
+  while (width > 1 || height > 1) {
+    int new_width = std::max(width / 2, 1);
+    int new_height = std::max(height / 2, 1);
+    image = KaiserDownsample1D(image, width, new_width, /*lines=*/height, /*stride=*/1, /*line_stride=*/width,
+                               /*new_stride=*/1, /*new_line_stride=*/new_width);
+    image = KaiserDownsample1D(image, height, new_height, /*lines=*/new_width, /*stride=*/new_width,
+                               /*line_stride=*/1, /*new_stride=*/new_width, /*new_line_stride=*/1);
+    width = new_width;
+    height = new_height;
+
+    MipLevel level{width, height, std::vector<uint8_t>(width * height * 4)};
+    for (int i = 0; i < width * height; ++i) {
+      glm::vec4 pixel = glm::clamp(image[i], 0.0f, 1.0f);
+      if (normal_map) {
+        glm::vec3 normal = glm::vec3(pixel) * 2.0f - 1.0f;
+        normal = glm::length(normal) > 0.0f ? glm::normalize(normal) : glm::vec3(0.0f, 0.0f, 1.0f);
+        pixel = glm::vec4(normal * 0.5f + 0.5f, pixel.a);
+      } else if (srgb) {
+        pixel = glm::vec4(LinearToSrgb(pixel.r), LinearToSrgb(pixel.g), LinearToSrgb(pixel.b), pixel.a);
+      }
+      for (int channel = 0; channel < 4; ++channel) {
+        level.rgba[i * 4 + channel] = static_cast<uint8_t>(std::round(pixel[channel] * 255.0f));
+      }
+    }
+    levels.push_back(std::move(level));
+  }
+  return levels;
+}
+
+// Writes a KTX file with a compressed mip chain. Normal maps are stored as RG11 (the shader
+// reconstructs Z).
+void WriteCompressedTexture(const std::string& output_path, const std::vector<MipLevel>& levels, bool normal_map) {
+  gli::texture2d texture(normal_map ? gli::FORMAT_RG_EAC_UNORM_BLOCK16 : gli::FORMAT_RGBA_ETC2_UNORM_BLOCK16,
+                         gli::texture2d::extent_type(levels[0].width, levels[0].height), levels.size());
+  for (std::size_t level = 0; level < levels.size(); ++level) {
+    std::vector<uint8_t> compressed =
+        CompressEtc2(levels[level].rgba, levels[level].width, levels[level].height, /*rg_only=*/normal_map);
+    if (compressed.size() != texture.size(level)) {
+      LOG_ERROR("Unexpected compressed size for % level %: % (expected %)", output_path, level,
+                compressed.size(), texture.size(level));
+      return;
+    }
+    memcpy(texture.data(0, 0, level), compressed.data(), compressed.size());
+  }
+
+  if (!gli::save_ktx(texture, output_path)) {
+    LOG_ERROR("Failed to write %", output_path);
+  }
+}
+
 void WriteImageOpt(const std::string& output_path, std::vector<uint8_t>* uncompressed, int width, int height) {
   // Make sure min alpha is 1, because libimagequant assumes we don't care about RGB if alpha = 0, and in textures
   // alpha may not actually be used as transparency.
@@ -1029,64 +2028,63 @@ void ParseMesh(const std::string& mesh_path) {
 
   LOG_DEBUG("% deduplicated vertex data", ivd.vds.size());
 
-  std::vector<float> vertices(ivd.vds.size() * 3);
-  for (uint32_t i = 0; i < ivd.vds.size(); ++i) {
-    float* vec = ivd.vds[i].Position();
-    vertices[i * 3] = vec[0];
-    vertices[i * 3 + 1] = vec[1];
-    vertices[i * 3 + 2] = vec[2];
-  }
+  OptimiseMesh(&ivd, mesh_path);
 
-  std::vector<float> normals(ivd.vds.size() * 3);
-  for (uint32_t i = 0; i < ivd.vds.size(); ++i) {
-    float* vec = ivd.vds[i].Normal();
-    normals[i * 3] = vec[0];
-    normals[i * 3 + 1] = vec[1];
-    normals[i * 3 + 2] = vec[2];
-  }
+  std::vector<MeshLod> lods = GenerateLods(ivd, /*skinned=*/skin != nullptr, mesh_path);
 
-  std::vector<float> tangents(ivd.vds.size() * 3);
-  for (uint32_t i = 0; i < ivd.vds.size(); ++i) {
-    float* vec = ivd.vds[i].Tangent();
-    tangents[i * 3] = vec[0];
-    tangents[i * 3 + 1] = vec[1];
-    tangents[i * 3 + 2] = vec[2];
+  // Quantise positions to the bounding box.
+  glm::vec3 aabb_min(std::numeric_limits<float>::max());
+  glm::vec3 aabb_max(std::numeric_limits<float>::lowest());
+  for (auto& vd : ivd.vds) {
+    glm::vec3 position(vd.Position()[0], vd.Position()[1], vd.Position()[2]);
+    aabb_min = glm::min(aabb_min, position);
+    aabb_max = glm::max(aabb_max, position);
+  }
+  if (ivd.vds.empty()) {
+    aabb_min = aabb_max = glm::vec3(0.0f);
   }
+  glm::vec3 extent = aabb_max - aabb_min;
 
-  std::vector<float> tex_coords(ivd.vds.size() * 2);
+  std::vector<PackedVertex> packed_vertices(ivd.vds.size());
   for (uint32_t i = 0; i < ivd.vds.size(); ++i) {
-    float* vec = ivd.vds[i].UV0();
-    tex_coords[i * 2] = vec[0];
-    tex_coords[i * 2 + 1] = -vec[1];
-  }
+    VertexData& vd = ivd.vds[i];
+    PackedVertex& pv = packed_vertices[i];
 
-  std::vector<float> ao_tex_coords(ivd.vds.size() * 2, 0.0f);
-  if (texcoords_data.size() >= 2) {
-    for (uint32_t i = 0; i < ivd.vds.size(); ++i) {
-      float* vec = ivd.vds[i].UV1();
-      ao_tex_coords[i * 2] = vec[0];
-      ao_tex_coords[i * 2 + 1] = -vec[1];
+    for (int j = 0; j < 3; ++j) {
+      float normalised = extent[j] > 0.0f ? ((vd.Position()[j] - aabb_min[j]) / extent[j]) : 0.0f;
+      pv.position[j] = glm::packUnorm1x16(normalised);
     }
-  }
+    pv.position[3] = 0;
 
-  std::vector<uint8_t> bone_indices(ivd.vds.size() * kMaxSkinInfluences);
-  if (skin) {
-    for (uint32_t i = 0; i < ivd.vds.size(); ++i) {
-      for (int bone = 0; bone < kMaxSkinInfluences; ++bone) {
-        bone_indices[i * kMaxSkinInfluences + bone] = static_cast<uint8_t>(*ivd.vds[i].BoneId(bone));
-      }
+    PackOctahedral(vd.Normal(), pv.normal);
+    PackOctahedral(vd.Tangent(), pv.tangent);
+
+    pv.uv0[0] = glm::packHalf1x16(vd.UV0()[0]);
+    pv.uv0[1] = glm::packHalf1x16(-vd.UV0()[1]);
+
+    if (texcoords_data.size() >= 2) {
+      pv.uv1[0] = glm::packHalf1x16(vd.UV1()[0]);
+      pv.uv1[1] = glm::packHalf1x16(-vd.UV1()[1]);
+    } else {
+      pv.uv1[0] = pv.uv1[1] = glm::packHalf1x16(0.0f);
     }
-  }
 
-  std::vector<float> bone_weights(ivd.vds.size() * kMaxSkinInfluences);
-  if (skin) {
-    for (uint32_t i = 0; i < ivd.vds.size(); ++i) {
+    if (skin) {
+      float weights[kMaxSkinInfluences];
       for (int bone = 0; bone < kMaxSkinInfluences; ++bone) {
-        bone_weights[i * kMaxSkinInfluences + bone] = *ivd.vds[i].BoneWeight(bone);
+        pv.bone_ids[bone] = static_cast<uint8_t>(*vd.BoneId(bone));
+        weights[bone] = *vd.BoneWeight(bone);
       }
+      PackBoneWeights(weights, pv.bone_weights);
+    } else {
+      std::fill(std::begin(pv.bone_ids), std::end(pv.bone_ids), 0);
+      std::fill(std::begin(pv.bone_weights), std::end(pv.bone_weights), 0);
     }
   }
 
+  data::Vec3 position_offset(aabb_min.x, aabb_min.y, aabb_min.z);
+  data::Vec3 position_scale(extent.x, extent.y, extent.z);
+
   // bind_pose_transform is size 0 if not skinned.
   std::vector<float> bind_pose_transforms;
   if (skin) {
@@ -1135,21 +2133,48 @@ void ParseMesh(const std::string& mesh_path) {
     attachment_point_bones.push_back(bone);
   }
 
+  std::vector<flatbuffers::Offset<data::VertexAttribute>> vertex_attributes;
+  for (const auto& attrib : kPackedAttributes) {
+    vertex_attributes.push_back(data::CreateVertexAttribute(
+        builder, attrib.location, attrib.type, attrib.components, attrib.normalised, attrib.offset));
+  }
+  auto vertex_attributes_fb = builder.CreateVector(vertex_attributes);
+
+  // All LODs are stored in the same index buffer, after the full detail mesh.
+  std::vector<uint32_t> all_indices = ivd.indices;
+  std::vector<data::MeshLod> lods_fb;
+  lods_fb.push_back(data::MeshLod(/*first_index=*/0, /*num_indices=*/ivd.indices.size(), /*error=*/0.0f));
+  for (const auto& lod : lods) {
+    lods_fb.push_back(data::MeshLod(all_indices.size(), lod.indices.size(), lod.error));
+    all_indices.insert(all_indices.end(), lod.indices.begin(), lod.indices.end());
+  }
+
+  // Use 16-bit indices if possible (almost always).
+  std::vector<uint32_t> vertex_indices;
+  std::vector<uint16_t> vertex_indices_16;
+  if (ivd.vds.size() <= (std::numeric_limits<uint16_t>::max() + 1)) {
+    vertex_indices_16.assign(all_indices.begin(), all_indices.end());
+  } else {
+    LOG_INFO("% has % vertices, using 32-bit indices", mesh_path, ivd.vds.size());
+    vertex_indices = std::move(all_indices);
+  }
+
   auto mesh_fb = data::CreateMesh(
     builder,
     /*path=*/builder.CreateString(RemoveExtension(mesh_path)),
-    /*vertex_indices=*/builder.CreateVector(ivd.indices),
-    /*vertices=*/builder.CreateVector(vertices),
-    /*normals=*/builder.CreateVector(normals),
-    /*tangents=*/builder.CreateVector(tangents),
-    /*tex_coords=*/builder.CreateVector(tex_coords),
-    /*ao_tex_coords=*/builder.CreateVector(ao_tex_coords),
-    /*bone_indices=*/builder.CreateVector(bone_indices),
-    /*bone_weights=*/builder.CreateVector(bone_weights),
+    /*vertex_indices=*/builder.CreateVector(vertex_indices),
     /*bind_pose_transforms=*/builder.CreateVector(bind_pose_transforms),
     /*attachment_point_names=*/builder.CreateVectorOfStrings(attachment_point_names),
     /*attachment_point_transforms=*/builder.CreateVector(attachment_point_transforms),
-    /*attachment_point_bones=*/builder.CreateVector(attachment_point_bones)
+    /*attachment_point_bones=*/builder.CreateVector(attachment_point_bones),
+    /*packed_vertices=*/builder.CreateVector(reinterpret_cast<const uint8_t*>(packed_vertices.data()),
+                                             packed_vertices.size() * sizeof(PackedVertex)),
+    /*vertex_stride=*/sizeof(PackedVertex),
+    /*vertex_attributes=*/vertex_attributes_fb,
+    /*position_offset=*/&position_offset,
+    /*position_scale=*/&position_scale,
+    /*vertex_indices_16=*/builder.CreateVector(vertex_indices_16),
+    /*lods=*/builder.CreateVectorOfStructs(lods_fb)
     );
   builder.Finish(mesh_fb);
   WriteFB(std::string(kOutputPrefix) + kMeshPathPrefix + RemoveExtension(mesh_path),
@@ -1158,8 +2183,9 @@ void ParseMesh(const std::string& mesh_path) {
 
 std::unique_ptr<ThreadPool> g_texture_animation_pool;
 
-// Normal maps need to have inverted green for right handed coordinate system.
-void SaveTexture(const std::string& texture_path, bool invert_green) {
+// Normal maps need to have inverted green for right handed coordinate system. srgb is for colour
+// textures, which need to be filtered in linear space.
+void SaveTexture(const std::string& texture_path, bool invert_green, bool srgb) {
   static DoneTracker done_tracker;
   if (done_tracker.ShouldSkip(texture_path)) {
     return;
@@ -1213,7 +2239,17 @@ void SaveTexture(const std::string& texture_path, bool invert_green) {
         uncompressed[idx] = 255 - uncompressed[idx];
       }
     }
-    WriteImageOpt(output_path, &uncompressed, width, height);
+    std::vector<MipLevel> levels = GenerateMipChain(uncompressed, width, height, /*normal_map=*/invert_green,
+                                                    srgb);
+    WriteCompressedTexture(std::string(kOutputPrefix) + kTexturePathPrefix + RemoveExtension(texture_path) + ".ktx",
+                           levels, /*normal_map=*/invert_green);
+
+    // The PNG fallback has level 0 in the usual place, and the other levels in separate files.
+    for (std::size_t level = 0; level < levels.size(); ++level) {
+      std::string level_path = level == 0 ? output_path : (std::string(kOutputPrefix) + kTexturePathPrefix +
+          RemoveExtension(texture_path) + "_mip" + std::to_string(level) + ".png");
+      WriteImageOpt(level_path, &levels[level].rgba, levels[level].width, levels[level].height);
+    }
   } else {
     LOG_ERROR("Unknown texture extension: %", old_extension);
     return;
@@ -1427,8 +2463,8 @@ void SaveAnimation(const std::string& animation_path) {
   }
 }
 
-void EnqueueTexture(const std::string& texture_path, bool invert_green) {
-  g_texture_animation_pool->Push([=]() { SaveTexture(texture_path, invert_green); });
+void EnqueueTexture(const std::string& texture_path, bool invert_green, bool srgb) {
+  g_texture_animation_pool->Push([=]() { SaveTexture(texture_path, invert_green, srgb); });
   LOG_INFO("Enqueued texture % (invert %)", texture_path, invert_green);
 }
 
@@ -1439,6 +2475,135 @@ void EnqueueAnimation(const std::string& animation_path) {
 
 std::unique_ptr<ThreadPool> g_parser_pool;
 
+// Textures are packed into texture arrays by material slot and size. Layers are assigned when
+// actors and terrains are parsed, so they can go into the actor/terrain flatbuffers. That's
+// before textures are converted, so sizes come from the source file headers.
+// Arrays are capped in size so streaming one in doesn't take too much memory.
+constexpr int kMaxTextureArrayTexels = 1 << 22;
+
+// Minimum GL_MAX_ARRAY_TEXTURE_LAYERS in OpenGL ES 3.0.
+constexpr int kMaxTextureArrayLayers = 256;
+
+struct TextureArrayLayout {
+  int width;
+  int height;
+  std::vector<std::string> layers;
+};
+
+struct TextureArrayLayer {
+  std::string array;
+  int layer;
+};
+
+std::mutex g_texture_arrays_mutex;
+
+// By array name.
+std::map<std::string, TextureArrayLayout> g_texture_arrays;
+
+// By texture file (relative to the textures directory, without extension).
+std::map<std::string, TextureArrayLayer> g_texture_array_layers;
+
+// Names of arrays for each slot and size. Only the last one can have space left.
+std::map<std::string, std::vector<std::string>> g_texture_arrays_by_key;
+
+std::optional<glm::ivec2> SourceImageSize(const std::string& full_path) {
+  std::vector<uint8_t> file_content = ReadWholeFile(full_path);
+  std::string extension = Extension(full_path);
+  if (extension == "png") {
+    unsigned width = 0;
+    unsigned height = 0;
+    lodepng::State state;
+    if (lodepng_inspect(&width, &height, &state, file_content.data(), file_content.size()) == 0) {
+      return glm::ivec2(width, height);
+    }
+  } else if (extension == "dds") {
+    // "DDS ", then the DDS_HEADER, which has height and width after its size and flags.
+    if (file_content.size() >= 20 && memcmp(file_content.data(), "DDS ", 4) == 0) {
+      uint32_t height;
+      uint32_t width;
+      memcpy(&height, &file_content[12], sizeof(height));
+      memcpy(&width, &file_content[16], sizeof(width));
+      return glm::ivec2(width, height);
+    }
+  }
+  return std::nullopt;
+}
+
+// texture_path is relative to the textures directory. slot is the material slot (eg.
+// "baseTex"). Returns std::nullopt if the texture can't be read (the runtime falls back to
+// using the texture on its own).
+std::optional<TextureArrayLayer> AssignTextureArrayLayer(const std::string& texture_path, const std::string& slot) {
+  std::string texture_file = RemoveExtension(texture_path);
+  {
+    std::lock_guard<std::mutex> guard(g_texture_arrays_mutex);
+    auto it = g_texture_array_layers.find(texture_file);
+    if (it != g_texture_array_layers.end()) {
+      return it->second;
+    }
+  }
+
+  std::optional<glm::ivec2> size = SourceImageSize(std::string(kInputPrefix) + kTexturePathPrefix + texture_path);
+  if (!size) {
+    LOG_ERROR("Failed to read image size of %", texture_path);
+    return std::nullopt;
+  }
+
+  std::lock_guard<std::mutex> guard(g_texture_arrays_mutex);
+
+  // Another thread may have got here first while we were reading the file.
+  auto it = g_texture_array_layers.find(texture_file);
+  if (it != g_texture_array_layers.end()) {
+    return it->second;
+  }
+
+  std::string key = slot + "_" + std::to_string(size->x) + "x" + std::to_string(size->y);
+  int max_layers = std::clamp(kMaxTextureArrayTexels / (size->x * size->y), 1, kMaxTextureArrayLayers);
+  std::vector<std::string>& arrays = g_texture_arrays_by_key[key];
+  if (arrays.empty() || static_cast<int>(g_texture_arrays[arrays.back()].layers.size()) >= max_layers) {
+    std::string array_name = key + "_" + std::to_string(arrays.size());
+    g_texture_arrays[array_name] = TextureArrayLayout{size->x, size->y, {}};
+    arrays.push_back(array_name);
+  }
+
+  TextureArrayLayout& array = g_texture_arrays[arrays.back()];
+  TextureArrayLayer layer{arrays.back(), static_cast<int>(array.layers.size())};
+  array.layers.push_back(texture_file);
+  g_texture_array_layers[texture_file] = layer;
+  return layer;
+}
+
+// Makes a data::Texture, and enqueues the texture for conversion.
+flatbuffers::Offset<data::Texture> MakeTexture(flatbuffers::FlatBufferBuilder* builder, const std::string& slot,
+                                               const std::string& texture_path) {
+  bool invert_green = slot == "normTex";
+  // Only base textures are colours. The others (normal, specular, AO) are data.
+  bool srgb = slot == "baseTex";
+  EnqueueTexture(texture_path, invert_green, srgb);
+  std::optional<TextureArrayLayer> array_layer = AssignTextureArrayLayer(texture_path, slot);
+  return data::CreateTexture(
+      *builder,
+      /*name=*/builder->CreateString(slot),
+      /*file=*/builder->CreateString(RemoveExtension(texture_path)),
+      /*array=*/array_layer ? builder->CreateString(array_layer->array) : flatbuffers::Offset<flatbuffers::String>(),
+      /*layer=*/array_layer ? array_layer->layer : -1);
+}
+
+void WriteTextureArrays() {
+  flatbuffers::FlatBufferBuilder builder(kFlatBuilderInitSize);
+  std::vector<flatbuffers::Offset<data::TextureArray>> arrays;
+  for (const auto& [name, array] : g_texture_arrays) {
+    arrays.push_back(data::CreateTextureArray(
+        builder,
+        /*name=*/builder.CreateString(name),
+        /*width=*/array.width,
+        /*height=*/array.height,
+        /*layers=*/builder.CreateVectorOfStrings(array.layers)));
+  }
+  builder.Finish(data::CreateTextureArrays(builder, builder.CreateVector(arrays)));
+  WriteFB(std::string(kOutputPrefix) + kTexturePathPrefix + "texture_arrays", builder);
+  LOG_INFO("% textures packed into % texture arrays", g_texture_array_layers.size(), g_texture_arrays.size());
+}
+
 void MakeActor(const std::string& actor_path) {
   static DoneTracker done_tracker;
   if (done_tracker.ShouldSkip(actor_path)) {
@@ -1562,13 +2727,7 @@ void MakeActor(const std::string& actor_path) {
         for (auto& texture : textures) {
           std::string texture_name = texture.ToElement()->Attribute("name");
           std::string texture_file = texture.ToElement()->Attribute("file");
-          bool invert_green = texture_name == "normTex";
-          EnqueueTexture(kActorTexturePathPrefix + texture_file, invert_green);
-          texture_offsets.push_back(data::CreateTexture(
-              builder,
-              /*name=*/builder.CreateString(texture_name),
-              /*file=*/builder.CreateString(kActorTexturePathPrefix + RemoveExtension(texture_file))
-            ));
+          texture_offsets.push_back(MakeTexture(&builder, texture_name, kActorTexturePathPrefix + texture_file));
         }
       }
 
@@ -1691,13 +2850,7 @@ void MakeTerrain(const std::string& terrain_path) {
     for (auto& texture : textures) {
       std::string texture_name = texture.ToElement()->Attribute("name");
       std::string texture_file = texture.ToElement()->Attribute("file");
-      bool invert_green = texture_name == "normTex";
-      EnqueueTexture(kTerrainTexturePathPrefix + texture_file, invert_green);
-      texture_offsets.push_back(data::CreateTexture(
-          builder,
-          /*name=*/builder.CreateString(texture_name),
-          /*file=*/builder.CreateString(kTerrainTexturePathPrefix + RemoveExtension(texture_file))
-        ));
+      texture_offsets.push_back(MakeTexture(&builder, texture_name, kTerrainTexturePathPrefix + texture_file));
     }
   }
 
@@ -1912,6 +3065,8 @@ int main(int /*argc*/, char** /*argv*/) {
 
   g_texture_animation_pool.reset();
 
+  WriteTextureArrays();
+
   FCollada::Release();
   LOG_INFO("Took % seconds", (GetTimeUs() - start_time) / 1000000.0f);
   return 0;
@@ -0,0 +1,124 @@
+#include "mesh_buffer_pool.h"
+
+#include <algorithm>
+
+#include "logger.h"
+#include "utils.h"
+
+namespace {
+// Most a page can have with 16-bit indices.
+static constexpr std::size_t kMaxPageVertices = 65536;
+
+// 1 MiB of 16-bit indices. This is a few times what 65536 vertices need for all LODs of
+// typical meshes.
+static constexpr std::size_t kPageIndices = 512 * 1024;
+}
+
+bool MeshBufferPool::VertexFormat::operator==(const VertexFormat& other) const {
+  if (stride != other.stride || attribs.size() != other.attribs.size()) {
+    return false;
+  }
+  for (std::size_t i = 0; i < attribs.size(); ++i) {
+    const Renderer::AttribSpec& a = attribs[i];
+    const Renderer::AttribSpec& b = other.attribs[i];
+    if (a.attrib_location != b.attrib_location || a.gl_type != b.gl_type ||
+        a.components_per_element != b.components_per_element || a.normalised != b.normalised ||
+        a.offset != b.offset) {
+      return false;
+    }
+  }
+  return true;
+}
+
+MeshAllocation MeshBufferPool::Allocate(const VertexFormat& format, const void* vertices, std::size_t num_vertices,
+                                        const std::vector<uint32_t>& indices) {
+  MeshAllocation allocation;
+  allocation.num_vertices = num_vertices;
+  allocation.num_indices = indices.size();
+
+  bool found = false;
+  if (num_vertices <= kMaxPageVertices) {
+    for (std::size_t i = 0; i < pages_.size() && !found; ++i) {
+      Page& page = pages_[i];
+      if (page.index_type != GL_UNSIGNED_SHORT || page.format != format ||
+          (page.used_vertices + num_vertices) > page.vertex_capacity ||
+          (page.used_indices + indices.size()) > page.index_capacity) {
+        continue;
+      }
+      allocation.page = i;
+      found = true;
+    }
+  }
+
+  if (!found) {
+    allocation.page = MakePage(format, num_vertices, indices.size());
+  }
+
+  Page& page = pages_[allocation.page];
+  allocation.first_vertex = page.used_vertices;
+  allocation.first_index = page.used_indices;
+  page.used_vertices += num_vertices;
+  page.used_indices += indices.size();
+
+  allocation.vao = page.vao;
+  allocation.vertex_buffer = page.vertex_buffer;
+  allocation.index_type = page.index_type;
+  allocation.index_size = page.index_size;
+  allocation.index_offset = allocation.first_index * page.index_size;
+
+  // The element array buffer binding is VAO state, so the page's VAO has to be bound.
+  Renderer::UseVAO(page.vao);
+
+  glBindBuffer(GL_ARRAY_BUFFER, page.vertex_buffer);
+  glBufferSubData(GL_ARRAY_BUFFER, allocation.first_vertex * format.stride, num_vertices * format.stride, vertices);
+  CHECK_GL_ERROR
+
+  if (page.index_type == GL_UNSIGNED_SHORT) {
+    std::vector<uint16_t> rebased(indices.size());
+    for (std::size_t i = 0; i < indices.size(); ++i) {
+      rebased[i] = static_cast<uint16_t>(indices[i] + allocation.first_vertex);
+    }
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, allocation.index_offset, rebased.size() * sizeof(uint16_t), rebased.data());
+  } else {
+    std::vector<uint32_t> rebased(indices.size());
+    for (std::size_t i = 0; i < indices.size(); ++i) {
+      rebased[i] = static_cast<uint32_t>(indices[i] + allocation.first_vertex);
+    }
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, allocation.index_offset, rebased.size() * sizeof(uint32_t), rebased.data());
+  }
+  CHECK_GL_ERROR
+
+  return allocation;
+}
+
+std::size_t MeshBufferPool::MakePage(const VertexFormat& format, std::size_t num_vertices, std::size_t num_indices) {
+  bool large = num_vertices > kMaxPageVertices;
+  std::size_t vertex_capacity = std::max(num_vertices, kMaxPageVertices);
+  std::size_t index_capacity = std::max(num_indices, kPageIndices);
+  GLenum index_type = large ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT;
+  std::size_t index_size = large ? sizeof(uint32_t) : sizeof(uint16_t);
+
+  GLuint vao;
+  glGenVertexArrays(1, &vao);
+  CHECK_GL_ERROR
+  Renderer::UseVAO(vao);
+
+  GLuint buffers[2];
+  glGenBuffers(2, buffers);
+  CHECK_GL_ERROR
+
+  glBindBuffer(GL_ARRAY_BUFFER, buffers[0]);
+  glBufferData(GL_ARRAY_BUFFER, vertex_capacity * format.stride, nullptr, GL_STATIC_DRAW);
+  CHECK_GL_ERROR
+  Renderer::SetUpAttribs(format.attribs, format.stride);
+
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers[1]);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, index_capacity * index_size, nullptr, GL_STATIC_DRAW);
+  CHECK_GL_ERROR
+
+  pages_.push_back(Page{format, index_type, index_size, vao, buffers[0], buffers[1],
+                        vertex_capacity, index_capacity});
+  LOG_INFO("Mesh buffer page % made (% vertices of % bytes, % indices)", pages_.size() - 1,
+           vertex_capacity, format.stride, index_capacity);
+  return pages_.size() - 1;
+}
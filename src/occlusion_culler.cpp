@@ -0,0 +1,130 @@
+#include "occlusion_culler.h"
+
+#include "renderer.h"
+
+namespace {
+// Renderables not seen for this many frames (eg. deleted) are forgotten.
+constexpr static uint64_t kForgetFrames = 60;
+
+constexpr static int kBoxNumIndices = 36;
+}
+
+OcclusionCuller::OcclusionCuller() {
+  shader_ = GetShader("occlusion_box.vs", "occlusion_box.fs");
+
+  const static std::vector<GLfloat> vertices = {
+    0.0f, 0.0f, 0.0f,
+    1.0f, 0.0f, 0.0f,
+    0.0f, 1.0f, 0.0f,
+    1.0f, 1.0f, 0.0f,
+    0.0f, 0.0f, 1.0f,
+    1.0f, 0.0f, 1.0f,
+    0.0f, 1.0f, 1.0f,
+    1.0f, 1.0f, 1.0f,
+  };
+
+  // Face culling is disabled while drawing boxes, so winding doesn't matter.
+  const static std::vector<GLushort> indices = {
+    0, 1, 2,  2, 1, 3, // z = 0
+    4, 5, 6,  6, 5, 7, // z = 1
+    0, 1, 4,  4, 1, 5, // y = 0
+    2, 3, 6,  6, 3, 7, // y = 1
+    0, 2, 4,  4, 2, 6, // x = 0
+    1, 3, 5,  5, 3, 7, // x = 1
+  };
+
+  box_vao_ = Renderer::MakeVAO({
+    Renderer::VBOSpec(vertices, 0, GL_FLOAT, 3),
+  },
+  Renderer::EBOSpec(indices));
+}
+
+OcclusionCuller::~OcclusionCuller() {
+  Clear();
+}
+
+void OcclusionCuller::CollectResults() {
+  for (auto& [renderable, occludee] : occludees_) {
+    if (!occludee.pending) {
+      continue;
+    }
+    GLuint available = GL_FALSE;
+    glGetQueryObjectuiv(occludee.query, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) {
+      continue;
+    }
+    GLuint any_samples_passed = GL_TRUE;
+    glGetQueryObjectuiv(occludee.query, GL_QUERY_RESULT, &any_samples_passed);
+    occludee.visible = any_samples_passed != GL_FALSE;
+    occludee.pending = false;
+  }
+  CHECK_GL_ERROR
+}
+
+void OcclusionCuller::IssueQueries(const std::vector<std::pair<Renderable*, BoundingBox>>& occludees,
+                                   const glm::vec3& eye_pos, uint64_t frame) {
+  shader_->Activate();
+  Renderer::UseVAO(box_vao_);
+  glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+  glDepthMask(GL_FALSE);
+  glDisable(GL_CULL_FACE);
+
+  for (const auto& [renderable, bounds] : occludees) {
+    Occludee& occludee = occludees_[renderable];
+    occludee.last_tested_frame = frame;
+    if (occludee.pending) {
+      continue;
+    }
+
+    // The box would be clipped by the near plane, and may not draw anything.
+    if (bounds.Contains(eye_pos)) {
+      occludee.visible = true;
+      continue;
+    }
+
+    if (occludee.query == 0) {
+      glGenQueries(1, &occludee.query);
+    }
+    shader_->SetUniform("box_min"_name, bounds.min);
+    shader_->SetUniform("box_max"_name, bounds.max);
+    glBeginQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE, occludee.query);
+    glDrawElements(GL_TRIANGLES, kBoxNumIndices, GL_UNSIGNED_SHORT, (const void*) 0);
+    glEndQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE);
+    occludee.pending = true;
+  }
+
+  glEnable(GL_CULL_FACE);
+  glDepthMask(GL_TRUE);
+  glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+  CHECK_GL_ERROR
+
+  for (auto it = occludees_.begin(); it != occludees_.end();) {
+    if ((frame - it->second.last_tested_frame) > kForgetFrames) {
+      if (it->second.query != 0) {
+        glDeleteQueries(1, &it->second.query);
+      }
+      it = occludees_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void OcclusionCuller::Clear() {
+  for (auto& [renderable, occludee] : occludees_) {
+    if (occludee.query != 0) {
+      glDeleteQueries(1, &occludee.query);
+    }
+  }
+  occludees_.clear();
+}
+
+std::size_t OcclusionCuller::NumCulled() const {
+  std::size_t ret = 0;
+  for (const auto& [renderable, occludee] : occludees_) {
+    if (!occludee.visible) {
+      ++ret;
+    }
+  }
+  return ret;
+}
@@ -0,0 +1,206 @@
+#include "quality_governor.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+#include "logger.h"
+
+namespace {
+// Weight of the latest frame in smoothed pass times.
+constexpr static float kPassTimeSmoothing = 0.1f;
+
+// Frames to wait after a tier change before changing again, so smoothed times can catch up.
+constexpr static uint64_t kSettleFrames = 60;
+
+// Frames before retrying a tier we stepped down from.
+constexpr static uint64_t kRetryFrames = 600;
+
+// Step down above this fraction of the budget.
+constexpr static float kStepDownFraction = 1.1f;
+
+// Step up below this fraction of the budget (GPU time only, see Renderer::UpdateRenderScale()),
+// if the feature turned on is expected to keep us below kStepUpTargetFraction.
+constexpr static float kStepUpFraction = 0.75f;
+constexpr static float kStepUpTargetFraction = 0.9f;
+
+// Frames StepUpProbe holds off stepping up for after a change, at least and at most.
+constexpr static uint64_t kMinProbeHoldFrames = 300;
+constexpr static uint64_t kMaxProbeHoldFrames = kMinProbeHoldFrames << 5;
+
+// A step down within this many frames of a step up means the step up was too much.
+constexpr static uint64_t kProbeFailFrames = 120;
+
+constexpr static const char* kPassNames[kNumTimedPasses] = {
+  "skin", "shadow", "depth", "geometry", "post", "ui"
+};
+
+constexpr static const char* kFeatureNames[kNumQualityFeatures] = {
+  "specular", "AO", "normal map", "SMAA", "shadows"
+};
+
+// Pass measuring the cost of features with a pass of their own.
+std::optional<TimedPass> OwnPass(QualityFeature feature) {
+  switch (feature) {
+    case QualityFeature::kSMAA: return TimedPass::kPostProcess;
+    case QualityFeature::kShadows: return TimedPass::kShadow;
+    default: return std::nullopt;
+  }
+}
+
+std::string FormatMs(const std::optional<float>& ms) {
+  if (!ms) {
+    return "?";
+  }
+  std::ostringstream ss;
+  ss << std::fixed << std::setprecision(2) << *ms;
+  return ss.str();
+}
+}
+
+StepUpProbe::StepUpProbe() : hold_frames_(kMinProbeHoldFrames) {}
+
+void StepUpProbe::Update(uint64_t frame, bool stepped_down, bool stepped_up) {
+  if (stepped_down) {
+    if (last_step_up_frame_ && (frame - *last_step_up_frame_) < kProbeFailFrames) {
+      hold_frames_ = std::min(hold_frames_ * 2, kMaxProbeHoldFrames);
+    }
+    last_step_up_frame_.reset();
+    last_change_frame_ = frame;
+  } else if (stepped_up) {
+    if (last_step_up_frame_) {
+      // The last step up held.
+      hold_frames_ = kMinProbeHoldFrames;
+    }
+    last_step_up_frame_ = frame;
+    last_change_frame_ = frame;
+  }
+}
+
+QualityGovernor::QualityGovernor(float budget_ms) : budget_ms_(budget_ms) {}
+
+void QualityGovernor::Update(uint64_t frame, float frame_time_ms, bool gpu_time,
+                             const std::array<std::optional<float>, kNumTimedPasses>& pass_ms,
+                             QualityFeatureMask user_features, bool can_step_down, bool can_step_up) {
+  for (int i = 0; i < kNumTimedPasses; ++i) {
+    if (!pass_ms[i]) {
+      continue;
+    }
+    if (smoothed_pass_ms_[i]) {
+      *smoothed_pass_ms_[i] += (*pass_ms[i] - *smoothed_pass_ms_[i]) * kPassTimeSmoothing;
+    } else {
+      smoothed_pass_ms_[i] = pass_ms[i];
+    }
+  }
+
+  for (int i = 0; i < kNumQualityFeatures; ++i) {
+    auto feature = static_cast<QualityFeature>(i);
+    std::optional<TimedPass> pass = OwnPass(feature);
+    if (pass && Allows(feature) && (user_features & QualityFeatureBit(feature)) &&
+        pass_ms[static_cast<int>(*pass)]) {
+      feature_cost_ms_[i] = smoothed_pass_ms_[static_cast<int>(*pass)];
+    }
+  }
+
+  if ((frame - last_change_frame_) < kSettleFrames) {
+    return;
+  }
+
+  const std::optional<float>& geometry_ms = smoothed_pass_ms_[static_cast<int>(TimedPass::kGeometry)];
+  if (changed_feature_ && geometry_ms_before_change_ && geometry_ms) {
+    float diff = *geometry_ms - *geometry_ms_before_change_;
+    feature_cost_ms_[static_cast<int>(*changed_feature_)] = std::max(Allows(*changed_feature_) ? diff : -diff, 0.0f);
+  }
+  changed_feature_.reset();
+
+  if (frame_time_ms > (budget_ms_ * kStepDownFraction)) {
+    if (!can_step_down) {
+      return;
+    }
+    // Turning off features the user has already turned off doesn't help.
+    int tier = tier_;
+    while (tier > 0 && !(user_features & QualityFeatureBit(FeatureOfTier(tier)))) {
+      --tier;
+    }
+    if (tier > 0) {
+      too_slow_tier_ = tier_;
+      too_slow_frame_ = frame;
+      SetTier(frame, tier - 1, FeatureOfTier(tier));
+    }
+    return;
+  }
+
+  if (tier_ == kMaxTier || !can_step_up) {
+    return;
+  }
+
+  int tier = tier_ + 1;
+  while (tier < kMaxTier && !(user_features & QualityFeatureBit(FeatureOfTier(tier)))) {
+    ++tier;
+  }
+  QualityFeature feature = FeatureOfTier(tier);
+  bool user_enabled = user_features & QualityFeatureBit(feature);
+
+  if (!gpu_time) {
+    // CPU frame time can't show headroom with vsync. The caller's StepUpProbe decides.
+    SetTier(frame, tier, feature);
+    return;
+  }
+
+  if (tier >= too_slow_tier_ && (frame - too_slow_frame_) < kRetryFrames) {
+    return;
+  }
+
+  float cost = user_enabled ? feature_cost_ms_[static_cast<int>(feature)].value_or(0.0f) : 0.0f;
+  if (frame_time_ms < (budget_ms_ * kStepUpFraction) &&
+      (frame_time_ms + cost) < (budget_ms_ * kStepUpTargetFraction)) {
+    SetTier(frame, tier, feature);
+  }
+}
+
+void QualityGovernor::Reset() {
+  tier_ = kMaxTier;
+  changed_feature_.reset();
+  too_slow_tier_ = kMaxTier + 1;
+}
+
+void QualityGovernor::SetTier(uint64_t frame, int tier, QualityFeature toggled_feature) {
+  tier_ = tier;
+  last_change_frame_ = frame;
+
+  // Features with their own pass are measured directly.
+  if (!OwnPass(toggled_feature)) {
+    changed_feature_ = toggled_feature;
+    geometry_ms_before_change_ = smoothed_pass_ms_[static_cast<int>(TimedPass::kGeometry)];
+  }
+
+  LOG_INFO("Quality tier % (% turned %)", tier_, kFeatureNames[static_cast<int>(toggled_feature)],
+           Allows(toggled_feature) ? "on" : "off");
+}
+
+std::string QualityGovernor::TierSummary() const {
+  std::string ret = FormatString("Quality tier %/%, budget % ms", tier_, kMaxTier, FormatMs(budget_ms_));
+  for (int i = 0; i < kNumQualityFeatures; ++i) {
+    if (!Allows(static_cast<QualityFeature>(i))) {
+      ret += (i == 0) ? ", off: " : ", ";
+      ret += kFeatureNames[i];
+    }
+  }
+  return ret;
+}
+
+std::string QualityGovernor::PassTimesSummary() const {
+  std::string ret = "GPU ms:";
+  for (int i = 0; i < kNumTimedPasses; ++i) {
+    ret += FormatString(" % %", kPassNames[i], FormatMs(smoothed_pass_ms_[i]));
+  }
+  return ret;
+}
+
+std::string QualityGovernor::FeatureCostsSummary() const {
+  std::string ret = "Feature cost ms:";
+  for (int i = 0; i < kNumQualityFeatures; ++i) {
+    ret += FormatString(" % %", kFeatureNames[i], FormatMs(feature_cost_ms_[i]));
+  }
+  return ret;
+}
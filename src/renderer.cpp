@@ -14,10 +14,14 @@
 #include "platform_includes.h"
 #include "texture_manager.h"
 
+#include <algorithm>
+#include <cmath>
 #include <cstddef>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <sstream>
+#include <utility>
 
 namespace {
 constexpr static float kFov = 60.0f;
@@ -29,12 +33,73 @@ constexpr static float kZoomSpeed = 1e-5f;
 constexpr static int kShadowMapSize = 2048;
 
 constexpr static glm::vec3 kLightPos(150.0f, 0.0f, 75.0f);
+
+// Dynamic resolution. The render scale is kRenderScaleStep * steps, between 0.5 and 1.
+constexpr static float kRenderScaleStep = 0.05f;
+constexpr static int kMinRenderScaleSteps = 10;
+constexpr static int kMaxRenderScaleSteps = 20;
+constexpr static float kTargetFrameTimeMs = 1000.0f / 60.0f;
+
+// Weight of the latest frame in the smoothed frame time.
+constexpr static float kFrameTimeSmoothing = 0.1f;
+
+// Frames to wait after a change before changing the scale again, so the smoothed frame time
+// can catch up.
+constexpr static uint64_t kRenderScaleChangeInterval = 30;
+
+GLuint MakeUniformBuffer(std::size_t size, GLuint binding) {
+  GLuint ubo;
+  glGenBuffers(1, &ubo);
+  glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+  glBufferData(GL_UNIFORM_BUFFER, size, nullptr, GL_DYNAMIC_DRAW);
+  glBindBufferBase(GL_UNIFORM_BUFFER, binding, ubo);
+  CHECK_GL_ERROR
+  return ubo;
+}
+
+void UpdateUniformBuffer(GLuint ubo, const void* data, std::size_t size) {
+  glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+  // Respecify the whole buffer so the driver can orphan the old storage if it's still in use.
+  glBufferData(GL_UNIFORM_BUFFER, size, data, GL_DYNAMIC_DRAW);
+  CHECK_GL_ERROR
+}
 }
 
-/*static*/ void Renderable::SetLightParams(RenderContext* context, ShaderProgram* shader) {
-  shader->SetUniform("light_transform"_name, context->light_transform);
-  shader->SetUniform("light_pos"_name, context->light_pos);
-  shader->SetUniform("eye_pos"_name, context->eye_pos);
+BoundingBox BoundingBox::Transformed(const glm::mat4& transform) const {
+  BoundingBox ret{glm::vec3(std::numeric_limits<float>::max()), glm::vec3(std::numeric_limits<float>::lowest())};
+  for (int corner = 0; corner < 8; ++corner) {
+    glm::vec3 point((corner & 1) ? max.x : min.x, (corner & 2) ? max.y : min.y, (corner & 4) ? max.z : min.z);
+    glm::vec3 transformed = glm::vec3(transform * glm::vec4(point, 1.0f));
+    ret.min = glm::min(ret.min, transformed);
+    ret.max = glm::max(ret.max, transformed);
+  }
+  return ret;
+}
+
+namespace {
+// Nearest first, by view depth of the centre of their bounds. Renderables without bounds (terrain)
+// go last, since they are usually behind everything else.
+void SortFrontToBack(std::vector<Renderable*>* renderables, const glm::mat4& view) {
+  std::vector<std::pair<float, Renderable*>> sorted;
+  sorted.reserve(renderables->size());
+  for (auto* renderable : *renderables) {
+    float depth = std::numeric_limits<float>::infinity();
+    std::optional<BoundingBox> bounds = renderable->WorldBounds();
+    if (bounds) {
+      // The camera looks down -z in view space.
+      depth = -(view * glm::vec4(0.5f * (bounds->min + bounds->max), 1.0f)).z;
+    }
+    sorted.emplace_back(depth, renderable);
+  }
+  std::stable_sort(sorted.begin(), sorted.end(),
+                   [](const auto& a, const auto& b) { return a.first < b.first; });
+  for (std::size_t i = 0; i < sorted.size(); ++i) {
+    (*renderables)[i] = sorted[i].second;
+  }
+}
+}
+
+/*static*/ void Renderable::SetShadowTextureUnits(ShaderProgram* shader) {
   shader->SetUniform("shadow_texture"_name, kShadowTextureUnit);
 }
 
@@ -42,7 +107,7 @@ TestTriangleRenderable::TestTriangleRenderable() {
   const static std::vector<GLfloat> vertices = { 0.0f, 1.0f, 0.0f,
                                       0.0f, 0.0f, 1.0f,
                                       0.0f,  -1.0f, 0.0f, };
-  const static std::vector<GLuint> indices = {
+  const static std::vector<GLushort> indices = {
     0, 1, 2,
     2, 1, 0
   };
@@ -68,13 +133,11 @@ void TestTriangleRenderable::Render(RenderContext* context) {
   simple_shader_->SetUniform("mvp"_name, mvp);
 
   Renderer::UseVAO(vao_id_);
-  glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, (const void*)0);
+  glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, (const void*)0);
 }
 
-Renderer::Renderer() {
-  #define GraphicsSetting(upper, lower, type, default, toggle_key) render_context_.lower = default;
-  GRAPHICS_SETTINGS
-  #undef GraphicsSetting
+Renderer::Renderer() : quality_governor_(kTargetFrameTimeMs) {
+  ApplySettings();
 
   eye_azimuth_ = kDefaultEyeAzimuth;
   eye_elevation_ = kDefaultEyeElevation;
@@ -86,10 +149,54 @@ Renderer::Renderer() {
 
   first_frame_ = true;
 
+  static_shadows_valid_ = false;
+
+  render_scale_steps_ = kMaxRenderScaleSteps;
+  render_scale_ = 1.0f;
+  smoothed_frame_time_ms_ = kTargetFrameTimeMs;
+  last_render_scale_change_frame_ = 0;
+
   render_context_.frame_counter = 0;
   render_context_.frame_start_time = GetTimeUs();
 }
 
+ShaderFeatures Renderer::EnabledShaderFeatures() const {
+  ShaderFeatures features = kNoShaderFeatures;
+  if (render_context_.use_lighting) {
+    features |= kShaderFeatureLighting;
+  }
+  if (render_context_.use_specular_highlight) {
+    features |= kShaderFeatureSpecularHighlight;
+  }
+  if (render_context_.use_normal_map) {
+    features |= kShaderFeatureNormalMap;
+  }
+  if (render_context_.use_ao_map) {
+    features |= kShaderFeatureAOMap;
+  }
+  if (render_context_.use_shadows) {
+    features |= kShaderFeatureShadows;
+  }
+  return features;
+}
+
+void Renderer::ApplySettings() {
+  #define GraphicsSetting(upper, lower, type, default, toggle_key) render_context_.lower = settings_.lower;
+  GRAPHICS_SETTINGS
+  #undef GraphicsSetting
+
+  render_context_.use_specular_highlight &= quality_governor_.Allows(QualityFeature::kSpecularHighlight);
+  render_context_.use_ao_map &= quality_governor_.Allows(QualityFeature::kAOMap);
+  render_context_.use_normal_map &= quality_governor_.Allows(QualityFeature::kNormalMap);
+  render_context_.use_smaa &= quality_governor_.Allows(QualityFeature::kSMAA);
+  render_context_.use_shadows &= quality_governor_.Allows(QualityFeature::kShadows);
+}
+
+void Renderer::WarmUpShaders() {
+  // Skinning isn't a graphics setting, but skinned meshes need it.
+  ::WarmUpShaders(EnabledShaderFeatures() | kShaderFeatureSkinning | kShaderFeaturePreskinned);
+}
+
 void Renderer::RenderFrame(const std::vector<Renderable*>& renderables) {
   int window_width;
   int window_height;
@@ -101,15 +208,27 @@ void Renderer::RenderFrame(const std::vector<Renderable*>& renderables) {
     window_ = SDL_GL_GetCurrentWindow();
     SDL_GL_GetDrawableSize(window_, &window_width, &window_height);
 
-    last_window_width_ = window_width;
-    last_window_height_ = window_height;
+    last_render_width_ = window_width;
+    last_render_height_ = window_height;
+
+    if (GpuTimer::Supported()) {
+      for (auto& timer : pass_timers_) {
+        timer.emplace();
+      }
+    }
+
+    // Only the shadow map with everything in it is sampled. The static one is a cache.
+    static_shadow_fb_ = FrameBuffer(kShadowMapSize, kShadowMapSize, /*have_colour=*/false, /*have_depth=*/true);
 
-    shadow_fb_ = FrameBuffer(kShadowMapSize, kShadowMapSize, /*have_colour=*/false, /*have_depth=*/true);
-    TextureManager::GetInstance()->BindTexture(shadow_fb_->DepthTex(), GL_TEXTURE0 + kShadowTextureUnit);
+    dynamic_shadow_fb_ = FrameBuffer(kShadowMapSize, kShadowMapSize, /*have_colour=*/false, /*have_depth=*/true);
+    TextureManager::GetInstance()->BindTexture(dynamic_shadow_fb_->DepthTex(), GL_TEXTURE0 + kShadowTextureUnit);
 
     geometry_fb_ = FrameBuffer(window_width, window_height, /*have_colour=*/true, /*have_depth=*/true);
     TextureManager::GetInstance()->BindTexture(geometry_fb_->ColourTex(), GL_TEXTURE0 + kGeometryColourTextureUnit);
 
+    per_frame_ubo_ = MakeUniformBuffer(sizeof(PerFrameUniforms), kPerFrameUniformBinding);
+    per_pass_ubo_ = MakeUniformBuffer(sizeof(PerPassUniforms), kPerPassUniformBinding);
+
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
     // Oversized triangle.
@@ -118,7 +237,7 @@ void Renderer::RenderFrame(const std::vector<Renderable*>& renderables) {
     positions.push_back(3.0f); positions.push_back(-1.0f); // v1
     positions.push_back(-1.0f); positions.push_back(3.0f); // v2
 
-    std::vector<GLuint> indices;
+    std::vector<GLushort> indices;
     indices.push_back(0); indices.push_back(1); indices.push_back(2);
 
     fullscreen_vao_id_ = MakeVAO({
@@ -126,6 +245,8 @@ void Renderer::RenderFrame(const std::vector<Renderable*>& renderables) {
     },
     EBOSpec(indices));
 
+    occlusion_culler_.emplace();
+
     // SMAA
     smaa_data_ = SMAAData();
     smaa_data_->area_tex_ = TextureFromMemory(
@@ -141,26 +262,123 @@ void Renderer::RenderFrame(const std::vector<Renderable*>& renderables) {
     smaa_data_->blending_shader_ = GetShader("smaa_blend.vs", "smaa_blend.fs");
   }
 
+  // Upload textures that finished loading in the background.
+  TextureManager::GetInstance()->Update();
+
   SDL_GL_GetDrawableSize(window_, &window_width, &window_height);
 
-  if (window_width != last_window_width_ || window_height != last_window_height_) {
-    last_window_width_ = window_width;
-    last_window_height_ = window_height;
+  uint64_t time_now = GetTimeUs();
+  int64_t time_since_last_frame = time_now - render_context_.frame_start_time;
+  render_context_.frame_start_time = time_now;
+
+  // The disjoint flag is reset when read, so it's checked once here for all timers.
+  if (pass_timers_[0] && GpuTimer::Disjoint()) {
+    for (auto& timer : pass_timers_) {
+      timer->DiscardPending();
+    }
+  }
+
+  // GPU frame time is the sum of the passes, if we have results for all of them.
+  std::array<std::optional<float>, kNumTimedPasses> pass_ms;
+  bool gpu_time = pass_timers_[0] && passes_run_[static_cast<int>(TimedPass::kGeometry)];
+  float frame_time_ms = 0.0f;
+  for (int i = 0; i < kNumTimedPasses; ++i) {
+    if (pass_timers_[i] && passes_run_[i]) {
+      pass_ms[i] = pass_timers_[i]->LatestMs();
+      gpu_time = gpu_time && pass_ms[i].has_value();
+      frame_time_ms += pass_ms[i].value_or(0.0f);
+    }
+  }
+  if (!gpu_time) {
+    frame_time_ms = time_since_last_frame / 1000.0f;
+  }
+  smoothed_frame_time_ms_ += (frame_time_ms - smoothed_frame_time_ms_) * kFrameTimeSmoothing;
+
+  int render_scale_steps_before = render_scale_steps_;
+  int quality_tier_before = quality_governor_.Tier();
+
+  if (UseDynamicResolution()) {
+    UpdateRenderScale(gpu_time);
+  } else {
+    render_scale_steps_ = kMaxRenderScaleSteps;
+    render_scale_ = 1.0f;
+  }
+
+  // The quality governor only turns features off when resolution is as low as it goes, and
+  // back on when resolution is back to full.
+  if (UseQualityGovernor()) {
+    QualityFeatureMask user_features = 0;
+    user_features |= UseSpecularHighlight() ? QualityFeatureBit(QualityFeature::kSpecularHighlight) : 0;
+    user_features |= UseAOMap() ? QualityFeatureBit(QualityFeature::kAOMap) : 0;
+    user_features |= UseNormalMap() ? QualityFeatureBit(QualityFeature::kNormalMap) : 0;
+    user_features |= UseSMAA() ? QualityFeatureBit(QualityFeature::kSMAA) : 0;
+    user_features |= UseShadows() ? QualityFeatureBit(QualityFeature::kShadows) : 0;
+    bool can_step_down = !UseDynamicResolution() || render_scale_steps_ == kMinRenderScaleSteps;
+    bool can_step_up = render_scale_steps_ == kMaxRenderScaleSteps &&
+                       (gpu_time || step_up_probe_.CanProbe(render_context_.frame_counter));
+    quality_governor_.Update(render_context_.frame_counter, smoothed_frame_time_ms_, gpu_time, pass_ms,
+                             user_features, can_step_down, can_step_up);
+  } else {
+    quality_governor_.Reset();
+  }
+
+  // Resets from turning a controller off aren't steps.
+  bool scale_on = UseDynamicResolution();
+  bool governor_on = UseQualityGovernor();
+  step_up_probe_.Update(render_context_.frame_counter,
+                        /*stepped_down=*/(scale_on && render_scale_steps_ < render_scale_steps_before) ||
+                            (governor_on && quality_governor_.Tier() < quality_tier_before),
+                        /*stepped_up=*/(scale_on && render_scale_steps_ > render_scale_steps_before) ||
+                            (governor_on && quality_governor_.Tier() > quality_tier_before));
+  ApplySettings();
+  passes_run_ = {};
+
+  // Dynamic renderables with bounds can be occlusion culled. Everything else is an occluder.
+  // Occludees are tested after the geometry pass, when all occluders have been drawn.
+  std::vector<Renderable*> occluders;
+  std::vector<std::pair<Renderable*, BoundingBox>> occludees;
+  for (auto* renderable : renderables) {
+    std::optional<BoundingBox> bounds;
+    if (!renderable->IsStatic()) {
+      bounds = renderable->WorldBounds();
+    }
+    if (bounds) {
+      occludees.emplace_back(renderable, *bounds);
+    } else {
+      occluders.push_back(renderable);
+    }
+  }
+  if (render_context_.use_occlusion_culling) {
+    occlusion_culler_->CollectResults();
+  } else {
+    occlusion_culler_->Clear();
+  }
+
+  int render_width = std::max(1, static_cast<int>(std::lround(window_width * render_scale_)));
+  int render_height = std::max(1, static_cast<int>(std::lround(window_height * render_scale_)));
+
+  // Whether the scene is rendered at a lower resolution than the window, and has to be upscaled.
+  bool upscale = render_width != window_width || render_height != window_height;
+
+  if (render_width != last_render_width_ || render_height != last_render_height_) {
+    last_render_width_ = render_width;
+    last_render_height_ = render_height;
 
     // Resize our textures (don't resize shadow map).
     if (geometry_fb_) {
-      geometry_fb_->Resize(window_width, window_height);
+      geometry_fb_->Resize(render_width, render_height);
     }
 
     if (smaa_data_) {
-      smaa_data_->edge_fbo_->Resize(window_width, window_height);
-      smaa_data_->weights_fbo_->Resize(window_width, window_height);
+      if (smaa_data_->edge_fbo_) {
+        smaa_data_->edge_fbo_->Resize(render_width, render_height);
+      }
+      if (smaa_data_->weights_fbo_) {
+        smaa_data_->weights_fbo_->Resize(render_width, render_height);
+      }
     }
   }
-  
-  uint64_t time_now = GetTimeUs();
-  int64_t time_since_last_frame = time_now - render_context_.frame_start_time;
-  render_context_.frame_start_time = time_now;
+
 
   glBindFramebuffer(GL_FRAMEBUFFER, 0);
   glEnable(GL_CULL_FACE);
@@ -174,12 +392,28 @@ void Renderer::RenderFrame(const std::vector<Renderable*>& renderables) {
 
   render_context_.eye_pos = EyePos();
   render_context_.light_pos = LightPos();
+  render_context_.lod_scale = 0.5f * render_height / std::tan(0.5f * glm::radians(kFov));
+
+  render_context_.shader_features = EnabledShaderFeatures();
+
+  // Skinning pass. Animated meshes are skinned once per frame here, and the other passes draw
+  // the results. Static renderables have nothing to skin. Occlusion culled renderables are still
+  // drawn in the shadow pass, so they only skip skinning when there are no shadows.
+  BeginTimedPass(TimedPass::kSkinning);
+  render_context_.pass = RenderPass::kSkinning;
+  glEnable(GL_RASTERIZER_DISCARD);
+  for (auto* renderable : renderables) {
+    if (!renderable->IsStatic() && (render_context_.use_shadows || occlusion_culler_->IsVisible(renderable))) {
+      renderable->Render(&render_context_);
+    }
+  }
+  glDisable(GL_RASTERIZER_DISCARD);
+  EndTimedPass(TimedPass::kSkinning);
 
   // Shadow pass
-  if (UseShadows()) {
+  if (render_context_.use_shadows) {
+    BeginTimedPass(TimedPass::kShadow);
     glViewport(0, 0, kShadowMapSize, kShadowMapSize);
-    shadow_fb_->Bind();
-    glClear(GL_DEPTH_BUFFER_BIT);
     float light_distance = glm::length(render_context_.light_pos);
     float shadow_near_z = 0.0f;
     float shadow_far_z = 4.0f * light_distance + 100.0f;
@@ -189,21 +423,56 @@ void Renderer::RenderFrame(const std::vector<Renderable*>& renderables) {
     render_context_.view = light_view;
     render_context_.projection = light_projection;
     render_context_.pass = RenderPass::kShadow;
+    UploadPerPassUniforms();
+
+    std::vector<Renderable*> static_casters;
+    std::vector<Renderable*> dynamic_casters;
     for (auto* renderable : renderables) {
+      if (renderable->IsStatic()) {
+        static_casters.push_back(renderable);
+      } else {
+        dynamic_casters.push_back(renderable);
+      }
+    }
+
+    // Static casters only need to be re-rendered if they have changed, or the light has moved.
+    if (!static_shadows_valid_ || static_casters != static_shadow_casters_ ||
+        render_context_.light_pos != static_shadow_light_pos_) {
+      static_shadow_fb_->Bind();
+      glClear(GL_DEPTH_BUFFER_BIT);
+
+      // The cached shadow map is reused from other view points, so it has to be view independent.
+      float lod_scale = render_context_.lod_scale;
+      render_context_.lod_scale = std::numeric_limits<float>::infinity();
+      for (auto* renderable : static_casters) {
+        renderable->Render(&render_context_);
+      }
+      render_context_.lod_scale = lod_scale;
+      static_shadow_casters_ = std::move(static_casters);
+      static_shadow_light_pos_ = render_context_.light_pos;
+      static_shadows_valid_ = true;
+    }
+
+    // Start from the cached static shadows, so the lighting shaders only need one shadow map.
+    static_shadow_fb_->BlitDepthTo(&*dynamic_shadow_fb_, kShadowMapSize, kShadowMapSize);
+    dynamic_shadow_fb_->Bind();
+    for (auto* renderable : dynamic_casters) {
       renderable->Render(&render_context_);
     }
     render_context_.light_transform = light_projection * light_view;
+    EndTimedPass(TimedPass::kShadow);
   }
 
   // Geometry pass
-  // If we are doing SMAA (or any other post processing), we have to render into a framebuffer. Otherwise
-  // we can render into the back buffer directly.
-  if (UseSMAA()) {
+  // If we are doing SMAA (or any other post processing), or upscaling, we have to render into a
+  // framebuffer. Otherwise we can render into the back buffer directly.
+  bool post_process = render_context_.use_smaa || upscale;
+  if (post_process) {
     geometry_fb_->Bind();
   } else {
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
   }
-  glViewport(0, 0, window_width, window_height);
+  glViewport(0, 0, render_width, render_height);
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
   glm::mat4 view = glm::lookAt(render_context_.eye_pos, view_centre_, glm::vec3(0.0f, 0.0f, 1.0f));
@@ -215,69 +484,185 @@ void Renderer::RenderFrame(const std::vector<Renderable*>& renderables) {
 
   render_context_.view = view;
   render_context_.projection = projection;
+  UploadPerFrameUniforms();
+  UploadPerPassUniforms();
+
+  // Occludees found invisible last time they were tested are skipped. The rest are drawn front to
+  // back if enabled, so hidden fragments fail the depth test before they are shaded.
+  std::vector<Renderable*> geometry_renderables = occluders;
+  for (const auto& [renderable, bounds] : occludees) {
+    if (occlusion_culler_->IsVisible(renderable)) {
+      geometry_renderables.push_back(renderable);
+    }
+  }
+  if (render_context_.use_front_to_back_sort) {
+    SortFrontToBack(&geometry_renderables, view);
+  }
+
+  if (render_context_.use_depth_prepass) {
+    BeginTimedPass(TimedPass::kDepthPrepass);
+    render_context_.pass = RenderPass::kDepthPrepass;
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    for (auto* renderable : geometry_renderables) {
+      renderable->Render(&render_context_);
+    }
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+    // Renderables in the prepass are drawn again at exactly the same depth (gl_Position is
+    // invariant in their programs). Not GL_EQUAL, so the ones that weren't in the prepass can still
+    // be drawn.
+    glDepthFunc(GL_LEQUAL);
+    EndTimedPass(TimedPass::kDepthPrepass);
+  }
 
+  BeginTimedPass(TimedPass::kGeometry);
   render_context_.pass = RenderPass::kGeometry;
-  for (auto* renderable : renderables) {
+  for (auto* renderable : geometry_renderables) {
     renderable->Render(&render_context_);
   }
+  glDepthFunc(GL_LESS);
+  if (render_context_.use_occlusion_culling) {
+    occlusion_culler_->IssueQueries(occludees, render_context_.eye_pos, render_context_.frame_counter);
+  }
+  EndTimedPass(TimedPass::kGeometry);
 
   glDisable(GL_DEPTH_TEST);
 
-  if (UseSMAA()) {
-    // First pass - detect edges using luma.
+  if (post_process) {
+    BeginTimedPass(TimedPass::kPostProcess);
+  }
+
+  if (render_context_.use_smaa) {
+    // Depth is only needed during the geometry pass.
+    geometry_fb_->Invalidate({GL_DEPTH_ATTACHMENT});
+
+    // First pass - detect edges using luma. Pixels with edges are marked in the stencil buffer
+    // (the shader discards the others), so the weights pass only runs on them.
     smaa_data_->edges_shader_->Activate();
-    smaa_data_->edges_shader_->SetUniform("resolution"_name, glm::vec2(window_width, window_height));
+    smaa_data_->edges_shader_->SetUniform("resolution"_name, glm::vec2(render_width, render_height));
     smaa_data_->edges_shader_->SetUniform("colorTex"_name, kGeometryColourTextureUnit);
     if (!smaa_data_->edge_fbo_) {
-      smaa_data_->edge_fbo_ = FrameBuffer(window_width, window_height, /*have_colour=*/true, /*have_depth=*/false);
+      smaa_data_->edge_fbo_ = FrameBuffer(render_width, render_height, /*have_colour=*/true, /*have_depth=*/false,
+                                          /*have_stencil=*/true);
       TextureManager::GetInstance()->BindTexture(smaa_data_->edge_fbo_->ColourTex(), GL_TEXTURE0 + kSmaaEdgesTextureUnit);
     }
     smaa_data_->edge_fbo_->Bind();
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glClear(GL_COLOR_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+    glEnable(GL_STENCIL_TEST);
+    glStencilFunc(GL_ALWAYS, /*ref=*/1, /*mask=*/0xff);
+    glStencilOp(/*sfail=*/GL_KEEP, /*dpfail=*/GL_KEEP, /*dppass=*/GL_REPLACE);
     DrawFullScreen();
 
     // Second pass - calculate blending weights.
     smaa_data_->weights_shader_->Activate();
-    smaa_data_->weights_shader_->SetUniform("resolution"_name, glm::vec2(window_width, window_height));
-    smaa_data_->weights_shader_->SetUniform("SMAA_RT_METRICS"_name, glm::vec4(1.0f / window_width, 1.0f / window_height,
-                                                                              window_width, window_height));
+    smaa_data_->weights_shader_->SetUniform("resolution"_name, glm::vec2(render_width, render_height));
+    smaa_data_->weights_shader_->SetUniform("SMAA_RT_METRICS"_name, glm::vec4(1.0f / render_width, 1.0f / render_height,
+                                                                              render_width, render_height));
     smaa_data_->weights_shader_->SetUniform("edgesTex"_name, kSmaaEdgesTextureUnit);
     smaa_data_->weights_shader_->SetUniform("areaTex"_name, kSmaaAreaTexTextureUnit);
     smaa_data_->weights_shader_->SetUniform("searchTex"_name, kSmaaSearchTexTextureUnit);
     if (!smaa_data_->weights_fbo_) {
-      smaa_data_->weights_fbo_ = FrameBuffer(window_width, window_height, /*have_colour=*/true, /*have_depth=*/false);
+      smaa_data_->weights_fbo_ = FrameBuffer(render_width, render_height, /*have_colour=*/true, /*have_depth=*/false);
+      smaa_data_->weights_fbo_->UseStencilOf(*smaa_data_->edge_fbo_);
       TextureManager::GetInstance()->BindTexture(smaa_data_->weights_fbo_->ColourTex(), GL_TEXTURE0 + kSmaaWeightsTextureUnit);
     }
     smaa_data_->weights_fbo_->Bind();
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glStencilFunc(GL_EQUAL, /*ref=*/1, /*mask=*/0xff);
+    glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
     DrawFullScreen();
+    glDisable(GL_STENCIL_TEST);
+    smaa_data_->weights_fbo_->Invalidate({GL_STENCIL_ATTACHMENT});
 
-    // Third pass - actual blending into back buffer.
+    // Third pass - actual blending into back buffer (or the edges framebuffer, which we are done
+    // with, if we are upscaling). This isn't stencil masked, because pixels next to edges are
+    // blended too, and every pixel has to be written anyway.
     smaa_data_->blending_shader_->Activate();
-    smaa_data_->blending_shader_->SetUniform("resolution"_name, glm::vec2(window_width, window_height));
+    smaa_data_->blending_shader_->SetUniform("resolution"_name, glm::vec2(render_width, render_height));
     smaa_data_->blending_shader_->SetUniform("colorTex"_name, kGeometryColourTextureUnit);
     smaa_data_->blending_shader_->SetUniform("blendTex"_name, kSmaaWeightsTextureUnit);
-    smaa_data_->blending_shader_->SetUniform("SMAA_RT_METRICS"_name, glm::vec4(1.0f / window_width, 1.0f / window_height,
-                                                                              window_width, window_height));
+    smaa_data_->blending_shader_->SetUniform("SMAA_RT_METRICS"_name, glm::vec4(1.0f / render_width, 1.0f / render_height,
+                                                                              render_width, render_height));
 
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    DrawFullScreen();
+    if (upscale) {
+      smaa_data_->edge_fbo_->Bind();
+      DrawFullScreen();
+      smaa_data_->edge_fbo_->BlitColourToBackBuffer(render_width, render_height, window_width, window_height);
+    } else {
+      glBindFramebuffer(GL_FRAMEBUFFER, 0);
+      glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+      DrawFullScreen();
+    }
+  } else if (upscale) {
+    geometry_fb_->Invalidate({GL_DEPTH_ATTACHMENT});
+    geometry_fb_->BlitColourToBackBuffer(render_width, render_height, window_width, window_height);
   }
 
+  if (post_process) {
+    EndTimedPass(TimedPass::kPostProcess);
+  }
+
+  // The UI is drawn at full resolution.
+  glViewport(0, 0, window_width, window_height);
+
   // UI pass.
+  BeginTimedPass(TimedPass::kUi);
   glEnable(GL_BLEND);
 
   render_context_.pass = RenderPass::kUi;
   for (auto* renderable : renderables) {
     renderable->Render(&render_context_);
   }
+  EndTimedPass(TimedPass::kUi);
 
   ++render_context_.frame_counter;
 
   SDL_GL_SwapWindow(window_);
 }
 
+void Renderer::UpdateRenderScale(bool gpu_time) {
+  if ((render_context_.frame_counter - last_render_scale_change_frame_) < kRenderScaleChangeInterval) {
+    return;
+  }
+
+  int new_steps = render_scale_steps_;
+  if (smoothed_frame_time_ms_ > kTargetFrameTimeMs * 1.1f) {
+    // GPU time scales roughly with the number of pixels, so we can jump straight to a scale
+    // that should be fast enough.
+    new_steps = static_cast<int>(std::floor(render_scale_steps_ * std::sqrt(kTargetFrameTimeMs / smoothed_frame_time_ms_)));
+    new_steps = std::min(new_steps, render_scale_steps_ - 1);
+  } else if (gpu_time ? (smoothed_frame_time_ms_ < kTargetFrameTimeMs * 0.8f)
+                      : step_up_probe_.CanProbe(render_context_.frame_counter)) {
+    // Going up is one step at a time, so we don't oscillate. With vsync, CPU frame time never
+    // goes much below the target, so we can only tell that we have headroom from GPU time.
+    // Without it, we try a step up every now and then (see StepUpProbe).
+    new_steps = render_scale_steps_ + 1;
+  }
+  new_steps = std::clamp(new_steps, kMinRenderScaleSteps, kMaxRenderScaleSteps);
+
+  if (new_steps != render_scale_steps_) {
+    render_scale_steps_ = new_steps;
+    render_scale_ = render_scale_steps_ * kRenderScaleStep;
+    last_render_scale_change_frame_ = render_context_.frame_counter;
+    LOG_INFO("Render scale % (% frame time % ms)", render_scale_, gpu_time ? "GPU" : "CPU", smoothed_frame_time_ms_);
+  }
+}
+
+void Renderer::BeginTimedPass(TimedPass pass) {
+  auto& timer = pass_timers_[static_cast<int>(pass)];
+  if (timer) {
+    timer->Begin();
+  }
+  passes_run_[static_cast<int>(pass)] = true;
+}
+
+void Renderer::EndTimedPass(TimedPass pass) {
+  auto& timer = pass_timers_[static_cast<int>(pass)];
+  if (timer) {
+    timer->End();
+  }
+}
+
 void Renderer::MoveCamera(int32_t x_from, int32_t y_from, int32_t x_to, int32_t y_to) {
   glm::vec3 from = UnProjectToXY(x_from, y_from);
   glm::vec3 to = UnProjectToXY(x_to, y_to);
@@ -286,12 +671,31 @@ void Renderer::MoveCamera(int32_t x_from, int32_t y_from, int32_t x_to, int32_t
   view_centre_.z = 0;
 }
 
+void Renderer::UploadPerFrameUniforms() {
+  static_assert(offsetof(PerFrameUniforms, light_pos) == 64);
+  static_assert(offsetof(PerFrameUniforms, eye_pos) == 80);
+
+  PerFrameUniforms uniforms;
+  uniforms.light_transform = render_context_.light_transform;
+  uniforms.light_pos = render_context_.light_pos;
+  uniforms.padding0 = 0.0f;
+  uniforms.eye_pos = render_context_.eye_pos;
+  uniforms.padding1 = 0.0f;
+  UpdateUniformBuffer(per_frame_ubo_, &uniforms, sizeof(uniforms));
+}
+
+void Renderer::UploadPerPassUniforms() {
+  PerPassUniforms uniforms;
+  uniforms.view_projection = render_context_.projection * render_context_.view;
+  UpdateUniformBuffer(per_pass_ubo_, &uniforms, sizeof(uniforms));
+}
+
 void Renderer::DrawFullScreen() {
   UseVAO(fullscreen_vao_id_);
-  glDrawElements(GL_TRIANGLES, 3, GL_UNSIGNED_INT, (const void*) 0);
+  glDrawElements(GL_TRIANGLES, 3, GL_UNSIGNED_SHORT, (const void*) 0);
 }
 
-Renderer::FrameBuffer::FrameBuffer(int width, int height, bool have_colour, bool have_depth) {
+Renderer::FrameBuffer::FrameBuffer(int width, int height, bool have_colour, bool have_depth, bool have_stencil) {
   glGenFramebuffers(1, &fbo_);
   glBindFramebuffer(GL_FRAMEBUFFER, fbo_);
   if (have_colour) {
@@ -306,11 +710,49 @@ Renderer::FrameBuffer::FrameBuffer(int width, int height, bool have_colour, bool
     depth_tex_ = TextureManager::GetInstance()->MakeDepthTexture(width, height);
     glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, *depth_tex_, /*lod=*/0);
   }
+  if (have_stencil) {
+    // Never sampled, so a renderbuffer is enough.
+    GLuint stencil_rb;
+    glGenRenderbuffers(1, &stencil_rb);
+    glBindRenderbuffer(GL_RENDERBUFFER, stencil_rb);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_STENCIL_INDEX8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_STENCIL_ATTACHMENT, GL_RENDERBUFFER, stencil_rb);
+    stencil_rb_ = stencil_rb;
+  }
   if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
       LOG_ERROR("Framebuffer incomplete");
   }
 }
 
+Renderer::FrameBuffer::~FrameBuffer() {
+  if (colour_tex_.has_value()) {
+    TextureManager::GetInstance()->DeleteTexture(*colour_tex_);
+  }
+  if (depth_tex_.has_value()) {
+    TextureManager::GetInstance()->DeleteTexture(*depth_tex_);
+  }
+  if (stencil_rb_.has_value()) {
+    glDeleteRenderbuffers(1, &*stencil_rb_);
+  }
+  if (fbo_ != 0) {
+    glDeleteFramebuffers(1, &fbo_);
+  }
+}
+
+Renderer::FrameBuffer::FrameBuffer(FrameBuffer&& other)
+    : fbo_(std::exchange(other.fbo_, 0)),
+      colour_tex_(std::exchange(other.colour_tex_, std::nullopt)),
+      depth_tex_(std::exchange(other.depth_tex_, std::nullopt)),
+      stencil_rb_(std::exchange(other.stencil_rb_, std::nullopt)) {}
+
+Renderer::FrameBuffer& Renderer::FrameBuffer::operator=(FrameBuffer&& other) {
+  std::swap(fbo_, other.fbo_);
+  std::swap(colour_tex_, other.colour_tex_);
+  std::swap(depth_tex_, other.depth_tex_);
+  std::swap(stencil_rb_, other.stencil_rb_);
+  return *this;
+}
+
 void Renderer::FrameBuffer::Resize(int width, int height) {
   if (colour_tex_.has_value()) {
     TextureManager::GetInstance()->ResizeColourTexture(*colour_tex_, width, height);
@@ -318,12 +760,46 @@ void Renderer::FrameBuffer::Resize(int width, int height) {
   if (depth_tex_.has_value()) {
     TextureManager::GetInstance()->ResizeDepthTexture(*depth_tex_, width, height);
   }
+  if (stencil_rb_.has_value()) {
+    // Framebuffers using it with UseStencilOf() see the new size too.
+    glBindRenderbuffer(GL_RENDERBUFFER, *stencil_rb_);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_STENCIL_INDEX8, width, height);
+  }
 }
 
 void Renderer::FrameBuffer::Bind() {
   glBindFramebuffer(GL_FRAMEBUFFER, fbo_);
 }
 
+void Renderer::FrameBuffer::UseStencilOf(const FrameBuffer& other) {
+  Bind();
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_STENCIL_ATTACHMENT, GL_RENDERBUFFER, *other.stencil_rb_);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+      LOG_ERROR("Framebuffer incomplete");
+  }
+}
+
+void Renderer::FrameBuffer::BlitColourToBackBuffer(int width, int height, int window_width, int window_height) {
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo_);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+  glBlitFramebuffer(0, 0, width, height, 0, 0, window_width, window_height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  CHECK_GL_ERROR
+}
+
+void Renderer::FrameBuffer::BlitDepthTo(FrameBuffer* other, int width, int height) {
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo_);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, other->fbo_);
+  glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  CHECK_GL_ERROR
+}
+
+void Renderer::FrameBuffer::Invalidate(std::initializer_list<GLenum> attachments) {
+  Bind();
+  glInvalidateFramebuffer(GL_FRAMEBUFFER, attachments.size(), attachments.begin());
+}
+
 glm::vec3 Renderer::EyePos() {
   float eye_avimuth_rad = eye_azimuth_ * M_PI / 180.0f;
   float eye_elevation_rad = eye_elevation_ * M_PI / 180.0f;
@@ -361,20 +837,14 @@ glm::vec3 Renderer::UnProjectToXY(int32_t x, int32_t y) {
   GLuint vao;
   glGenVertexArrays(1, &vao);
   CHECK_GL_ERROR
-  glBindVertexArray(vao);
+  // Through UseVAO() so it knows what is bound.
+  UseVAO(vao);
   CHECK_GL_ERROR
   for (const Renderer::VBOSpec& vbo : vbos) {
-    glEnableVertexAttribArray(vbo.attrib_location);
-    CHECK_GL_ERROR
     GLuint vbo_id = MakeAndUploadBuf(GL_ARRAY_BUFFER, vbo.data, vbo.data_size);
     glBindBuffer(GL_ARRAY_BUFFER, vbo_id);
     CHECK_GL_ERROR
-    if (vbo.IsInt()) {
-      glVertexAttribIPointer(vbo.attrib_location, vbo.components_per_element, vbo.gl_type, 0, (const void*) 0);
-    } else {
-      glVertexAttribPointer(vbo.attrib_location, vbo.components_per_element, vbo.gl_type, GL_FALSE, 0, (const void*) 0);
-    }
-    CHECK_GL_ERROR
+    SetUpAttribs(vbo.attribs, vbo.stride);
   }
   GLuint ebo_id = MakeAndUploadBuf(GL_ELEMENT_ARRAY_BUFFER, ebo.data, ebo.data_size);
   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo_id);
@@ -382,6 +852,21 @@ glm::vec3 Renderer::UnProjectToXY(int32_t x, int32_t y) {
   return vao;
 }
 
+/*static*/ void Renderer::SetUpAttribs(const std::vector<AttribSpec>& attribs, std::size_t stride) {
+  for (const Renderer::AttribSpec& attrib : attribs) {
+    glEnableVertexAttribArray(attrib.attrib_location);
+    CHECK_GL_ERROR
+    const void* offset = reinterpret_cast<const void*>(attrib.offset);
+    if (attrib.IsInt() && !attrib.normalised) {
+      glVertexAttribIPointer(attrib.attrib_location, attrib.components_per_element, attrib.gl_type, stride, offset);
+    } else {
+      glVertexAttribPointer(attrib.attrib_location, attrib.components_per_element, attrib.gl_type,
+                            attrib.normalised ? GL_TRUE : GL_FALSE, stride, offset);
+    }
+    CHECK_GL_ERROR
+  }
+}
+
 /*static*/ void Renderer::UseVAO(GLuint vao) {
   static GLuint current_vao = 0;
   if (vao != current_vao) {
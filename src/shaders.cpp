@@ -1,10 +1,14 @@
 #include "shaders.h"
 
-#include <fstream>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
 #include <map>
-#include <regex>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "logger.h"
 #include "utils.h"
@@ -14,12 +18,40 @@
 namespace {
 
 constexpr const char* kShaderPrefix = "assets/shaders/";
+constexpr const char* kProgramCacheDir = "shader_cache/";
+
+// Bump to invalidate all cached programs (eg. if the cache file format changes).
+constexpr uint32_t kProgramCacheVersion = 1;
+
+// From KHR_parallel_shader_compile.
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+// Every program the game uses, so they can all be compiled at startup (see WarmUpShaders()).
+// Each is compiled with every combination of the features it may be used with.
+struct ShaderManifestEntry {
+  const char* vertex_shader_file_name;
+  const char* fragment_shader_file_name;
+  ShaderFeatures features;
+};
+
+constexpr ShaderManifestEntry kShaderManifest[] = {
+  { "actor.vs", "actor.fs", kAllShaderFeatures & ~kShaderFeatureSkinning },
+  { "shadow.vs", "shadow.fs", kShaderFeaturePreskinned },
+  { "skin.vs", "skin.fs", kShaderFeatureSkinning },
+  { "terrain.vs", "terrain.fs", kAllShaderFeatures & ~(kShaderFeatureSkinning | kShaderFeaturePreskinned) },
+  { "ui.vs", "ui.fs", kNoShaderFeatures },
+  { "smaa_edges.vs", "smaa_edges_luma.fs", kNoShaderFeatures },
+  { "smaa_weights.vs", "smaa_weights.fs", kNoShaderFeatures },
+  { "smaa_blend.vs", "smaa_blend.fs", kNoShaderFeatures },
+  { "occlusion_box.vs", "occlusion_box.fs", kNoShaderFeatures },
+};
 
-struct ShaderCompileResult {
-  GLuint shader = 0;
-  bool success = false;
-  std::string log;
-  std::string processed_source;
+// Vertex shaders whose outputs are captured with transform feedback, and the outputs to
+// capture (interleaved, in this order).
+const std::map<std::string, std::vector<const char*>> kTransformFeedbackVaryings = {
+  { "skin.vs", { "skinned_position", "skinned_normal", "skinned_tangent" } },
 };
 
 void PrintSourceWithLineNumbers(const std::string& source) {
@@ -34,195 +66,465 @@ void PrintSourceWithLineNumbers(const std::string& source) {
   LOG_ERROR("Processed source:\n%", ss_out.str());
 }
 
-std::string Replace(const std::string& s, const std::string& search,
-                    const std::string& replace) {
-  std::string::size_type pos = 0;
-  std::string ret = s;
-  while ((pos = ret.find(search, pos)) != std::string::npos) {
-    ret.replace(pos, search.size(), replace);
-    pos += replace.size();
-  }
+// #defines for the features, one per line.
+std::string FeatureDefines(ShaderFeatures features) {
+  std::string ret;
+  #define ShaderFeature(name, define) \
+    if (features & kShaderFeature ## name) { \
+      ret += "#define " #define "\n"; \
+    }
+  SHADER_FEATURES
+  #undef ShaderFeature
   return ret;
 }
 
-ShaderCompileResult CompileShader(GLenum shader_type, 
-                                  const std::string& source) {
-  ShaderCompileResult result;
-  result.success = false;
-
-  result.shader = glCreateShader(shader_type);
-  if (result.shader == 0) {
-    result.log = "Failed to create shader. Invalid type?";
-    return result;
+// Shader files (including included files) are only read once.
+const std::string& ShaderFileSource(const std::string& file_name) {
+  static std::unordered_map<std::string, std::string> cache;
+  auto it = cache.find(file_name);
+  if (it == cache.end()) {
+    try {
+      it = cache.insert(std::make_pair(file_name, ReadWholeFileString(std::string(kShaderPrefix) + file_name))).first;
+    } catch (const std::runtime_error& e) {
+      LOG_ERROR("Failed to read shader file %: %", file_name, e.what());
+      throw;
+    }
   }
+  return it->second;
+}
 
-  std::string source_proc = source;
+bool StartsWith(std::string_view s, std::string_view prefix) {
+  return s.substr(0, prefix.size()) == prefix;
+}
 
-  std::map<std::string, std::string> replacements;
+// A shader with includes resolved, split at the end of the #version line so defines can be
+// added there.
+struct PreprocessedShader {
+  std::string version_line;
+  std::string body;
+};
 
-  #ifdef USE_OPENGL
-  // GLSL ES 3.0 is based on GLSL 3.3.
-  replacements["#version 300 es"] = "#version 330";
-  #endif
+// Single pass preprocessor for #include (recursive, with #pragma once). #line directives are
+// added so compiler errors refer to the original files. Each file gets a source string number
+// (listed at the top of the body), which is what compilers print in error messages.
+class ShaderPreprocessor {
+ public:
+  PreprocessedShader Process(const std::string& file_name) {
+    ProcessFile(file_name, /*depth=*/0);
+
+    if (result_.version_line.empty()) {
+      LOG_ERROR("% has no #version", file_name);
+      throw std::runtime_error(file_name + " has no #version");
+    }
+
+    std::string file_list;
+    for (std::size_t i = 0; i < files_.size(); ++i) {
+      file_list += "// Source string " + std::to_string(i) + ": " + files_[i] + "\n";
+    }
+    result_.body.insert(0, file_list);
+    return std::move(result_);
+  }
 
-  const char* kIncludePattern = R"""(#include\s"(.+)")""";
-  std::regex include_regex(kIncludePattern);
+ private:
+  constexpr static int kMaxIncludeDepth = 16;
 
-  auto includes_begin = std::sregex_iterator(
-      source_proc.begin(), source_proc.end(), include_regex);
-  for (auto match = includes_begin; match != std::sregex_iterator(); ++match) {
-    replacements[match->str()] = ReadWholeFileString(std::string(kShaderPrefix) + match->str(1));
+  void ProcessFile(const std::string& file_name, int depth) {
+    if (once_files_.find(file_name) != once_files_.end()) {
+      return;
+    }
+
+    if (depth > kMaxIncludeDepth) {
+      LOG_ERROR("Includes nested too deeply at % (recursive include?)", file_name);
+      throw std::runtime_error("Includes nested too deeply at " + file_name);
+    }
+
+    const std::string& source = ShaderFileSource(file_name);
+    std::size_t file_number = files_.size();
+    files_.push_back(file_name);
+    result_.body.reserve(result_.body.size() + source.size());
+
+    std::string_view rest = source;
+    int line_number = 0;
+    bool need_line_directive = true;
+    while (!rest.empty()) {
+      std::size_t line_end = rest.find('\n');
+      std::string_view line = rest.substr(0, line_end);
+      rest = line_end == std::string_view::npos ? std::string_view() : rest.substr(line_end + 1);
+      ++line_number;
+
+      std::string_view directive = line.substr(std::min(line.find_first_not_of(" \t"), line.size()));
+
+      if (StartsWith(directive, "#version")) {
+        if (depth != 0 || !result_.version_line.empty()) {
+          LOG_ERROR("%:%: #version must be the first line of the main file", file_name, line_number);
+          throw std::runtime_error("Unexpected #version in " + file_name);
+        }
+        result_.version_line = line;
+        #ifdef USE_OPENGL
+        // GLSL ES 3.0 is based on GLSL 3.3.
+        if (StartsWith(directive, "#version 300 es")) {
+          result_.version_line = "#version 330";
+        }
+        #endif
+        need_line_directive = true;
+        continue;
+      }
+
+      if (StartsWith(directive, "#pragma once")) {
+        once_files_.insert(file_name);
+        need_line_directive = true;
+        continue;
+      }
+
+      if (StartsWith(directive, "#include")) {
+        std::size_t name_begin = directive.find('"');
+        std::size_t name_end = directive.rfind('"');
+        if (name_begin == std::string_view::npos || name_end == name_begin) {
+          LOG_ERROR("%:%: malformed #include", file_name, line_number);
+          throw std::runtime_error("Malformed #include in " + file_name);
+        }
+        ProcessFile(std::string(directive.substr(name_begin + 1, name_end - name_begin - 1)), depth + 1);
+        need_line_directive = true;
+        continue;
+      }
+
+      if (need_line_directive) {
+        result_.body += "#line " + std::to_string(line_number) + " " + std::to_string(file_number) + "\n";
+        need_line_directive = false;
+      }
+      result_.body += line;
+      result_.body += '\n';
+    }
   }
 
-  for (const auto& [find, replace] : replacements) {
-    source_proc = Replace(source_proc, find, replace);
+  PreprocessedShader result_;
+  std::vector<std::string> files_;
+  std::unordered_set<std::string> once_files_;
+};
+
+// Resolves includes, and adds defines right after #version. Only defines differ between
+// variants, so each file is only preprocessed once.
+std::string PreprocessShader(const std::string& file_name, const std::string& defines) {
+  static std::unordered_map<std::string, PreprocessedShader> cache;
+  auto it = cache.find(file_name);
+  if (it == cache.end()) {
+    it = cache.insert(std::make_pair(file_name, ShaderPreprocessor().Process(file_name))).first;
   }
+  const PreprocessedShader& preprocessed = it->second;
+
+  std::string ret;
+  ret.reserve(preprocessed.version_line.size() + 1 + defines.size() + preprocessed.body.size());
+  ret += preprocessed.version_line;
+  ret += '\n';
+  ret += defines;
+  ret += preprocessed.body;
+  return ret;
+}
 
-  result.processed_source = source_proc;
+// Starts compiling a shader. Drivers may compile in the background, so the result is only
+// checked when the program is finished.
+GLuint SubmitShader(GLenum shader_type, const std::string& source_proc) {
+  GLuint shader = glCreateShader(shader_type);
+  if (shader == 0) {
+    LOG_ERROR("Failed to create shader. Invalid type?");
+    throw std::runtime_error("Failed to create shader. Invalid type?");
+  }
 
   const char* source_cstr = source_proc.c_str();
-  glShaderSource(result.shader, 1, &source_cstr, nullptr);
-  glCompileShader(result.shader);
-  
+  glShaderSource(shader, 1, &source_cstr, nullptr);
+  glCompileShader(shader);
+  return shader;
+}
+
+void CheckShaderCompiled(GLuint shader, const std::string& file_name, const std::string& source_proc) {
   GLint compiled;
-  glGetShaderiv(result.shader, GL_COMPILE_STATUS, &compiled);
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
   
   if (!compiled) {
     GLint shader_log_len;
-    glGetShaderiv(result.shader, GL_INFO_LOG_LENGTH, &shader_log_len);
-    result.log.resize(shader_log_len);
-    glGetShaderInfoLog(result.shader, shader_log_len, nullptr,
-                       &result.log[0]);
-    glDeleteShader(result.shader);
-    result.shader = 0;
-    return result;
+    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &shader_log_len);
+    std::string log(shader_log_len, '\0');
+    glGetShaderInfoLog(shader, shader_log_len, nullptr, &log[0]);
+    LOG_ERROR("Compilation of % failed:\n%", file_name, log);
+    PrintSourceWithLineNumbers(source_proc);
+    throw std::runtime_error(
+        "Shader compilation failed: "s + log);
   }
-  
-  result.success = true;
-  return result;
 }
-} // namespace
 
-/*static*/ GLuint ShaderProgram::current_program_ = 0;
+// With KHR_parallel_shader_compile, drivers compile and link on background threads, and we
+// can poll for completion without blocking.
+bool HaveParallelShaderCompile() {
+  static bool have = [] {
+    if (!SDL_GL_ExtensionSupported("GL_KHR_parallel_shader_compile")) {
+      return false;
+    }
 
-ShaderProgram::ShaderProgram(const std::string& vertex_shader_file_name,
-                             const std::string& fragment_shader_file_name) 
-  : vertex_shader_file_name_(vertex_shader_file_name),
-    fragment_shader_file_name_(fragment_shader_file_name) {
-  std::ifstream vertex_file(std::string(kShaderPrefix) + vertex_shader_file_name);
-  std::ifstream fragment_file(std::string(kShaderPrefix) + fragment_shader_file_name);
-
-  if (!vertex_file) {
-    LOG_ERROR("Failed to open vertex shader file: %", vertex_shader_file_name);
-    throw std::runtime_error("Failed to open vertex shader file: "s
-                             + vertex_shader_file_name);
+    #ifndef __EMSCRIPTEN__
+    // Let the driver use as many threads as it likes (WebGL doesn't have this function).
+    using MaxShaderCompilerThreadsFn = void (APIENTRY *)(GLuint);
+    auto max_shader_compiler_threads = reinterpret_cast<MaxShaderCompilerThreadsFn>(
+        SDL_GL_GetProcAddress("glMaxShaderCompilerThreadsKHR"));
+    if (max_shader_compiler_threads) {
+      max_shader_compiler_threads(0xFFFFFFFF);
+    }
+    #endif
+
+    LOG_INFO("Using KHR_parallel_shader_compile");
+    return true;
+  }();
+  return have;
+}
+
+// Linked program binaries are cached on disk, so warm starts don't need to compile anything.
+// WebGL doesn't expose program binaries, and some drivers support no binary formats at all.
+bool ProgramCacheSupported() {
+  #ifdef __EMSCRIPTEN__
+  return false;
+  #else
+  static bool supported = [] {
+    GLint num_formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+    if (num_formats == 0) {
+      LOG_INFO("No program binary formats supported. Shader program cache disabled.");
+      return false;
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(kProgramCacheDir, ec);
+    if (ec) {
+      LOG_WARN("Failed to create %: %. Shader program cache disabled.", kProgramCacheDir, ec.message());
+      return false;
+    }
+    return true;
+  }();
+  return supported;
+  #endif
+}
+
+// Binaries are only valid for the driver that produced them, so the driver strings are part
+// of the key. Features are already in the processed sources as #defines.
+uint64_t ProgramCacheKey(const std::string& vertex_shader_source_proc,
+                         const std::string& fragment_shader_source_proc) {
+  static const std::string driver_string = [] {
+    auto gl_string = [](GLenum name) {
+      const GLubyte* s = glGetString(name);
+      return s ? std::string(reinterpret_cast<const char*>(s)) : std::string();
+    };
+    return gl_string(GL_VENDOR) + ";" + gl_string(GL_RENDERER) + ";" + gl_string(GL_VERSION);
+  }();
+  return Fnv1a64(std::to_string(kProgramCacheVersion) + ";" + driver_string + ";" +
+                 vertex_shader_source_proc + ";" + fragment_shader_source_proc);
+}
+
+std::string ProgramCachePath(uint64_t key) {
+  std::stringstream ss;
+  ss << kProgramCacheDir << std::hex << std::setw(16) << std::setfill('0') << key << ".bin";
+  return ss.str();
+}
+
+// Cache files are a ProgramCacheHeader followed by the binary.
+struct ProgramCacheHeader {
+  uint64_t key;
+  uint32_t version;
+  GLenum binary_format;
+  uint32_t binary_size;
+};
+
+// Returns whether the program was successfully loaded (and linked) from the cache.
+bool LoadCachedProgram(GLuint program, uint64_t key) {
+  std::string path = ProgramCachePath(key);
+  if (!std::filesystem::exists(path)) {
+    return false;
   }
 
-  if (!fragment_file) {
-    LOG_ERROR("Failed to open fragment shader file: %",
-              fragment_shader_file_name);
-    throw std::runtime_error(
-        "Failed to open fragment shader file: "s +
-        vertex_shader_file_name);
+  std::vector<std::uint8_t> data;
+  try {
+    data = ReadWholeFile(path);
+  } catch (const std::runtime_error& e) {
+    LOG_WARN("Failed to read cached program: %", e.what());
+    return false;
+  }
+
+  ProgramCacheHeader header;
+  if (data.size() < sizeof(header)) {
+    return false;
+  }
+  std::memcpy(&header, data.data(), sizeof(header));
+  if (header.version != kProgramCacheVersion || header.key != key ||
+      header.binary_size != data.size() - sizeof(header)) {
+    return false;
   }
 
-  std::string vertex_shader_source;
-  std::string fragment_shader_source;
+  glProgramBinary(program, header.binary_format, data.data() + sizeof(header), header.binary_size);
 
-  std::string line;
-  while (std::getline(vertex_file, line)) {
-    vertex_shader_source = vertex_shader_source + line + "\n";
+  // This fails if the driver has changed in a way that isn't reflected in the version strings.
+  GLint linked;
+  glGetProgramiv(program, GL_LINK_STATUS, &linked);
+  if (!linked) {
+    LOG_INFO("Cached program % rejected by driver", path);
+    return false;
   }
+  return true;
+}
 
-  while (std::getline(fragment_file, line)) {
-    fragment_shader_source = fragment_shader_source + line + "\n";
+void SaveCachedProgram(GLuint program, uint64_t key) {
+  GLint binary_size = 0;
+  glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &binary_size);
+  if (binary_size <= 0) {
+    return;
   }
 
+  ProgramCacheHeader header;
+  header.version = kProgramCacheVersion;
+  header.key = key;
+  header.binary_size = binary_size;
+
+  std::string data(sizeof(header) + binary_size, '\0');
+  GLsizei length = 0;
+  glGetProgramBinary(program, binary_size, &length, &header.binary_format, &data[sizeof(header)]);
+  if (length != binary_size) {
+    LOG_WARN("Failed to retrieve program binary");
+    return;
+  }
+  std::memcpy(&data[0], &header, sizeof(header));
+
+  try {
+    WriteWholeFileString(ProgramCachePath(key), data);
+  } catch (const std::runtime_error& e) {
+    LOG_WARN("Failed to write cached program: %", e.what());
+  }
+}
+} // namespace
+
+/*static*/ GLuint ShaderProgram::current_program_ = 0;
+
+ShaderProgram::ShaderProgram(const std::string& vertex_shader_file_name,
+                             const std::string& fragment_shader_file_name,
+                             ShaderFeatures features) 
+  : vertex_shader_file_name_(vertex_shader_file_name),
+    fragment_shader_file_name_(fragment_shader_file_name),
+    features_(features),
+    vertex_shader_(0),
+    fragment_shader_(0),
+    finished_(false) {
   program_ = glCreateProgram();
   if (program_ == 0) {
     LOG_ERROR("Failed to create program object.");
     throw std::runtime_error("Failed to create program object.");
   }
 
-  LOG_INFO("Compiling % (vertex shader)", vertex_shader_file_name);
-  auto compile_result = CompileShader(GL_VERTEX_SHADER,
-                                      vertex_shader_source);
-  if (HaveDebugFolder()) {
-    WriteWholeFileString("debug/"s + vertex_shader_file_name, compile_result.processed_source);
-  }
-  if (compile_result.success) {
-    glAttachShader(program_, compile_result.shader);
-    vertex_shader_ = compile_result.shader;
-  } else {
-    LOG_ERROR("Compilation failed:\n%", compile_result.log);
-    PrintSourceWithLineNumbers(compile_result.processed_source);
-    throw std::runtime_error(
-        "Shader compilation failed: "s + compile_result.log);
-  }
+  std::string defines = FeatureDefines(features);
+  std::string vertex_shader_source_proc = PreprocessShader(vertex_shader_file_name, defines);
+  std::string fragment_shader_source_proc = PreprocessShader(fragment_shader_file_name, defines);
 
-  LOG_INFO("Compiling % (fragment shader)", fragment_shader_file_name);
-  compile_result = CompileShader(GL_FRAGMENT_SHADER, fragment_shader_source);
   if (HaveDebugFolder()) {
-    WriteWholeFileString("debug/"s + fragment_shader_file_name, compile_result.processed_source);
+    // Variants are distinguished by feature bits in debug output.
+    std::string debug_prefix = features == kNoShaderFeatures ? "debug/"s : "debug/"s + std::to_string(features) + "_";
+    WriteWholeFileString(debug_prefix + vertex_shader_file_name, vertex_shader_source_proc);
+    WriteWholeFileString(debug_prefix + fragment_shader_file_name, fragment_shader_source_proc);
   }
 
-  if (compile_result.success) {
-    glAttachShader(program_, compile_result.shader);
-    fragment_shader_ = compile_result.shader;
+  use_cache_ = ProgramCacheSupported();
+  cache_key_ = use_cache_ ? ProgramCacheKey(vertex_shader_source_proc, fragment_shader_source_proc) : 0;
+
+  if (use_cache_ && LoadCachedProgram(program_, cache_key_)) {
+    LOG_INFO("Loaded % + % (features %) from program cache", vertex_shader_file_name,
+             fragment_shader_file_name, features);
+    Finish();
   } else {
-    LOG_ERROR("Compilation failed:\n%", compile_result.log);
-    PrintSourceWithLineNumbers(compile_result.processed_source);
-    throw std::runtime_error(
-        "Shader compilation failed: "s + compile_result.log);
+    // Kept for error messages until the program is finished.
+    vertex_shader_source_proc_ = std::move(vertex_shader_source_proc);
+    fragment_shader_source_proc_ = std::move(fragment_shader_source_proc);
+    SubmitCompileAndLink();
   }
+}
 
-  glLinkProgram(program_);
-  GLint linked;
-  glGetProgramiv(program_, GL_LINK_STATUS, &linked);
-  if (!linked) {
-    GLint log_length;
-    glGetProgramiv(program_, GL_INFO_LOG_LENGTH, &log_length);
-
-    if (log_length > 1) {
-      std::string link_log(log_length, '\0');
-      glGetProgramInfoLog(program_, log_length, nullptr, &link_log[0]);
-      LOG_ERROR("Shader program linking failed: %", link_log);
-      throw std::runtime_error(
-          "Shader program linking failed: "s + link_log);
-    }
+bool ShaderProgram::IsReady() {
+  if (finished_ || !HaveParallelShaderCompile()) {
+    return true;
   }
+  GLint completed = GL_FALSE;
+  glGetProgramiv(program_, GL_COMPLETION_STATUS_KHR, &completed);
+  return completed == GL_TRUE;
 }
 
-GLint ShaderProgram::GetUniformLocation(const NameLiteral& name) {
-  auto it = uniform_locations_cache_.find(name);
-
-  if (it == uniform_locations_cache_.end()) {
-    auto loc = glGetUniformLocation(program_, name.Ptr());
+void ShaderProgram::Finish() {
+  if (finished_) {
+    return;
+  }
 
-    constexpr bool kCheckShaderActive = false;
-    if (kCheckShaderActive && loc == -1) {
-      LOG_ERROR("% is not an active uniform in (%, %)", name,
-                vertex_shader_file_name_, fragment_shader_file_name_);
-      throw std::runtime_error("GetUniformLocation failed.");
+  // Loaded from cache if there are no shader objects.
+  if (vertex_shader_ != 0) {
+    CheckShaderCompiled(vertex_shader_, vertex_shader_file_name_, vertex_shader_source_proc_);
+    CheckShaderCompiled(fragment_shader_, fragment_shader_file_name_, fragment_shader_source_proc_);
+
+    GLint linked;
+    glGetProgramiv(program_, GL_LINK_STATUS, &linked);
+    if (!linked) {
+      GLint log_length;
+      glGetProgramiv(program_, GL_INFO_LOG_LENGTH, &log_length);
+
+      if (log_length > 1) {
+        std::string link_log(log_length, '\0');
+        glGetProgramInfoLog(program_, log_length, nullptr, &link_log[0]);
+        LOG_ERROR("Shader program linking failed: %", link_log);
+        throw std::runtime_error(
+            "Shader program linking failed: "s + link_log);
+      }
     }
 
-    if (loc == GL_INVALID_VALUE) {
-      LOG_ERROR("Invalid shader program (%, %)",
-                vertex_shader_file_name_, fragment_shader_file_name_);
-      throw std::runtime_error("GetUniformLocation failed.");
+    if (use_cache_) {
+      SaveCachedProgram(program_, cache_key_);
     }
 
-    if (loc == GL_INVALID_OPERATION) {
-      LOG_ERROR("Shader program has not been successfully linked (%, %)",
-                vertex_shader_file_name_, fragment_shader_file_name_);
-      throw std::runtime_error("GetUniformLocation failed.");
+    vertex_shader_source_proc_.clear();
+    vertex_shader_source_proc_.shrink_to_fit();
+    fragment_shader_source_proc_.clear();
+    fragment_shader_source_proc_.shrink_to_fit();
+  }
+
+  // GLSL ES 3.00 doesn't support layout(binding = ...), so we have to bind uniform blocks here.
+  constexpr std::pair<const char*, GLuint> kUniformBlockBindings[] = {
+    { "PerFrame", kPerFrameUniformBinding },
+    { "PerPass", kPerPassUniformBinding },
+  };
+  for (const auto& [block_name, binding] : kUniformBlockBindings) {
+    GLuint block_index = glGetUniformBlockIndex(program_, block_name);
+    if (block_index != GL_INVALID_INDEX) {
+      glUniformBlockBinding(program_, block_index, binding);
     }
+  }
 
-    uniform_locations_cache_.insert({name, loc});
-    return loc;
-  } else {
-    return it->second;
+  // Resolve all uniform locations now, so we never have to look them up while rendering.
+  for (std::size_t id = 0; id < kNumUniformNames; ++id) {
+    uniform_locations_[id] = glGetUniformLocation(program_, kUniformNames[id]);
+  }
+
+  finished_ = true;
+}
+
+void ShaderProgram::SubmitCompileAndLink() {
+  // Sets up parallel compilation before the first compile.
+  HaveParallelShaderCompile();
+
+  LOG_INFO("Compiling % + % (features %)", vertex_shader_file_name_, fragment_shader_file_name_, features_);
+  vertex_shader_ = SubmitShader(GL_VERTEX_SHADER, vertex_shader_source_proc_);
+  glAttachShader(program_, vertex_shader_);
+  fragment_shader_ = SubmitShader(GL_FRAGMENT_SHADER, fragment_shader_source_proc_);
+  glAttachShader(program_, fragment_shader_);
+
+  auto varyings_it = kTransformFeedbackVaryings.find(vertex_shader_file_name_);
+  if (varyings_it != kTransformFeedbackVaryings.end()) {
+    const std::vector<const char*>& varyings = varyings_it->second;
+    glTransformFeedbackVaryings(program_, varyings.size(), varyings.data(), GL_INTERLEAVED_ATTRIBS);
+  }
+
+  // Must be set before linking for glGetProgramBinary() to work.
+  if (use_cache_) {
+    glProgramParameteri(program_, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
   }
+
+  glLinkProgram(program_);
 }
 
 ShaderProgram::~ShaderProgram() {
@@ -244,19 +546,80 @@ ShaderProgram::~ShaderProgram() {
   }
 }
 
-ShaderProgram* GetShader(
+ShaderProgram* ShaderVariants::Get(ShaderFeatures features) {
+  auto it = variants_.find(features);
+  if (it != variants_.end()) {
+    return it->second;
+  } else {
+    ShaderProgram* program = new ShaderProgram(vertex_shader_file_name_,
+                                               fragment_shader_file_name_, features);
+    auto insert_result = variants_.insert(std::make_pair(features, program));
+    return insert_result.first->second;
+  }
+}
+
+ShaderVariants* GetShaderVariants(
   const std::string& vertex_shader_file_name,
   const std::string& fragment_shader_file_name) {
   std::string lookup_key =
     vertex_shader_file_name + ";" + fragment_shader_file_name;
-  static std::map<std::string, ShaderProgram*> shader_cache;
+  static std::map<std::string, ShaderVariants*> shader_cache;
   auto it = shader_cache.find(lookup_key);
   if (it != shader_cache.end()) {
     return it->second;
   } else {
-    ShaderProgram* program = new ShaderProgram(vertex_shader_file_name,
-                                               fragment_shader_file_name);
-    auto insert_result = shader_cache.insert(std::make_pair(lookup_key, program));
+    ShaderVariants* variants = new ShaderVariants(vertex_shader_file_name,
+                                                  fragment_shader_file_name);
+    auto insert_result = shader_cache.insert(std::make_pair(lookup_key, variants));
     return insert_result.first->second;
   }
-}
\ No newline at end of file
+}
+
+ShaderProgram* GetShader(
+  const std::string& vertex_shader_file_name,
+  const std::string& fragment_shader_file_name,
+  ShaderFeatures features) {
+  return GetShaderVariants(vertex_shader_file_name, fragment_shader_file_name)->Get(features);
+}
+
+void WarmUpShaders(ShaderFeatures features) {
+  uint64_t start_time = GetTimeUs();
+
+  // Submit everything before waiting for anything, so drivers can compile in parallel.
+  std::vector<ShaderProgram*> pending;
+  for (const auto& entry : kShaderManifest) {
+    ShaderVariants* variants = GetShaderVariants(entry.vertex_shader_file_name,
+                                                 entry.fragment_shader_file_name);
+    ShaderFeatures variant_features = entry.features & features;
+
+    // Iterate over all subsets of variant_features.
+    for (ShaderFeatures subset = variant_features;; subset = (subset - 1) & variant_features) {
+      pending.push_back(variants->Get(subset));
+      if (subset == 0) {
+        break;
+      }
+    }
+  }
+  std::size_t num_programs = pending.size();
+
+  #ifdef __EMSCRIPTEN__
+  // Browsers only update completion status between tasks, so waiting here would never end.
+  // Programs are finished on first use instead, by which time most should be compiled.
+  LOG_INFO("Submitted % shader programs in % ms", num_programs, (GetTimeUs() - start_time) / 1000);
+  #else
+  // Finish programs in the order they complete. Without KHR_parallel_shader_compile everything
+  // is ready, and this just waits for each in turn.
+  while (!pending.empty()) {
+    auto ready_begin = std::partition(pending.begin(), pending.end(),
+                                      [](ShaderProgram* program) { return !program->IsReady(); });
+    for (auto it = ready_begin; it != pending.end(); ++it) {
+      (*it)->Finish();
+    }
+    pending.erase(ready_begin, pending.end());
+    if (!pending.empty()) {
+      SDL_Delay(1);
+    }
+  }
+  LOG_INFO("Warmed up % shader programs in % ms", num_programs, (GetTimeUs() - start_time) / 1000);
+  #endif
+}
@@ -0,0 +1,92 @@
+#include "simulation.h"
+
+#include <algorithm>
+#include <chrono>
+#include <utility>
+
+#include "utils.h"
+
+namespace {
+constexpr static uint64_t kSimulationStepUs = 1000000 / 30;
+
+// If the simulation falls further behind than this (eg. the process was suspended), skip ahead
+// instead of running all the steps missed.
+constexpr static uint64_t kMaxLagUs = 250000;
+}
+
+Simulation::Simulation(std::vector<Actor>* actors) : actors_(actors) {}
+
+Simulation::~Simulation() {
+  done_ = true;
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+void Simulation::Start() {
+  Step(GetTimeUs());
+  #ifndef __EMSCRIPTEN__
+  thread_ = std::thread(&Simulation::Run, this);
+  #endif
+}
+
+void Simulation::ApplySnapshot(uint64_t time_us) {
+  #ifdef __EMSCRIPTEN__
+  Step(time_us);
+  #endif
+
+  if (snapshots_.HasPublished()) {
+    // The slot we have goes back to the simulation thread, so keep the latest snapshot out of it.
+    std::swap(previous_, *snapshots_.ReadSlot());
+    snapshots_.Take();
+  }
+
+  const WorldSnapshot& latest = *snapshots_.ReadSlot();
+  const WorldSnapshot* from = &previous_;
+  float t = 1.0f;
+
+  #ifdef __EMSCRIPTEN__
+  // Stepped just now, so there's nothing to wait for.
+  from = &latest;
+  #else
+  if (previous_.actors.size() != latest.actors.size() || latest.time_us <= previous_.time_us) {
+    from = &latest;
+  } else {
+    // One step behind, so we are always between two snapshots if the simulation keeps up.
+    double render_time_us = static_cast<double>(time_us) - kSimulationStepUs;
+    t = (render_time_us - previous_.time_us) / (latest.time_us - previous_.time_us);
+    t = std::clamp(t, 0.0f, 1.0f);
+  }
+  #endif
+
+  std::size_t index = 0;
+  for (auto& actor : *actors_) {
+    index = actor.ApplySnapshots(from->actors, latest.actors, index, t);
+  }
+}
+
+void Simulation::Step(uint64_t time_us) {
+  WorldSnapshot* snapshot = snapshots_.WriteSlot();
+  snapshot->time_us = time_us;
+  std::size_t index = 0;
+  for (auto& actor : *actors_) {
+    actor.Update(time_us);
+    index = actor.WriteSnapshots(&snapshot->actors, index);
+  }
+  snapshot->actors.resize(index);
+  snapshots_.Publish();
+}
+
+void Simulation::Run() {
+  uint64_t next_step_us = GetTimeUs();
+  while (!done_) {
+    next_step_us += kSimulationStepUs;
+    uint64_t now = GetTimeUs();
+    if (next_step_us > now) {
+      std::this_thread::sleep_for(std::chrono::microseconds(next_step_us - now));
+    } else if ((now - next_step_us) > kMaxLagUs) {
+      next_step_us = now;
+    }
+    Step(next_step_us);
+  }
+}
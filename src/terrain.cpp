@@ -16,6 +16,9 @@ namespace {
 constexpr static float kHexRingOffset = kGridSize * 0.07f;
 constexpr static int kMapSize = 15;
 
+// We use 16-bit indices.
+constexpr static std::size_t kMaxVertices = 65536;
+
 static constexpr const char* kTerrainPathPrefix = "assets/art/terrains/";
 
 TextureSet* TerrainTextureSet(const std::string& path) {
@@ -33,8 +36,8 @@ TextureSet* TerrainTextureSet(const std::string& path) {
   return &(it->second);
 }
 
-void DrawHex(const Hex& hex, std::vector<float>* positions, std::vector<GLuint>* indices) {
-  GLuint base_index = positions->size() / 3;
+void DrawHex(const Hex& hex, std::vector<float>* positions, std::vector<GLushort>* indices) {
+  GLushort base_index = positions->size() / 3;
 
   hex.ForEachVertex(kGridSize, kGridSize - kHexRingOffset, [&](const glm::vec2& vertex, int index) {
     (void) index;
@@ -51,8 +54,8 @@ void DrawHex(const Hex& hex, std::vector<float>* positions, std::vector<GLuint>*
 }
 
 // Draw a ring around the hex.
-void DrawHexRing(const Hex& hex, std::vector<float>* positions, std::vector<GLuint>* indices, bool is_outside) {
-  GLuint base_index = positions->size() / 3;
+void DrawHexRing(const Hex& hex, std::vector<float>* positions, std::vector<GLushort>* indices, bool is_outside) {
+  GLushort base_index = positions->size() / 3;
 
   // As an optimization we only draw half the ring for inner hexs (there is still some extra drawing).
   hex.ForEachVertex(kGridSize, kGridSize + kHexRingOffset, [&](const glm::vec2& vertex, int index) {
@@ -73,7 +76,7 @@ void DrawHexRing(const Hex& hex, std::vector<float>* positions, std::vector<GLui
 
   // 12 triangles for outer ring, 6 for inside.
   if (is_outside) {
-    constexpr static GLuint offsets[] = {
+    constexpr static GLushort offsets[] = {
       0, 1, 7, 0, 7, 6, 1, 2, 8, 8, 7, 1, 8, 2, 9, 2, 3, 9,
       3, 10, 9, 3, 4, 10, 10, 4, 11, 4, 5, 11, 11, 5, 6, 5, 0, 6,
     };
@@ -82,7 +85,7 @@ void DrawHexRing(const Hex& hex, std::vector<float>* positions, std::vector<GLui
       indices->push_back(base_index + offset);
     }
   } else {
-    constexpr static GLuint offsets[] = {
+    constexpr static GLushort offsets[] = {
       0, 1, 5, 0, 5, 4, 1, 2, 6, 6, 5, 1, 6, 2, 7, 2, 3, 7
     };
 
@@ -95,7 +98,7 @@ void DrawHexRing(const Hex& hex, std::vector<float>* positions, std::vector<GLui
 }
 
 Terrain::Terrain() : 
-    shader_(nullptr),
+    shader_variants_(nullptr),
     initialized_(false),
     vao_id_(0),
     num_indices_(0),
@@ -117,9 +120,9 @@ void Terrain::Render(RenderContext* context) {
     Hex origin;
 
     std::vector<float> positions;
-    std::vector<GLuint> indices;
+    std::vector<GLushort> indices;
     std::vector<float> edge_positions;
-    std::vector<GLuint> edge_indices;
+    std::vector<GLushort> edge_indices;
 
     for (int i = 0; i < kMapSize; ++i) {
       origin.ForEachHexAtDist(i, [&](const Hex& hex) {
@@ -128,6 +131,10 @@ void Terrain::Render(RenderContext* context) {
       });
     }
 
+    if (positions.size() / 3 > kMaxVertices || edge_positions.size() / 3 > kMaxVertices) {
+      throw std::runtime_error("Map too large for 16-bit indices");
+    }
+
     vao_id_ = Renderer::MakeVAO({
       Renderer::VBOSpec(positions, 0, GL_FLOAT, 3),
     },
@@ -140,12 +147,7 @@ void Terrain::Render(RenderContext* context) {
     Renderer::EBOSpec(edge_indices));
     edges_num_indices_ = edge_indices.size();
 
-    shader_ = GetShader("terrain.vs", "terrain.fs");
-    shader_->Activate();
-
-    // Each 0ad tile is 2m x 2m, and a terrain texture is supposed to span 11x11 tiles.
-    // https://trac.wildfiregames.com/wiki/ArtDesignDocument#TerrainTextures
-    shader_->SetUniform("texture_scale"_name, (1.0f / 22.0f));
+    shader_variants_ = GetShaderVariants("terrain.vs", "terrain.fs");
 
     std::size_t num_terrains = sizeof(kTestTerrainPaths) / sizeof(kTestTerrainPaths[0]);
     terrain_selection_ = Rand(0, num_terrains);
@@ -154,27 +156,24 @@ void Terrain::Render(RenderContext* context) {
     initialized_ = true;
   }
 
-  shader_->Activate();
-
-  SetLightParams(context, shader_);
+  TextureSet* textures = TerrainTextureSet(kTestTerrainPaths[terrain_selection_]);
 
-  // Graphics settings.
-  #define GraphicsSetting(upper, lower, type, default, toggle_key) \
-    shader_->SetUniform(NameLiteral(#lower), context->lower);
-  GRAPHICS_SETTINGS
-  #undef GraphicsSetting
+  ShaderProgram* shader = shader_variants_->Get(
+      context->shader_features & TextureManager::SupportedShaderFeatures(*textures));
+  shader->Activate();
+  SetShadowTextureUnits(shader);
 
-  TextureSet* textures = TerrainTextureSet(kTestTerrainPaths[terrain_selection_]);
-  TextureManager::GetInstance()->UseTextureSet(shader_, *textures);
+  // Each 0ad tile is 2m x 2m, and a terrain texture is supposed to span 11x11 tiles.
+  // https://trac.wildfiregames.com/wiki/ArtDesignDocument#TerrainTextures
+  shader->SetUniform("texture_scale"_name, (1.0f / 22.0f));
 
-  glm::mat4 mvp = context->projection * context->view;
-  shader_->SetUniform("mvp"_name, mvp);
+  TextureManager::GetInstance()->UseTextureSet(shader, *textures);
 
-  shader_->SetUniform("is_edge"_name, 0);
+  shader->SetUniform("is_edge"_name, 0);
   Renderer::UseVAO(vao_id_);
-  glDrawElements(GL_TRIANGLES, num_indices_, GL_UNSIGNED_INT, (const void*) 0);
+  glDrawElements(GL_TRIANGLES, num_indices_, GL_UNSIGNED_SHORT, (const void*) 0);
 
-  shader_->SetUniform("is_edge"_name, 1);
+  shader->SetUniform("is_edge"_name, 1);
   Renderer::UseVAO(edges_vao_id_);
-  glDrawElements(GL_TRIANGLES, edges_num_indices_, GL_UNSIGNED_INT, (const void*) 0);
+  glDrawElements(GL_TRIANGLES, edges_num_indices_, GL_UNSIGNED_SHORT, (const void*) 0);
 }
@@ -1,7 +1,14 @@
 #include "texture_manager.h"
 
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <thread>
+
 #include "lodepng/lodepng.h"
 
+#include "texture_arrays_generated.h"
+
 #include "utils.h"
 
 namespace {
@@ -10,16 +17,58 @@ static constexpr const char* kTexturePathPrefix = "assets/art/textures/";
 // This is an unused texture unit used for loading and setting texture params.
 // Number of texture units must be at least 32.
 static constexpr const GLenum kUnusedTextureUnit = 31;
+
+// Texture data uploaded per frame is limited to this (except that at least one texture is
+// always uploaded, however large), so a burst of new textures is spread over several frames.
+static constexpr std::size_t kUploadBudgetBytesPerFrame = 8 * 1024 * 1024;
+
+static constexpr int kMaxDecodeThreads = 4;
+
+// Textures used this recently are never evicted, so we don't thrash when everything visible
+// doesn't fit in the budget.
+static constexpr uint64_t kMinFramesBeforeEviction = 60;
+
+uint32_t PlaceholderColour(TexturePlaceholder placeholder) {
+  // RGBA bytes, little endian.
+  switch (placeholder) {
+    case TexturePlaceholder::kNormal: return 0xffff8080;
+    case TexturePlaceholder::kSpecular: return 0xff000000;
+    case TexturePlaceholder::kBase:
+    case TexturePlaceholder::kAO:
+    default: return 0xff808080;
+  }
+}
+}
+
+TextureManager::TextureManager() {
+  GLint num_formats = 0;
+  glGetIntegerv(GL_NUM_COMPRESSED_TEXTURE_FORMATS, &num_formats);
+  std::vector<GLint> formats(num_formats);
+  if (num_formats > 0) {
+    glGetIntegerv(GL_COMPRESSED_TEXTURE_FORMATS, formats.data());
+  }
+  auto supported = [&formats](GLenum format) {
+    return std::find(formats.begin(), formats.end(), static_cast<GLint>(format)) != formats.end();
+  };
+  etc2_supported_ = supported(GL_COMPRESSED_RGBA8_ETC2_EAC) && supported(GL_COMPRESSED_RG11_EAC);
+  LOG_INFO("ETC2/EAC textures %", etc2_supported_ ? "supported" : "not supported, using PNG");
+
+  LoadTextureArrays();
+
+  #ifndef __EMSCRIPTEN__
+  // Leave a core for the render thread.
+  int num_threads = std::clamp(static_cast<int>(std::thread::hardware_concurrency()) - 1, 1, kMaxDecodeThreads);
+  decode_pool_ = std::make_unique<ThreadPool>(num_threads);
+  decode_pool_->Run();
+  #endif
 }
 
 GLuint TextureFromMemory(int width, int height, GLint internal_format,
                          GLenum format, GLenum type, const uint8_t* data) {
-  glActiveTexture(GL_TEXTURE0 + kUnusedTextureUnit);
-  CHECK_GL_ERROR;
   GLuint texture_id;
   glGenTextures(1, &texture_id);
   CHECK_GL_ERROR;
-  glBindTexture(GL_TEXTURE_2D, texture_id);
+  TextureManager::GetInstance()->BindTextureForEditing(texture_id);
   CHECK_GL_ERROR;
   glTexImage2D(GL_TEXTURE_2D, /*level=*/0, internal_format, width, height,
                /*border=*/0, format, type, data);
@@ -32,57 +81,481 @@ GLuint TextureFromMemory(int width, int height, GLint internal_format,
   return texture_id;
 }
 
-void TextureManager::BindTexture(const std::string& texture_name, GLenum texture_unit) {
-  glActiveTexture(texture_unit);
-  auto it = texture_cache_.find(texture_name);
-  if (it == texture_cache_.end()) {
-    GLuint texture_id;
-    glGenTextures(1, &texture_id);
-    CHECK_GL_ERROR;
-    glBindTexture(GL_TEXTURE_2D, texture_id);
-    CHECK_GL_ERROR;
+void TextureManager::LoadTextureArrays() {
+  std::string path = std::string(kTexturePathPrefix) + "texture_arrays.fb";
+  if (!std::filesystem::exists(path)) {
+    LOG_INFO("No texture arrays, textures will be bound individually");
+    return;
+  }
+  std::vector<uint8_t> raw_buffer = ReadWholeFile(path);
+  const data::TextureArrays* texture_arrays = data::GetTextureArrays(raw_buffer.data());
+  if (!texture_arrays->arrays()) {
+    return;
+  }
+  for (const data::TextureArray* texture_array : *texture_arrays->arrays()) {
+    std::vector<std::string>& layer_files = texture_arrays_[texture_array->name()->str()];
+    for (const auto* layer_file : *texture_array->layers()) {
+      layer_files.push_back(layer_file->str());
+    }
+  }
+  LOG_INFO("% texture arrays loaded", texture_arrays_.size());
+}
+
+TextureHandle TextureManager::GetTextureHandle(const std::string& texture_name, TexturePlaceholder placeholder) {
+  auto it = texture_handles_.find(texture_name);
+  if (it == texture_handles_.end()) {
+    TextureHandle handle = static_cast<TextureHandle>(textures_.size());
+    ResidentTexture texture;
+    texture.name = texture_name;
+    texture.placeholder = placeholder;
+    auto array_it = texture_arrays_.find(texture_name);
+    if (array_it != texture_arrays_.end()) {
+      texture.layer_files = array_it->second;
+    } else {
+      texture.layer_files.push_back(texture_name);
+    }
+    textures_.push_back(std::move(texture));
+    it = texture_handles_.insert(std::make_pair(texture_name, handle)).first;
+  }
+  return it->second;
+}
 
-    texture_cache_.insert(std::make_pair(texture_name, texture_id));
+void TextureManager::BindTexture(TextureHandle handle, GLenum texture_unit) {
+  ResidentTexture& texture = textures_[static_cast<uint32_t>(handle)];
+  if (texture.texture_id == 0) {
+    StartLoading(handle);
+  } else if (!texture.streaming && !texture.level_bytes.empty() && texture.base_level > 0) {
+    // Top levels were dropped to stay within the memory budget, and we need them again.
+    texture.streaming = true;
+    StartDecode(handle);
+  }
+  texture.last_used_frame = frame_;
+  BindToUnit(texture.texture_id, texture_unit, GL_TEXTURE_2D_ARRAY);
+}
 
-    std::string png_path = std::string(kTexturePathPrefix) + texture_name + ".png";
-    std::vector<uint8_t> image_data;
-    uint32_t width, height;
-    uint32_t error = lodepng::decode(image_data, width, height, png_path.c_str());
+void TextureManager::StartLoading(TextureHandle handle) {
+  ResidentTexture& texture = textures_[static_cast<uint32_t>(handle)];
+  glGenTextures(1, &texture.texture_id);
+  CHECK_GL_ERROR;
+  BindTextureForEditing(texture.texture_id, GL_TEXTURE_2D_ARRAY);
+  CHECK_GL_ERROR;
+
+  // The placeholder lives in the same texture object as the real image will. It only has one
+  // layer, so all layers sample it (layer indices are clamped).
+  uint32_t placeholder_colour = PlaceholderColour(texture.placeholder);
+  glTexImage3D(GL_TEXTURE_2D_ARRAY, /*level=*/0, /*internalFormat=*/GL_RGBA, /*width=*/1, /*height=*/1,
+               /*depth=*/1, 0, GL_RGBA, GL_UNSIGNED_BYTE, &placeholder_colour);
+  CHECK_GL_ERROR;
+
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, 0);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
 
+  if (!texture.failed) {
+    texture.streaming = true;
+    StartDecode(handle);
+  }
+}
+
+void TextureManager::StartDecode(TextureHandle handle) {
+  // Workers don't touch textures_, which can be reallocated.
+  const ResidentTexture& texture = textures_[static_cast<uint32_t>(handle)];
+  std::vector<std::string> layer_files = texture.layer_files;
+  TexturePlaceholder placeholder = texture.placeholder;
+  #ifdef __EMSCRIPTEN__
+  DecodeTexture(layer_files, placeholder, handle);
+  #else
+  decode_pool_->Push([this, layer_files, placeholder, handle]() { DecodeTexture(layer_files, placeholder, handle); });
+  #endif
+}
+
+void TextureManager::DecodeTexture(const std::vector<std::string>& layer_files, TexturePlaceholder placeholder,
+                                   TextureHandle handle) {
+  DecodedTexture decoded;
+  decoded.handle = handle;
+  bool loaded = false;
+
+  if (etc2_supported_) {
+    // Either all layers are compressed, or we use PNGs for all of them.
+    std::vector<DecodedTexture> layers(layer_files.size());
+    loaded = true;
+    for (std::size_t i = 0; i < layer_files.size() && loaded; ++i) {
+      std::string ktx_path = std::string(kTexturePathPrefix) + layer_files[i] + ".ktx";
+      loaded = std::filesystem::exists(ktx_path) && LoadKtx(ktx_path, &layers[i]);
+    }
+    loaded = loaded && StackLayers(layers, &decoded);
+  }
+
+  if (!loaded) {
+    std::vector<DecodedTexture> layers(layer_files.size());
+    std::vector<bool> layer_loaded(layer_files.size());
+    int reference = -1;
+    for (std::size_t i = 0; i < layer_files.size(); ++i) {
+      layer_loaded[i] = LoadPng(layer_files[i], &layers[i]);
+      if (layer_loaded[i] && reference < 0) {
+        reference = i;
+      }
+    }
+
+    if (reference < 0) {
+      // The placeholder stays. We still hand back the (empty) result, so Update() knows we
+      // are done with the texture.
+      LOG_ERROR("Failed to decode texture % (% layers)", layer_files.empty() ? "" : layer_files[0], layer_files.size());
+      std::lock_guard<std::mutex> lock(decoded_textures_mutex_);
+      decoded_textures_.push_back(std::move(decoded));
+      return;
+    }
+
+    // Layers we can't use are filled with the placeholder colour, so the rest of the array
+    // can still be used.
+    const DecodedTexture::Level& reference_level_0 = layers[reference].levels[0];
+    uint32_t placeholder_colour = PlaceholderColour(placeholder);
+    for (std::size_t i = 0; i < layers.size(); ++i) {
+      if (layer_loaded[i] && layers[i].levels[0].width == reference_level_0.width &&
+          layers[i].levels[0].height == reference_level_0.height) {
+        continue;
+      }
+      if (layer_loaded[i]) {
+        LOG_ERROR("% is not the same size as the other layers of its texture array", layer_files[i]);
+      }
+      layers[i].levels = layers[reference].levels;
+      layers[i].data.resize(layers[reference].data.size());
+      for (std::size_t offset = 0; offset < layers[i].data.size(); offset += sizeof(placeholder_colour)) {
+        memcpy(&layers[i].data[offset], &placeholder_colour, sizeof(placeholder_colour));
+      }
+    }
+
+    StackLayers(layers, &decoded);
+  }
+
+  std::lock_guard<std::mutex> lock(decoded_textures_mutex_);
+  decoded_textures_.push_back(std::move(decoded));
+}
+
+/*static*/ bool TextureManager::LoadPng(const std::string& texture_name, DecodedTexture* decoded) {
+  // Level 0 is in the usual place, and make_assets writes the other levels to separate files.
+  std::string base_path = std::string(kTexturePathPrefix) + texture_name;
+  for (int level = 0; ; ++level) {
+    std::string level_path = level == 0 ? (base_path + ".png") : (base_path + "_mip" + std::to_string(level) + ".png");
+    if (level > 0) {
+      const DecodedTexture::Level& previous = decoded->levels.back();
+      if ((previous.width == 1 && previous.height == 1) || !std::filesystem::exists(level_path)) {
+        break;
+      }
+    }
+
+    std::vector<uint8_t> pixels;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t error = lodepng::decode(pixels, width, height, level_path.c_str());
     if (error) {
-      LOG_ERROR("Failed to load texture file %: %", texture_name, lodepng_error_text(error));
+      LOG_ERROR("Failed to load texture file %: %", level_path, lodepng_error_text(error));
+      if (level == 0) {
+        return false;
+      }
+      break;
+    }
+
+    if (level > 0 && (width != std::max(decoded->levels[0].width >> level, 1u) ||
+                      height != std::max(decoded->levels[0].height >> level, 1u))) {
+      LOG_ERROR("% has the wrong size for level %", level_path, level);
+      break;
+    }
+
+    decoded->levels.push_back(DecodedTexture::Level{width, height, decoded->data.size(), pixels.size()});
+    decoded->data.insert(decoded->data.end(), pixels.begin(), pixels.end());
+  }
+  return true;
+}
+
+/*static*/ bool TextureManager::StackLayers(const std::vector<DecodedTexture>& layers, DecodedTexture* decoded) {
+  const DecodedTexture& first = layers[0];
+  std::size_t num_levels = first.levels.size();
+  for (const DecodedTexture& layer : layers) {
+    // Levels are halved from the same size, so they all match if level 0 does.
+    if (layer.compressed_format != first.compressed_format ||
+        layer.levels[0].width != first.levels[0].width || layer.levels[0].height != first.levels[0].height) {
+      return false;
+    }
+    num_levels = std::min(num_levels, layer.levels.size());
+  }
+
+  decoded->compressed_format = first.compressed_format;
+  decoded->num_layers = layers.size();
+  decoded->levels.clear();
+  decoded->data.clear();
+  for (std::size_t level = 0; level < num_levels; ++level) {
+    DecodedTexture::Level stacked{first.levels[level].width, first.levels[level].height, decoded->data.size(), 0};
+    for (const DecodedTexture& layer : layers) {
+      const DecodedTexture::Level& layer_level = layer.levels[level];
+      auto begin = layer.data.begin() + layer_level.offset;
+      decoded->data.insert(decoded->data.end(), begin, begin + layer_level.size);
+      stacked.size += layer_level.size;
+    }
+    decoded->levels.push_back(stacked);
+  }
+  return true;
+}
+
+/*static*/ bool TextureManager::LoadKtx(const std::string& path, DecodedTexture* decoded) {
+  static constexpr uint8_t kKtxIdentifier[12] = {
+    0xab, 'K', 'T', 'X', ' ', '1', '1', 0xbb, '\r', '\n', 0x1a, '\n'
+  };
+
+  // Header fields after the identifier, all uint32.
+  enum KtxHeaderField {
+    kEndianness, kGlType, kGlTypeSize, kGlFormat, kGlInternalFormat, kGlBaseInternalFormat,
+    kPixelWidth, kPixelHeight, kPixelDepth, kNumberOfArrayElements, kNumberOfFaces,
+    kNumberOfMipmapLevels, kBytesOfKeyValueData, kNumHeaderFields
+  };
+
+  std::vector<uint8_t> file = ReadWholeFile(path);
+  auto read_uint32 = [&file](std::size_t offset) {
+    uint32_t value;
+    memcpy(&value, &file[offset], sizeof(value));
+    return value;
+  };
+
+  std::size_t header_size = sizeof(kKtxIdentifier) + kNumHeaderFields * sizeof(uint32_t);
+  if (file.size() < header_size || memcmp(file.data(), kKtxIdentifier, sizeof(kKtxIdentifier)) != 0) {
+    LOG_ERROR("% is not a KTX file", path);
+    return false;
+  }
+  auto header = [&](KtxHeaderField field) { return read_uint32(sizeof(kKtxIdentifier) + field * sizeof(uint32_t)); };
+
+  // make_assets writes little endian files, and we don't run anywhere else.
+  if (header(kEndianness) != 0x04030201) {
+    LOG_ERROR("% has unexpected endianness", path);
+    return false;
+  }
+  GLenum format = header(kGlInternalFormat);
+  if ((format != GL_COMPRESSED_RGBA8_ETC2_EAC && format != GL_COMPRESSED_RG11_EAC) ||
+      header(kPixelDepth) != 0 || header(kNumberOfArrayElements) != 0 || header(kNumberOfFaces) != 1) {
+    LOG_ERROR("% is not a supported KTX texture (format %)", path, format);
+    return false;
+  }
+
+  uint32_t width = header(kPixelWidth);
+  uint32_t height = header(kPixelHeight);
+  std::vector<DecodedTexture::Level> levels;
+
+  std::size_t offset = header_size + header(kBytesOfKeyValueData);
+  uint32_t num_levels = std::max(header(kNumberOfMipmapLevels), 1u);
+  for (uint32_t level = 0; level < num_levels; ++level) {
+    if (offset + sizeof(uint32_t) > file.size()) {
+      LOG_ERROR("% is truncated", path);
+      return false;
+    }
+    std::size_t size = read_uint32(offset);
+    offset += sizeof(uint32_t);
+    if (offset + size > file.size()) {
+      LOG_ERROR("% is truncated", path);
+      return false;
+    }
+    levels.push_back(DecodedTexture::Level{std::max(width >> level, 1u), std::max(height >> level, 1u), offset, size});
+    // Image data is padded to 4 bytes.
+    offset += (size + 3) & ~static_cast<std::size_t>(3);
+  }
+
+  decoded->compressed_format = format;
+  decoded->levels = std::move(levels);
+  decoded->data = std::move(file);
+  return true;
+}
+
+void TextureManager::Update() {
+  ++frame_;
+
+  {
+    std::lock_guard<std::mutex> lock(decoded_textures_mutex_);
+    for (DecodedTexture& decoded : decoded_textures_) {
+      // Textures that had their top levels dropped only need those levels.
+      const ResidentTexture& texture = textures_[static_cast<uint32_t>(decoded.handle)];
+      decoded.texture_id = texture.texture_id;
+      decoded.next_level = std::min(static_cast<int>(decoded.levels.size()), texture.base_level) - 1;
+      uploading_textures_.push_back(std::move(decoded));
+    }
+    decoded_textures_.clear();
+  }
+
+  // One level at a time, round robin, so all textures get their low resolution levels before
+  // any gets its high resolution levels.
+  std::size_t bytes_uploaded = 0;
+  while (!uploading_textures_.empty() && (bytes_uploaded == 0 || bytes_uploaded < kUploadBudgetBytesPerFrame)) {
+    DecodedTexture decoded = std::move(uploading_textures_.front());
+    uploading_textures_.pop_front();
+    ResidentTexture& texture = textures_[static_cast<uint32_t>(decoded.handle)];
+    if (decoded.next_level >= 0) {
+      int level = decoded.next_level;
+      std::size_t level_bytes = UploadNextLevel(&decoded);
+      if (texture.level_bytes.size() < decoded.levels.size()) {
+        texture.level_bytes.resize(decoded.levels.size());
+      }
+      resident_bytes_ += level_bytes - texture.level_bytes[level];
+      texture.level_bytes[level] = level_bytes;
+      texture.base_level = level;
+      bytes_uploaded += decoded.levels[level].size;
+    }
+    if (decoded.next_level >= 0) {
+      uploading_textures_.push_back(std::move(decoded));
+    } else {
+      texture.streaming = false;
+      texture.failed = texture.failed || decoded.levels.empty();
+    }
+  }
+
+  EvictToBudget();
+}
+
+void TextureManager::EvictToBudget() {
+  while (resident_bytes_ > memory_budget_) {
+    // Least recently used texture that is fully loaded and not in recent use. Textures with only
+    // the placeholder have nothing to free.
+    ResidentTexture* lru = nullptr;
+    for (ResidentTexture& texture : textures_) {
+      if (texture.texture_id == 0 || texture.streaming || texture.level_bytes.empty() ||
+          (texture.last_used_frame + kMinFramesBeforeEviction) > frame_) {
+        continue;
+      }
+      if (!lru || texture.last_used_frame < lru->last_used_frame) {
+        lru = &texture;
+      }
+    }
+
+    if (!lru) {
+      // Everything is in use. We'll just have to go over.
       return;
     }
 
-    glTexImage2D(GL_TEXTURE_2D, /*level=*/0, /*internalFormat=*/GL_RGBA, width, height,
-                 0, GL_RGBA, GL_UNSIGNED_BYTE, image_data.data());
-    CHECK_GL_ERROR;
+    if (lru->base_level + 1 < static_cast<int>(lru->level_bytes.size())) {
+      // Drop the top level. Respecifying it with no data frees its memory, and it's outside
+      // the levels the texture uses now.
+      BindTextureForEditing(lru->texture_id, GL_TEXTURE_2D_ARRAY);
+      glTexImage3D(GL_TEXTURE_2D_ARRAY, lru->base_level, /*internalFormat=*/GL_RGBA, /*width=*/0, /*height=*/0,
+                   /*depth=*/0, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+      resident_bytes_ -= lru->level_bytes[lru->base_level];
+      lru->level_bytes[lru->base_level] = 0;
+      ++lru->base_level;
+      glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, lru->base_level);
+      CHECK_GL_ERROR;
+    } else {
+      // Only the smallest level left. Evict the whole texture. It will be streamed in again
+      // (with a placeholder) if it's used again.
+      for (std::size_t level_bytes : lru->level_bytes) {
+        resident_bytes_ -= level_bytes;
+      }
+      DeleteTexture(lru->texture_id);
+      lru->texture_id = 0;
+      lru->level_bytes.clear();
+      lru->base_level = std::numeric_limits<int>::max();
+    }
+  }
+}
+
+std::size_t TextureManager::UploadNextLevel(DecodedTexture* decoded) {
+  int level = decoded->next_level--;
+  const DecodedTexture::Level& level_data = decoded->levels[level];
+
+  BindTextureForEditing(decoded->texture_id, GL_TEXTURE_2D_ARRAY);
+
+  const uint8_t* pixels = decoded->data.data() + level_data.offset;
+
+  #ifndef __EMSCRIPTEN__
+  // Going through a PBO lets the driver copy the data to the GPU asynchronously, instead of
+  // blocking in glTexImage3D(). WebGL copies texture data synchronously either way, so there
+  // a PBO would just be another copy.
+  if (upload_pbo_ == 0) {
+    glGenBuffers(1, &upload_pbo_);
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload_pbo_);
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 12); // Our largest textures are 2^12
+  // Respecifying the buffer orphans the previous upload's storage, so we don't wait for it.
+  glBufferData(GL_PIXEL_UNPACK_BUFFER, level_data.size, pixels, GL_STREAM_DRAW);
+  pixels = nullptr; // Offset into the PBO.
+  #endif
 
-    glGenerateMipmap(GL_TEXTURE_2D);
+  if (decoded->compressed_format == 0) {
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, level, /*internalFormat=*/GL_RGBA, level_data.width, level_data.height,
+                 decoded->num_layers, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
   } else {
-    glBindTexture(GL_TEXTURE_2D, it->second);
+    glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, level, decoded->compressed_format, level_data.width,
+                           level_data.height, decoded->num_layers, /*border=*/0, level_data.size, pixels);
   }
+
+  #ifndef __EMSCRIPTEN__
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  #endif
+  CHECK_GL_ERROR;
+
+  // Levels from this one down are all there, so the texture can be used from this level.
+  // Level 0 still has the placeholder until then, but it's outside the range so it doesn't
+  // matter.
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, level);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, decoded->levels.size() - 1);
+
+  if (decoded->levels.size() == 1 && (level_data.width > 1 || level_data.height > 1)) {
+    // Assets from before make_assets generated mips (or an array with a layer from before).
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 12); // Our largest textures are 2^12
+    glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+
+    // The generated levels take another third.
+    return level_data.size + level_data.size / 3;
+  }
+
+  return level_data.size;
 }
 
 void TextureManager::BindTexture(GLuint texture, GLenum texture_unit) {
-  if (texture_unit < GL_TEXTURE0) {
+  if (texture_unit < GL_TEXTURE0 || texture_unit >= (GL_TEXTURE0 + kNumTextureUnits)) {
     LOG_FATAL("Texture unit must be GL_TEXTURE0 + n");
   }
-  glActiveTexture(texture_unit);
-  glBindTexture(GL_TEXTURE_2D, texture);
+  ActivateTextureUnit(texture_unit);
+  BindToUnit(texture, texture_unit);
+}
+
+void TextureManager::BindTextureForEditing(GLuint texture, GLenum target) {
+  ActivateTextureUnit(GL_TEXTURE0 + kUnusedTextureUnit);
+  BindToUnit(texture, GL_TEXTURE0 + kUnusedTextureUnit, target);
+}
+
+void TextureManager::DeleteTexture(GLuint texture) {
+  // GL unbinds deleted textures, and the name can be reused.
+  for (auto* bindings : {&bound_textures_, &bound_texture_arrays_}) {
+    for (GLuint& bound_texture : *bindings) {
+      if (bound_texture == texture) {
+        bound_texture = 0;
+      }
+    }
+  }
+  glDeleteTextures(1, &texture);
+}
+
+void TextureManager::ActivateTextureUnit(GLenum texture_unit) {
+  if (texture_unit != active_texture_unit_) {
+    glActiveTexture(texture_unit);
+    active_texture_unit_ = texture_unit;
+  }
+}
+
+void TextureManager::BindToUnit(GLuint texture, GLenum texture_unit, GLenum target) {
+  // Each unit has separate 2D and 2D array bindings.
+  auto& bindings = target == GL_TEXTURE_2D_ARRAY ? bound_texture_arrays_ : bound_textures_;
+  GLuint& bound_texture = bindings[texture_unit - GL_TEXTURE0];
+  if (bound_texture != texture) {
+    ActivateTextureUnit(texture_unit);
+    glBindTexture(target, texture);
+    bound_texture = texture;
+  }
 }
 
 GLuint TextureManager::MakeColourTexture(int width, int height) {
-  glActiveTexture(GL_TEXTURE0);
   GLuint texture_id;
   glGenTextures(1, &texture_id);
   CHECK_GL_ERROR;
-  glBindTexture(GL_TEXTURE_2D, texture_id);
+  BindTextureForEditing(texture_id);
   CHECK_GL_ERROR;
   glTexImage2D(GL_TEXTURE_2D, /*level=*/0, /*internalFormat=*/GL_RGBA, width, height,
                0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
@@ -99,11 +572,10 @@ GLuint TextureManager::MakeColourTexture(int width, int height) {
 }
 
 GLuint TextureManager::MakeDepthTexture(int width, int height) {
-  glActiveTexture(GL_TEXTURE0);
   GLuint texture_id;
   glGenTextures(1, &texture_id);
   CHECK_GL_ERROR;
-  glBindTexture(GL_TEXTURE_2D, texture_id);
+  BindTextureForEditing(texture_id);
   CHECK_GL_ERROR;
   glTexImage2D(GL_TEXTURE_2D, /*level=*/0, /*internalFormat=*/GL_DEPTH_COMPONENT32F, width, height,
                0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
@@ -123,16 +595,14 @@ GLuint TextureManager::MakeDepthTexture(int width, int height) {
 }
 
 void TextureManager::ResizeColourTexture(GLuint texture_id, int width, int height) {
-  glActiveTexture(GL_TEXTURE0);
-  glBindTexture(GL_TEXTURE_2D, texture_id);
+  BindTextureForEditing(texture_id);
   glTexImage2D(GL_TEXTURE_2D, /*level=*/0, /*internalFormat=*/GL_RGBA, width, height,
                0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
   CHECK_GL_ERROR;
 }
 
 void TextureManager::ResizeDepthTexture(GLuint texture_id, int width, int height) {
-  glActiveTexture(GL_TEXTURE0);
-  glBindTexture(GL_TEXTURE_2D, texture_id);
+  BindTextureForEditing(texture_id);
   glTexImage2D(GL_TEXTURE_2D, /*level=*/0, /*internalFormat=*/GL_DEPTH_COMPONENT32F, width, height,
                0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
   CHECK_GL_ERROR;
@@ -149,18 +619,32 @@ TextureSet TextureManager::LoadTextures(const flatbuffers::Vector<flatbuffers::O
   for (const auto* texture : textures) {
     auto texture_name = texture->name()->str();
     auto texture_file = texture->file()->str();
+
+    // Textures not in an array (or in an array we don't know about, if texture_arrays.fb is
+    // out of date) are arrays of their own.
+    std::string array_name = texture_file;
+    float layer = 0.0f;
+    if (texture->array() && texture->layer() >= 0 && texture_arrays_.count(texture->array()->str())) {
+      array_name = texture->array()->str();
+      layer = texture->layer();
+    }
+
     if (texture_name == "baseTex") {
-      LOG_DEBUG("baseTex found: %", texture_file);
-      ret.base_texture = texture_file;
+      LOG_DEBUG("baseTex found: % (% layer %)", texture_file, array_name, layer);
+      ret.base_texture = GetTextureHandle(array_name, TexturePlaceholder::kBase);
+      ret.layers.x = layer;
     } else if (texture_name == "normTex") {
-      LOG_DEBUG("normTex found: %", texture_file);
-      ret.norm_texture = texture_file;
+      LOG_DEBUG("normTex found: % (% layer %)", texture_file, array_name, layer);
+      ret.norm_texture = GetTextureHandle(array_name, TexturePlaceholder::kNormal);
+      ret.layers.y = layer;
     } else if (texture_name == "specTex") {
-      LOG_DEBUG("specTex found: %", texture_file);
-      ret.spec_texture = texture_file;
+      LOG_DEBUG("specTex found: % (% layer %)", texture_file, array_name, layer);
+      ret.spec_texture = GetTextureHandle(array_name, TexturePlaceholder::kSpecular);
+      ret.layers.z = layer;
     } else if (texture_name == "aoTex") {
-      LOG_DEBUG("aoTex found: %", texture_file);
-      ret.ao_texture = texture_file;
+      LOG_DEBUG("aoTex found: % (% layer %)", texture_file, array_name, layer);
+      ret.ao_texture = GetTextureHandle(array_name, TexturePlaceholder::kAO);
+      ret.layers.w = layer;
     }
   }
   return ret;
@@ -170,24 +654,35 @@ void TextureManager::UseTextureSet(ShaderProgram* shader, const TextureSet& text
   BindTexture(textures.base_texture, GL_TEXTURE0);
   shader->SetUniform("base_texture"_name, 0);
 
-  if (!textures.spec_texture.empty()) {
-    TextureManager::GetInstance()->BindTexture(textures.spec_texture, GL_TEXTURE1);
+  // Missing textures are handled by SupportedShaderFeatures() (the shader doesn't sample them).
+  if (textures.spec_texture != kNoTexture) {
+    BindTexture(textures.spec_texture, GL_TEXTURE1);
     shader->SetUniform("spec_texture"_name, 1);
-  } else {
-    shader->SetUniform("use_specular_highlight"_name, 0);
   }
 
-  if (!textures.norm_texture.empty()) {
-    TextureManager::GetInstance()->BindTexture(textures.norm_texture, GL_TEXTURE2);
+  if (textures.norm_texture != kNoTexture) {
+    BindTexture(textures.norm_texture, GL_TEXTURE2);
     shader->SetUniform("norm_texture"_name, 2);
-  } else {
-    shader->SetUniform("use_normal_map"_name, 0);
   }
 
-  if (!textures.ao_texture.empty()) {
-    TextureManager::GetInstance()->BindTexture(textures.ao_texture, GL_TEXTURE3);
+  if (textures.ao_texture != kNoTexture) {
+    BindTexture(textures.ao_texture, GL_TEXTURE3);
     shader->SetUniform("ao_texture"_name, 3);
-  } else {
-    shader->SetUniform("use_ao_map"_name, 0);
   }
+
+  shader->SetUniform("texture_layers"_name, textures.layers);
+}
+
+/*static*/ ShaderFeatures TextureManager::SupportedShaderFeatures(const TextureSet& textures) {
+  ShaderFeatures ret = kAllShaderFeatures;
+  if (textures.spec_texture == kNoTexture) {
+    ret &= ~kShaderFeatureSpecularHighlight;
+  }
+  if (textures.norm_texture == kNoTexture) {
+    ret &= ~kShaderFeatureNormalMap;
+  }
+  if (textures.ao_texture == kNoTexture) {
+    ret &= ~kShaderFeatureAOMap;
+  }
+  return ret;
 }
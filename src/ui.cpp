@@ -43,7 +43,7 @@ void UI::Render(RenderContext* context) {
     positions.push_back(1.0f); positions.push_back(0.0f); // v2
     positions.push_back(1.0f); positions.push_back(1.0f); // v3
 
-    std::vector<GLuint> indices;
+    std::vector<GLushort> indices;
     indices.push_back(0); indices.push_back(1); indices.push_back(2);
     indices.push_back(3); indices.push_back(2); indices.push_back(1);
 
@@ -143,10 +143,10 @@ void UI::DrawImage(SDL_Surface* surface, float x, float y, float w, float h) {
   }
 
   shader_->SetUniform("base_texture"_name, 0);
-  shader_->SetUniform("xywh", glm::vec4(x, y, w, h));
-  shader_->SetUniform("tex_xywh", glm::vec4(
+  shader_->SetUniform("xywh"_name, glm::vec4(x, y, w, h));
+  shader_->SetUniform("tex_xywh"_name, glm::vec4(
       0.0f, 0.0f, static_cast<float>(surface->w) / kGpuTextureWidth, static_cast<float>(surface->h) / kGpuTextureHeight));
 
   Renderer::UseVAO(vao_id_);
-  glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, (const void*) 0);
+  glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, (const void*) 0);
 }